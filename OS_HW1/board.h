@@ -0,0 +1,119 @@
+/*
+ * OS Assignment #1
+ *
+ * Status board of procman, shared with procstat.
+ *
+ * procman maps a file (by default /dev/shm/procman.<pid>) holding a
+ * BoardHeader and one BoardRecord per task, each on its own cache line,
+ * and is the only writer.  A record is guarded by a seqlock: 'seq' is odd
+ * while the record is being written, so a reader which saw an odd 'seq',
+ * or a different one after copying, copies again.  Readers never write,
+ * and procman never waits for them.
+ */
+
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <sched.h>
+
+#define BOARD_MAGIC   0x44524f42
+#define BOARD_VERSION 2
+#define BOARD_LINE    64
+#define BOARD_ID_LEN  16
+
+typedef struct _BoardHeader BoardHeader;
+struct _BoardHeader
+{
+  unsigned int       magic;
+  unsigned int       version;
+  unsigned int       record_size;
+  unsigned int       count;         /* records in use or free below this */
+  int                pid;
+  long long          start_time;    /* CLOCK_REALTIME ns */
+} __attribute__ ((aligned (BOARD_LINE)));
+
+typedef union _BoardId BoardId;
+union _BoardId
+{
+  char               str[BOARD_ID_LEN];
+  unsigned long long words[BOARD_ID_LEN / 8];
+};
+
+typedef struct _BoardRecord BoardRecord;
+struct _BoardRecord
+{
+  unsigned int       seq;
+  int                state;         /* TaskState of procman, -1 if free */
+  int                pid;
+  int                restarts;
+  int                exit_status;   /* wait status of the last run, -1 */
+  BoardId            id;
+  long long          spawn_time;    /* CLOCK_REALTIME ns of the last spawn */
+  long long          uptime;        /* ns, of the finished runs only */
+  long long          queue_delay;   /* ns the last spawn waited for admission */
+} __attribute__ ((aligned (BOARD_LINE)));
+
+#define BOARD_RECORDS(h) ((BoardRecord *) ((char *) (h) + sizeof (BoardHeader)))
+
+/* every field but 'seq', as relaxed atomics since the other side races. */
+static inline void
+board_copy (BoardRecord       *dst,
+            const BoardRecord *src)
+{
+  int i;
+
+#define COPY(f) __atomic_store_n (&dst->f, __atomic_load_n (&src->f, __ATOMIC_RELAXED), __ATOMIC_RELAXED)
+  COPY (state);
+  COPY (pid);
+  COPY (restarts);
+  COPY (exit_status);
+  for (i = 0; i < BOARD_ID_LEN / 8; i++)
+    COPY (id.words[i]);
+  COPY (spawn_time);
+  COPY (uptime);
+  COPY (queue_delay);
+#undef COPY
+}
+
+/* single writer. */
+static inline void
+board_write (BoardRecord       *record,
+             const BoardRecord *value)
+{
+  unsigned int seq;
+
+  seq = __atomic_load_n (&record->seq, __ATOMIC_RELAXED);
+  __atomic_store_n (&record->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  board_copy (record, value);
+  __atomic_store_n (&record->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* consistent copy of 'record', returns the number of retries. */
+static inline int
+board_read (const BoardRecord *record,
+            BoardRecord       *value)
+{
+  unsigned int seq;
+  int          retries;
+
+  for (retries = 0; ; retries++)
+    {
+      seq = __atomic_load_n (&record->seq, __ATOMIC_ACQUIRE);
+      if (!(seq & 1))
+        {
+          board_copy (value, record);
+          __atomic_thread_fence (__ATOMIC_ACQUIRE);
+          if (__atomic_load_n (&record->seq, __ATOMIC_RELAXED) == seq)
+            break;
+        }
+      /* the writer may be preempted in the middle of a record. */
+      if ((retries & 63) == 63)
+        sched_yield ();
+    }
+  value->seq = seq;
+
+  return retries;
+}
+
+#endif /* BOARD_H */
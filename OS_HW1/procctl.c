@@ -0,0 +1,179 @@
+/*
+ * OS Assignment #1 Control Client.
+ *
+ * Sends requests to the control socket of a running procman and prints
+ * the answers.  With a command on the command line it sends that one,
+ * otherwise every line of stdin, all over one connection:
+ *
+ *   procctl <pid> restart 'web*'
+ *   procctl <pid> scale wk 32
+ *   procctl <pid> upgrade
+ *   printf 'stop a*\nstart b1 b2\nstatus\n' | procctl <pid>
+ *
+ * Exits with 1 if any request failed.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MSG(x...) fprintf (stderr, x)
+#define STRERROR  strerror (errno)
+
+static int
+write_all (int         fd,
+           const char *buf,
+           size_t      len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = write (fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return -1;
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+static int
+send_requests (int    fd,
+               int    argc,
+               char **argv)
+{
+  char    buf[65536];
+  ssize_t len;
+  int     i;
+
+  if (argc > 0)
+    {
+      for (i = 0; i < argc; i++)
+        if (write_all (fd, argv[i], strlen (argv[i]))
+            || write_all (fd, i + 1 < argc ? " " : "\n", 1))
+          return -1;
+      return 0;
+    }
+
+  while ((len = read (STDIN_FILENO, buf, sizeof (buf))) != 0)
+    {
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 || write_all (fd, buf, len))
+        return -1;
+    }
+
+  return 0;
+}
+
+/* answers go to stdout, errors to stderr. */
+static int
+print_answers (int fd)
+{
+  char    buf[65536];
+  char   *line;
+  char   *end;
+  size_t  pos;
+  ssize_t len;
+  int     failed;
+
+  failed = 0;
+  pos = 0;
+  for (;;)
+    {
+      len = read (fd, buf + pos, sizeof (buf) - 1 - pos);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0)
+        return -1;
+      if (len == 0)
+        break;
+
+      pos += len;
+      line = buf;
+      while ((end = memchr (line, '\n', buf + pos - line)))
+        {
+          *end = '\0';
+          if (!strncmp (line, "error ", 6))
+            {
+              MSG ("%s\n", line + 6);
+              failed = 1;
+            }
+          else
+            printf ("%s\n", line);
+          line = end + 1;
+        }
+      pos -= line - buf;
+      memmove (buf, line, pos);
+
+      /* a line longer than the buffer goes out as it is. */
+      if (pos == sizeof (buf) - 1)
+        {
+          fwrite (buf, 1, pos, stdout);
+          pos = 0;
+        }
+    }
+
+  return failed;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  struct sockaddr_un addr;
+  char              *end;
+  int                failed;
+  int                fd;
+
+  if (argc < 2)
+    {
+      MSG ("usage: %s pid | control-socket [command [args...]]\n", argv[0]);
+      return -1;
+    }
+
+  /* a pid stands for the default socket of that procman. */
+  memset (&addr, 0x00, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strtol (argv[1], &end, 10);
+  if (*end == '\0')
+    snprintf (addr.sun_path, sizeof (addr.sun_path), "/tmp/procman.%s.sock",
+              argv[1]);
+  else
+    snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", argv[1]);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)))
+    {
+      MSG ("failed to connect to '%s': %s\n", addr.sun_path, STRERROR);
+      return -1;
+    }
+
+  if (send_requests (fd, argc - 2, argv + 2))
+    {
+      MSG ("failed to send requests: %s\n", STRERROR);
+      return -1;
+    }
+  shutdown (fd, SHUT_WR);
+
+  failed = print_answers (fd);
+  if (failed < 0)
+    {
+      MSG ("failed to read answers: %s\n", STRERROR);
+      return -1;
+    }
+  close (fd);
+
+  return failed;
+}
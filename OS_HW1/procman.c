@@ -2,68 +2,789 @@
  * OS Assignment #1
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#include <fnmatch.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <spawn.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/sched.h>
+
+#include "board.h"
+#include "trace.h"
+#include "zygote.h"
 
 #define MSG(x...) fprintf (stderr, x)
 #define STRERROR  strerror (errno)
 
 #define ID_MIN 2
 #define ID_MAX 8
+#define TASK_ID_MAX (ID_MAX + 5)       /* with '.<replica>' */
+#define REPLICAS_MAX 10000
 #define COMMAND_LEN 256
+#define LISTEN_MAX 8
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+/* glibc 2.41 can spawn right into a cgroup, older ones need clone3(). */
+#ifdef POSIX_SPAWN_SETCGROUP
+#define SPAWN_CGROUP 1
+#else
+#define SPAWN_CGROUP 0
+#endif
 
 typedef enum
 {
   ACTION_ONCE,
   ACTION_RESPAWN,
+  ACTION_INTERVAL,
+  ACTION_CALENDAR,
 
 } Action;
 
+/* of a scheduled run due while the last one is still going. */
+typedef enum
+{
+  OVERRUN_SKIP,
+  OVERRUN_QUEUE,
+  OVERRUN_KILL,
+
+} Overrun;
+
+typedef enum
+{
+  READY_SPAWN,
+  READY_NOTIFY,
+
+} Ready;
+
+typedef enum
+{
+  TASK_WAITING,
+  TASK_STARTING,
+  TASK_RUNNING,
+  TASK_EXITED,
+  TASK_FAILED,
+  TASK_BACKOFF,
+  TASK_QUARANTINED,
+  TASK_STOPPED,
+  TASK_SCHEDULED,
+  TASK_DEFERRED,
+
+} TaskState;
+
+/*
+ * The minutes a 'calendar' task runs at, from a cron line "minute hour
+ * day month weekday" in local time, see calendar_next().
+ */
+typedef struct _Calendar Calendar;
+struct _Calendar
+{
+  unsigned long long minutes;   /* a bit per minute, 0-59 */
+  unsigned long long hours;     /* 0-23 */
+  unsigned long long days;      /* 1-31 */
+  unsigned long long months;    /* 1-12 */
+  unsigned long long weekdays;  /* 0-6 from sunday */
+  int                either_day;  /* neither days nor weekdays is '*' */
+};
+
+/* cgroup v2 limits of a task, see cgroup_limits[]. */
+typedef enum
+{
+  LIMIT_CPU_MAX,
+  LIMIT_CPU_WEIGHT,
+  LIMIT_MEMORY_MAX,
+  LIMIT_IO_WEIGHT,
+  LIMIT_COUNT
+
+} Limit;
+
+/* placement of a task, see task_places[]. */
+typedef enum
+{
+  PLACE_CPUS,
+  PLACE_NUMA,
+  PLACE_NICE,
+  PLACE_IOPRIO,
+  PLACE_SCHED,
+  PLACE_COUNT
+
+} Place;
+
+/*
+ * Event loop.
+ *
+ * Every fd procman waits on is a Watch registered in one epoll instance,
+ * and every deadline is a Timer in a hierarchical timing wheel behind one
+ * timerfd.  Level 0 has a slot per millisecond tick for the next 256,
+ * each of the 4 levels above 64 slots covering a wrap of the level below,
+ * up to 49 days out.  Starting and stopping a timer is O(1), and so is a
+ * tick: a timer moves down a level at most 4 times before it is due.
+ */
+typedef struct _Watch Watch;
+typedef void (*WatchFunc) (Watch *watch, unsigned int events);
+struct _Watch
+{
+  int            fd;
+  WatchFunc      func;
+  void          *data;
+};
+
+typedef struct _Timer Timer;
+typedef void (*TimerFunc) (Timer *timer);
+struct _Timer
+{
+  long long      expire;
+  long long      tick;          /* the first at or after 'expire' */
+  int            slot;
+  Timer         *next;
+  Timer        **pprev;         /* NULL if not pending */
+  TimerFunc      func;
+  void          *data;
+};
+
+#define WHEEL_TICK   1000000LL  /* ns */
+#define WHEEL_BITS0  8
+#define WHEEL_BITS   6
+#define WHEEL_LEVELS 5
+#define WHEEL_SLOTS0 (1 << WHEEL_BITS0)
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_SIZE   (WHEEL_SLOTS0 + (WHEEL_LEVELS - 1) * WHEEL_SLOTS)
+#define WHEEL_SPAN   ((1LL << (WHEEL_BITS0 + (WHEEL_LEVELS - 1) * WHEEL_BITS)) - 1)
+
+typedef struct _Wheel Wheel;
+struct _Wheel
+{
+  long long          tick;      /* the next one to run */
+  long long          armed;     /* tick the timerfd is set for, or -1 */
+  int                count;
+  Timer             *slots[WHEEL_SIZE];
+  unsigned long long used[WHEEL_SIZE / 64];  /* a bit per non-empty slot */
+};
+
 typedef struct _Task Task;
+typedef struct _Zygote Zygote;
+
+/*
+ * Output capture, with -l.
+ *
+ * Every task writes its stdout (unless piped) and stderr to a pipe of its
+ * own, which the event loop drains into the ring of its Log without ever
+ * blocking.  A writer thread appends the complete lines with a timestamp
+ * to '<log-dir>/<id>.log', rotated to '<id>.log.1' at 'log_max' bytes.
+ * A full ring only stops draining that pipe, so a chatty child blocks on
+ * its own pipe until the writer catches up, see drain_log().
+ */
+#define LOG_RING (64 * 1024)
+
+typedef struct _Log Log;
+struct _Log
+{
+  char           id[TASK_ID_MAX + 1];
+  char          *ring;
+  unsigned int   head;          /* advanced by the event loop */
+  unsigned int   tail;          /* advanced by the writer */
+  int            full;          /* draining stopped until the tail moves */
+  Task          *task;          /* event loop only, NULL once closed */
+
+  int            file;          /* writer only */
+  long long      size;
+
+  /* under 'log_lock'. */
+  int            queued;
+  int            resuming;
+  int            closed;
+  Log           *next;          /* on 'log_queue', then 'log_done' */
+  Log           *next_resume;   /* on 'log_resume' */
+};
+
+/*
+ * A loaded config, either the config file itself or its binary snapshot,
+ * mapped into memory.  Tasks refer to its strings instead of copies, and
+ * hold a reference so that it stays mapped across reloads.
+ */
+typedef struct _Config Config;
+struct _Config
+{
+  char          *data;
+  size_t         size;
+  char         **argv;          /* argv vectors of every task */
+  int            argv_len;
+  int            argv_max;
+  char         **paths;         /* name, resolved path pairs */
+  int            paths_len;
+  int            paths_max;
+  int            refs;
+};
+
+/*
+ * Binary snapshot of a config, '<config-file>.bin'.
+ *
+ * It holds the tasks which passed validation in launch order, and is used
+ * instead of parsing while 'hash' matches the config file and PATH.  The
+ * layout is the header, SnapshotTask[task_count], the argv table of
+ * string offsets (0 ends a vector), then the strings.  A string offset of
+ * 0 is NULL.  'notes' are the diagnostics of the parse, printed again on
+ * every load so that a snapshot does not hide a broken line.
+ */
+#define SNAPSHOT_MAGIC   0x42434d50
+#define SNAPSHOT_VERSION 10
+
+typedef struct _SnapshotHeader SnapshotHeader;
+struct _SnapshotHeader
+{
+  unsigned int       magic;
+  unsigned int       version;
+  unsigned long long hash;
+  unsigned int       task_size;
+  unsigned int       task_count;
+  unsigned int       argv_count;
+  unsigned int       strings_size;
+  unsigned int       notes;         /* string offset */
+};
+
+typedef struct _SnapshotTask SnapshotTask;
+struct _SnapshotTask
+{
+  char               id[TASK_ID_MAX + 1];
+  char               pipe_id[ID_MAX + 1];
+  int                order;
+  int                action;
+  int                ready;
+  int                piped;
+  int                consumers;
+  int                pipe_size;
+  int                overlap;
+  int                zygote;
+  int                replica;
+  int                replicas;
+  int                limit_burst;
+  int                quarantine_count;
+  long long          ready_timeout;
+  long long          backoff;
+  long long          backoff_max;
+  long long          stable;
+  long long          limit_period;
+  long long          quarantine_window;
+  long long          grace;
+  int                overrun;
+  int                priority;
+  long long          every;
+  long long          timeout;
+  Calendar           calendar;
+  unsigned int       argv;
+  unsigned int       path;
+  unsigned int       after;
+  unsigned int       requires;
+  unsigned int       input;
+  unsigned int       listen;
+  unsigned int       limits[LIMIT_COUNT];
+  unsigned int       places[PLACE_COUNT];
+};
+
+/*
+ * Pipelines.
+ *
+ * A task with 'input=id' reads the stdout of task 'id'.  procman holds
+ * the read end of the producer's stdout (Relay) and the write end of the
+ * stdin of every consumer (Edge), and moves the data between them with
+ * splice(), or tee() for fan-out, so it never goes through userspace.
+ */
+typedef struct _Relay Relay;
+typedef struct _Edge Edge;
+struct _Edge
+{
+  Relay         *relay;
+  Task          *consumer;
+  int            fd;            /* write end of the consumer's stdin */
+  int            closed;
+  int            ahead;         /* bytes already tee()d, see relay_data() */
+  Watch          watch;
+
+  long long      bytes;
+  long long      first;
+  long long      last;
+};
+
+struct _Relay
+{
+  Task          *producer;
+  int            fd;            /* read end of the producer's stdout */
+  int            hup;
+  Watch          watch;
+  Edge         **edges;
+  int            edges_len;
+};
+
+/* startup dependency edge, 'required' ones propagate start failures. */
+typedef struct _Dep Dep;
+struct _Dep
+{
+  Task          *task;
+  int            required;
+};
+
+/* the fds of a spawn, the child's ends are closed once it runs. */
+typedef struct _Spawn Spawn;
+struct _Spawn
+{
+  long long      start;
+  int            leaf;          /* cgroup leaf to clone into, or -1 */
+  int            output;
+  int            notify[2];
+  int            in[2];
+  int            out[2];
+};
+
 struct _Task
 {
-  Task          *next;
+  int            seq;
 
   volatile pid_t pid;
   int            piped;
   int            pipe_a[2];
   int            pipe_b[2];
+  int            notify_fd;
+  int            pidfd;
+  Watch          pid_watch;
+  Watch          notify_watch;
+  Timer          ready_timer;
+  long long      spawn_time;
+  long long      exit_time;     /* reported with STOPPING=1, or 0 */
 
-  char           id[ID_MAX + 1];
+  char           id[TASK_ID_MAX + 1];
   char           pipe_id[ID_MAX + 1];
   int            order;
   Action         action;
-  char           command[COMMAND_LEN];
+  Ready          ready;
+  long long      ready_timeout;
+
+  /* restart policy of 'respawn' tasks, durations in milliseconds. */
+  long long      backoff;
+  long long      backoff_max;
+  long long      stable;
+  int            limit_burst;
+  long long      limit_period;
+  int            quarantine_count;
+  long long      quarantine_window;
+  long long      grace;         /* SIGTERM to SIGKILL at shutdown, -1 for -g */
+  char          *after;
+  char          *requires;
+  char          *input;
+  int            consumers;
+  int            pipe_size;
+
+  /* all strings point into 'config', see read_config(). */
+  Config        *config;
+  char         **argv;
+  int            argv_index;
+  char          *path;          /* resolved argv[0], NULL to search PATH */
+  char          *limits[LIMIT_COUNT];  /* NULL for the default */
+  char          *places[PLACE_COUNT];  /* NULL to inherit from procman */
+  int            cpu;           /* picked by 'cpus=spread', or -1 */
+
+  int            cgroup;        /* has a leaf in 'cgroup_fd' */
+
+  /* sockets bound once and passed to every instance, see open_listeners(). */
+  char          *listen;
+  int            overlap;       /* start the next instance, then stop */
+  int            listen_fds[LISTEN_MAX];
+  int            listen_count;  /* 0 until bound */
+
+  /* instance 'replica' of 'replicas' from one entry, see append_replicas(). */
+  int            replica;
+  int            replicas;      /* 0 if not replicated */
+
+  Log           *log;
+  int            log_fd;        /* write end of the output pipe */
+  Watch          log_watch;
+
+  /* published on the status board, see board_update(). */
+  int            board;         /* record index, or -1 */
+  int            restarts;
+  int            exit_status;   /* of the last run, or -1 */
+  long long      spawn_realtime;
+  long long      uptime;        /* of the finished runs, in ns */
+
+  TaskState      state;
+  int            level;
+  int            waiting;
+  int            released;
+  Dep           *deps;
+  int            deps_len;
+  int            deps_max;
+
+  Timer          restart_timer;
+  double         tokens;
+  long long      tokens_time;
+  int            failures;
+  int            window_failures;
+  long long      window_start;
+
+  Relay         *relay;
+  Edge          *input_edge;
+
+  /* config reload, see reload_config(). */
+  int            removed;
+  Task          *replaces;
+  Task          *replaced_by;
+  int            handoff;       /* 1 until 'replaced_by' is up, then 2 */
+
+  /* control socket, see run_command(). */
+  int            held;          /* stopped, not started or respawned */
+  int            restart;       /* spawn again once reaped */
+
+  /* 'interval' and 'calendar' runs, see schedule_task(). */
+  long long      every;         /* milliseconds */
+  Calendar       calendar;
+  Overrun        overrun;
+  long long      timeout;       /* of a run in milliseconds, 0 for none */
+  long long      next_run;      /* monotonic ns for 'every', else realtime */
+  Timer          schedule_timer;
+  Timer          run_timer;     /* timeout, then grace of the run */
+
+  /* admission control, see Admission. */
+  int            priority;      /* higher is admitted first, > 0 never waits */
+  int            admit_index;   /* in the queue from 1, 0 if not waiting */
+  long long      admit_seq;
+  int            admitted;      /* spawn_task() lets it through once */
+  long long      queued_time;   /* monotonic ns, 0 if not waiting */
+  long long      queue_delay;   /* of the last spawn in ns */
+
+  /* restarts forked by a template, see Zygote. */
+  int            zygote;        /* zygote=yes */
+  Zygote        *zygote_class;  /* once it spawned */
+  long long      down_time;     /* reaped for a restart, until ready */
+  Spawn          spawn;         /* sent to the template, until it replies */
+  Timer          zygote_timer;  /* pending while waiting for the reply */
+
+  /* shutdown, see begin_shutdown(). */
+  int            stopping;      /* alive when the shutdown began */
+  int            stop_waiting;  /* live dependents */
+  int            killed;
+  long long      stop_time;     /* signalled, or 0 */
+  Timer          stop_timer;
+};
+
+/*
+ * Task registry.
+ *
+ * 'tasks' is the launch order view, 'id_table' and 'pid_table' are open
+ * addressing hash tables (linear probing, power of two sizes) so that
+ * lookups from read_config() and from the reaper do not walk the list.
+ */
+typedef struct _Registry Registry;
+struct _Registry
+{
+  Task **tasks;
+  int    task_count;
+  int    task_max;
+
+  Task **id_table;
+  int    id_size;
+
+  Task **pid_table;
+  int    pid_size;
+  int    pid_count;
+
+  Config *config;               /* being read, see read_config() */
+};
+
+static Registry registry;
+
+/*
+ * Task records come from slabs of TASK_SLAB mapped outside the heap, and
+ * freed records go on a free list, linked through 'replaces'.  A reload
+ * or a scale allocates the new records while the old ones still run, so
+ * this way the next one reuses them instead of growing the heap.
+ */
+#define TASK_SLAB 256
+
+typedef struct _TaskSlab TaskSlab;
+struct _TaskSlab
+{
+  TaskSlab *next;
+  int       used;               /* records handed out in order */
+  Task      tasks[TASK_SLAB];
+};
+
+static TaskSlab *task_slabs;
+static Task     *task_free;
+static int       task_slab_count;
+static int       task_records;  /* in use */
+
+/* removed by a reload, freed once no event can refer to them. */
+static Task   **dead_tasks;
+static int      dead_len;
+static int      dead_max;
+
+static const char *config_file;
+
+/*
+ * Startup engine.
+ *
+ * Tasks with the same 'order' form a level, and a level is released when
+ * every task of the previous (higher order) level has started.  Together
+ * with the pipe-id, after= and requires= edges this makes a DAG, so the
+ * boot time is bounded by its critical path.  'queue' holds the tasks whose
+ * dependencies are all satisfied, 'starting' counts the tasks spawned but
+ * not ready yet, and it is capped by 'max_jobs' (0 means no limit).
+ */
+typedef struct _Startup Startup;
+struct _Startup
+{
+  Task **queue;
+  int    queue_head;
+  int    queue_len;
+
+  Task **done;
+  int    done_len;
+
+  int   *level_start;
+  int   *level_pending;
+  int    levels;
+
+  int    starting;
+  int    max_jobs;
+};
+
+static Startup startup;
+
+/*
+ * Shutdown, the startup order backwards.  A task is signalled once the
+ * tasks depending on it and every higher level are gone, 'prereqs' lists
+ * (by 'seq') the tasks each task depends on, and 'level' is the highest
+ * level with live tasks.  Each signalled task gets SIGKILL after its grace
+ * period, so the whole shutdown takes at most the sum over the levels.
+ */
+typedef struct _Shutdown Shutdown;
+struct _Shutdown
+{
+  int        signo;
+  long long  start;
+  long long  grace;             /* -g, in milliseconds */
+
+  Task     **prereqs;
+  int       *prereq_start;
+  int       *level_alive;
+  int        level;
+
+  int        stopped;
+  int        killed;
+  char       slowest[TASK_ID_MAX + 1];
+  long long  slowest_time;
+};
+
+static Shutdown teardown = { .grace = 10 * 1000 };
+
+static int      epoll_fd = -1;
+
+static int      timer_fd = -1;
+static Watch    timer_watch;
+static Wheel    wheel = { .armed = -1 };
+
+static int      null_fd = -1;
+
+/*
+ * cgroup v2 group of procman, 'procman.<pid>' below its own cgroup, with
+ * a leaf per task so that a task and everything it forks can be limited,
+ * frozen and killed as one.  -1 if cgroupfs is not writable (or -C), then
+ * tasks run in the cgroup of procman as before.
+ */
+static int      cgroup_fd = -1;
+static int      use_cgroup = 1;
+static char     cgroup_path[PATH_MAX];
+
+/*
+ * status board, see board.h.  Records of freed tasks are reused from
+ * 'board_free', the others are handed out in order.
+ */
+static const char  *board_file;
+static char         board_path[PATH_MAX];
+static int          board_fd = -1;
+static BoardHeader *board;
+static size_t       board_size;
+static int          board_max;
+static int         *board_free;
+static int          board_free_len;
+
+/*
+ * Control socket, '/tmp/procman.<pid>.sock' (or -c), see run_command().
+ * Connected clients and held tasks keep procman running, so that a task
+ * stopped from it can be started again.
+ */
+typedef struct _Client Client;
+struct _Client
+{
+  Watch   watch;
+  char   *in;
+  size_t  in_len;
+  size_t  in_max;
+  char   *out;
+  size_t  out_len;
+  size_t  out_pos;
+  size_t  out_max;
+  int     eof;
+};
+
+/*
+ * output capture, see Log.  The writer thread waits for 'log_queue', and
+ * hands logs back to the event loop on 'log_resume' (to drain again) and
+ * 'log_done' (to free) through 'log_event_fd'.
+ */
+static const char      *log_dir;
+static int              log_max = 16 * 1024 * 1024;
+static pthread_t        log_thread;
+static pthread_mutex_t  log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   log_cond = PTHREAD_COND_INITIALIZER;
+static Log             *log_queue;
+static Log             *log_resume;
+static Log             *log_done;
+static int              log_stop;
+static int              log_event_fd = -1;
+static Watch            log_event_watch;
+
+/* -T, events of trace.h, flushed by their own thread every TRACE_FLUSH ms. */
+#define TRACE_FLUSH 50
+
+static const char      *trace_file;
+static TraceRing       *trace_ring;
+static int              trace_fd = -1;
+static pthread_t        trace_thread;
+static pthread_mutex_t  trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   trace_cond = PTHREAD_COND_INITIALIZER;
+static int              trace_stop;
+static long long        trace_written;  /* by the thread until joined */
+static int              trace_append;   /* to the trace of the image before */
+
+static const char  *control_file;
+static char         control_path[PATH_MAX];
+static int          control_fd = -1;
+static Watch        control_watch;
+static int          clients;
+static int          held_tasks;
+
+static int      signal_fd = -1;
+static Watch    signal_watch;
+
+/*
+ * children are tracked with pidfds, and the ones without a pidfd (not
+ * supported, or out of fds) with SIGCHLD.
+ */
+static int      use_pidfd;
+static int      no_pidfd;
+static int      live_children;
+static int      restarting;
+static int      scheduled_tasks;  /* with a run pending, see schedule_task() */
+static int      sigchld_children;
+
+typedef struct _Stats Stats;
+struct _Stats
+{
+  long long spawns;
+  long long reaps;
+  long long respawns;
+  long long respawn_time;
+  long long respawn_time_max;
+  long long reap_samples;       /* exits with a time from the task */
+  long long reap_time;
+  long long reap_time_max;
+  long long sigchld_signals;
+  long long sigchld_reaps;
+  long long sigchld_batch_max;  /* reaps for one SIGCHLD */
+  long long start;
+  long long spawn_time;
+  long long backoffs;
+  long long quarantines;
+  long long board_updates;
+  long long log_bytes;
+  long long log_stalls;
+  long long log_lines;          /* by the writer thread */
+  long long log_writes;
+  long long log_errors;
+  long long orphans;            /* reaped as the subreaper */
+  long long upgrades;
+  long long scheduled_runs;     /* due, including the skipped ones */
+  long long skipped_runs;
+  long long timeouts;
+  long long zygote_starts;
+  long long zygote_forks;
+  long long zygote_colds;       /* zygote=yes spawns without a template */
+  long long ready_samples;      /* restarts until ready */
+  long long ready_time;
+  long long ready_time_max;
+  long long deferrals;          /* spawns which waited for admission */
+  long long admissions;
+  long long queue_time;
+  long long queue_time_max;
 };
 
-static Task *tasks;
+static sigset_t orig_mask;
+
+static int      show_stats;
+static Stats    stats;
+static char    *stats_file;     /* -J, one JSON object per run */
+
+/* fork() and exec instead of posix_spawn(), for comparison. */
+static int      use_fork;
 
 static volatile int running;
 
+/* strip 'str' in place, without moving it. */
 static char *
 strstrip (char *str)
 {
-  char  *start;
   size_t len;
 
-  len = strlen (str);
-  while (len--)
-    {
-      if (!isspace (str[len]))
-        break;
-      str[len] = '\0';
-    }
+  while (isspace (*str))
+    str++;
 
-  for (start = str; *start && isspace (*start); start++)
-    ;
-  memmove (str, start, strlen (start) + 1);
+  len = strlen (str);
+  while (len > 0 && isspace (str[len - 1]))
+    str[--len] = '\0';
 
   return str;
 }
@@ -85,502 +806,8747 @@ check_valid_id (const char *str)
   return 0;
 }
 
-static Task *
-lookup_task (const char *id)
+static long long
+now_ns (void)
 {
-  Task *task;
+  struct timespec ts;
 
-  for (task = tasks; task != NULL; task = task->next)
-    if (!strcmp (task->id, id))
-      return task;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
 
-  return NULL;
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static Task *
-lookup_task_by_pid (pid_t pid)
+static void
+set_cloexec (int fd,
+             int on)
 {
-  Task *task;
+  if (fd >= 0)
+    fcntl (fd, F_SETFD, on ? FD_CLOEXEC : 0);
+}
 
-  for (task = tasks; task != NULL; task = task->next)
-    if (task->pid == pid)
-      return task;
+static long long
+realtime_ns (void)
+{
+  struct timespec ts;
 
-  return NULL;
+  clock_gettime (CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+/* an event of 'task', or of procman if NULL, at 'time' or now if 0. */
 static void
-append_task (Task *task)
+trace_event (int        type,
+             Task      *task,
+             long long  arg,
+             long long  time)
 {
-  Task *new_task;
+  if (!trace_ring)
+    return;
 
-  new_task = malloc (sizeof (Task));
-  if (!new_task)
-    {
-      MSG ("failed to allocate a task: %s\n", STRERROR);
-      return;
-    }
+  trace_put (trace_ring, type, task ? task->id : "", task ? task->pid : 0,
+             arg, time);
+}
 
-  *new_task = *task;
-  new_task->next = NULL;
+/*
+ * "1.5s", "100ms", "2m", "1h", or plain seconds, in milliseconds.  Up to
+ * the span of the timer wheel, which also keeps out "inf" and "nan".
+ */
+static int
+parse_duration (const char *str,
+                long long  *msec)
+{
+  char  *end;
+  double value;
 
-  if (!tasks)                                                      //아무 task도 없을 경우 new_task가 tasks의 처음이 된다.
-    tasks = new_task;
+  value = strtod (str, &end);
+  if (end == str)
+    return -1;
 
-  else{
-      Task *t;
-      t = tasks;
-      if(new_task->order > t->order){                         //현재 존재하는 t의 가장 큰 order보다 new_task의 order가 더 큰 경우
-          printf("%d\n", t->order);
-          new_task->next = t;
-          t = new_task;
-      }
-      else {                                                  //new order가 사이값일 경우
-          Task *tmp;
-          while(t != NULL && new_task->order < t->order){
-              tmp = t;
-              t = t->next;
-          }
-          tmp->next = new_task;
-          new_task->next = t;
-      }
-  }
+  if (!strcmp (end, "ms"))
+    ;
+  else if (!strcmp (end, "") || !strcmp (end, "s"))
+    value *= 1000;
+  else if (!strcmp (end, "m"))
+    value *= 60 * 1000;
+  else if (!strcmp (end, "h"))
+    value *= 60 * 60 * 1000;
+  else
+    return -1;
+
+  if (!(value >= 0 && value <= WHEEL_SPAN))
+    return -1;
+  *msec = (long long) value;
+
+  return 0;
 }
 
+/* "65536", "256k" or "1m", in bytes. */
 static int
-read_config (const char *filename)
+parse_size (const char *str,
+            int        *size)
 {
-  FILE *fp;
-  char  line[COMMAND_LEN * 2];
-  int   line_nr;
+  char *end;
+  long  value;
 
-  fp = fopen (filename, "r");
-  if (!fp)
+  value = strtol (str, &end, 10);
+  if (end == str || value <= 0)
     return -1;
 
-  tasks = NULL;
+  if (!strcasecmp (end, "k"))
+    value *= 1024;
+  else if (!strcasecmp (end, "m"))
+    value *= 1024 * 1024;
+  else if (*end != '\0')
+    return -1;
 
-  line_nr = 0;
-  while (fgets (line, sizeof (line), fp))
-    {
-      Task   task;
-      char  *p;
-      char  *s;
-      size_t len;
+  if (value > INT_MAX)
+    return -1;
+  *size = (int) value;
 
-      line_nr++;
-      memset (&task, 0x00, sizeof (task));
+  return 0;
+}
 
-      len = strlen (line);
-      if (line[len - 1] == '\n')
-        line[len - 1] = '\0';
+/* "5/10s" is 5 in 10 seconds, "0" for no limit. */
+static int
+parse_limit (const char *str,
+             int        *count,
+             long long  *msec)
+{
+  char *end;
+  long  n;
 
-      if (0)
-        MSG ("config[%3d] %s\n", line_nr, line);
+  n = strtol (str, &end, 10);
+  if (end == str || n < 0)
+    return -1;
 
-      strstrip (line);
+  *count = (int) n;
+  if (*end == '\0' && n == 0)
+    {
+      *msec = 0;
+      return 0;
+    }
+  if (*end != '/')
+    return -1;
 
-      /* comment or empty line */
-      if (line[0] == '#' || line[0] == '\0')
-        continue;
+  return parse_duration (end + 1, msec);
+}
 
-      /* id */
-      s = line;
-      p = strchr (s, ':');
-      if (!p){
-        MSG("id part");
-        goto invalid_line;
-      }
-      *p = '\0';
-      strstrip (s);
-      if (check_valid_id (s))
+/*
+ * A field of a cron line: "*", "5" or "1-5", each with an optional step
+ * as in "0-30/10", or a comma separated list of them.
+ */
+static int
+parse_cron_field (const char         *str,
+                  int                 min,
+                  int                 max,
+                  unsigned long long *bits)
+{
+  const char *p = str;
+
+  *bits = 0;
+  for (;;)
+    {
+      char *end;
+      long  first;
+      long  last;
+      long  step;
+
+      if (*p == '*')
         {
-          MSG ("invalid id '%s' in line %d, ignored\n", s, line_nr);
-          continue;
+          first = min;
+          last = max;
+          end = (char *) p + 1;
         }
-      if (lookup_task (s))
+      else
         {
-          MSG ("duplicate id '%s' in line %d, ignored\n", s, line_nr);
-          continue;
+          first = last = strtol (p, &end, 10);
+          if (end == p)
+            return -1;
+          if (*end == '-')
+            {
+              p = end + 1;
+              last = strtol (p, &end, 10);
+              if (end == p)
+                return -1;
+            }
         }
-      strcpy (task.id, s);
 
-      /* action */
-      s = p + 1;
-      p = strchr (s, ':');
-      if (!p){
-        MSG("action part");
-        goto invalid_line;
-      }
-      *p = '\0';
-      strstrip (s);
-      if (!strcasecmp (s, "once"))
-        task.action = ACTION_ONCE;
-      else if (!strcasecmp (s, "respawn"))
-        task.action = ACTION_RESPAWN;
+      step = 1;
+      if (*end == '/')
+        {
+          p = end + 1;
+          step = strtol (p, &end, 10);
+          if (end == p || step < 1)
+            return -1;
+        }
+      if (first < min || last > max || first > last)
+        return -1;
+      for (; first <= last; first += step)
+        *bits |= 1ULL << first;
+
+      if (*end == '\0')
+        return 0;
+      if (*end != ',')
+        return -1;
+      p = end + 1;
+    }
+}
+
+/* "0 3 * * 1-5", minute hour day month weekday as cron reads them. */
+static int
+parse_calendar (const char *str,
+                Calendar   *calendar)
+{
+  char  line[256];
+  char *fields[5];
+  char *save;
+  int   n;
+
+  if (strlen (str) >= sizeof (line))
+    return -1;
+  strcpy (line, str);
+
+  for (n = 0; n < 5; n++)
+    {
+      fields[n] = strtok_r (n ? NULL : line, " \t", &save);
+      if (!fields[n])
+        return -1;
+    }
+  if (strtok_r (NULL, " \t", &save)
+      || parse_cron_field (fields[0], 0, 59, &calendar->minutes)
+      || parse_cron_field (fields[1], 0, 23, &calendar->hours)
+      || parse_cron_field (fields[2], 1, 31, &calendar->days)
+      || parse_cron_field (fields[3], 1, 12, &calendar->months)
+      || parse_cron_field (fields[4], 0, 7, &calendar->weekdays))
+    return -1;
+
+  /* sunday is 0 and 7. */
+  if (calendar->weekdays & 1ULL << 7)
+    calendar->weekdays = (calendar->weekdays | 1) & ~(1ULL << 7);
+  calendar->either_day = fields[2][0] != '*' && fields[4][0] != '*';
+
+  return 0;
+}
+
+static int
+calendar_day (const Calendar  *calendar,
+              const struct tm *tm)
+{
+  int day;
+  int weekday;
+
+  day = (calendar->days >> tm->tm_mday) & 1;
+  weekday = (calendar->weekdays >> tm->tm_wday) & 1;
+
+  return calendar->either_day ? day || weekday : day && weekday;
+}
+
+/*
+ * The first minute after realtime 'after' in ns that 'calendar' matches,
+ * or -1 if none does within years (February 30).  It moves by months,
+ * days and hours where it can, a few hundred steps at most.
+ */
+static long long
+calendar_next (const Calendar *calendar,
+               long long       after)
+{
+  struct tm tm;
+  time_t    t;
+  int       year;
+
+  t = after / 1000000000LL;
+  localtime_r (&t, &tm);
+  year = tm.tm_year;
+  tm.tm_sec = 0;
+  tm.tm_min++;
+
+  for (;;)
+    {
+      tm.tm_isdst = -1;
+      t = mktime (&tm);
+      if (t == (time_t) -1 || tm.tm_year > year + 8)
+        return -1;
+
+      if (!((calendar->months >> (tm.tm_mon + 1)) & 1))
+        {
+          tm.tm_mon++;
+          tm.tm_mday = 1;
+          tm.tm_hour = 0;
+          tm.tm_min = 0;
+        }
+      else if (!calendar_day (calendar, &tm))
+        {
+          tm.tm_mday++;
+          tm.tm_hour = 0;
+          tm.tm_min = 0;
+        }
+      else if (!((calendar->hours >> tm.tm_hour) & 1))
+        {
+          tm.tm_hour++;
+          tm.tm_min = 0;
+        }
+      else if (!((calendar->minutes >> tm.tm_min) & 1))
+        tm.tm_min++;
       else
+        return t * 1000000000LL;
+    }
+}
+
+/* "max", "50000" or "50000 100000", quota and period in microseconds. */
+static int
+check_cpu_max (const char *str)
+{
+  char *end;
+
+  if (!strncmp (str, "max", 3))
+    end = (char *) str + 3;
+  else if (strtol (str, &end, 10) <= 0)
+    return -1;
+
+  if (*end == ' ' && strtol (end + 1, &end, 10) <= 0)
+    return -1;
+
+  return *end == '\0' ? 0 : -1;
+}
+
+static int
+check_weight (const char *str)
+{
+  char *end;
+  long  n;
+
+  n = strtol (str, &end, 10);
+  if (end == str || *end != '\0' || n < 1 || n > 10000)
+    return -1;
+
+  return 0;
+}
+
+/* "max", or bytes with an optional k, m, g suffix as cgroupfs takes it. */
+static int
+check_memory_max (const char *str)
+{
+  char *end;
+
+  if (!strcmp (str, "max"))
+    return 0;
+
+  if (strtoll (str, &end, 10) <= 0)
+    return -1;
+  if (*end != '\0' && (!strchr ("kKmMgG", *end) || end[1] != '\0'))
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Options of the same name set these files in the cgroup of a task, the
+ * values are written as they are.  'reset' is the kernel default, for a
+ * limit removed by a reload.
+ */
+typedef struct _CgroupLimit CgroupLimit;
+struct _CgroupLimit
+{
+  const char *file;
+  const char *controller;
+  const char *reset;
+  int       (*check) (const char *str);
+};
+
+static const CgroupLimit cgroup_limits[LIMIT_COUNT] =
+{
+  { "cpu.max",    "cpu",    "max", check_cpu_max },
+  { "cpu.weight", "cpu",    "100", check_weight },
+  { "memory.max", "memory", "max", check_memory_max },
+  { "io.weight",  "io",     "100", check_weight },
+};
+
+/* "0-3,6" into 'set', as in cpuset.cpus and the node cpulists. */
+static int
+parse_cpu_list (const char *str,
+                cpu_set_t  *set)
+{
+  CPU_ZERO (set);
+  for (;;)
+    {
+      char *end;
+      long  first;
+      long  last;
+
+      first = strtol (str, &end, 10);
+      if (end == str || first < 0)
+        return -1;
+      last = first;
+      if (*end == '-')
+        {
+          str = end + 1;
+          last = strtol (str, &end, 10);
+          if (end == str || last < first)
+            return -1;
+        }
+      if (last >= CPU_SETSIZE)
+        return -1;
+      for (; first <= last; first++)
+        CPU_SET (first, set);
+
+      if (*end == '\0' || *end == '\n')
+        return 0;
+      if (*end != ',')
+        return -1;
+      str = end + 1;
+    }
+}
+
+/* a cpu list, or "spread" for the least used of the cpus procman has. */
+static int
+check_cpus (const char *str)
+{
+  cpu_set_t set;
+
+  if (!strcmp (str, "spread"))
+    return 0;
+
+  return parse_cpu_list (str, &set);
+}
+
+static int
+check_nodes (const char *str)
+{
+  cpu_set_t set;
+
+  return parse_cpu_list (str, &set);
+}
+
+static int
+check_nice (const char *str)
+{
+  char *end;
+  long  n;
+
+  n = strtol (str, &end, 10);
+  if (end == str || *end != '\0' || n < -20 || n > 19)
+    return -1;
+
+  return 0;
+}
+
+/* "idle", "be" or "rt" with an optional "/level", in the ioprio_set() value. */
+static int
+parse_ioprio (const char *str,
+              int        *ioprio)
+{
+  char *end;
+  long  level;
+  int   klass;
+
+  level = 4;
+  if (!strncmp (str, "idle", 4))
+    {
+      klass = 3;
+      level = 0;
+      str += 4;
+    }
+  else if (!strncmp (str, "be", 2) || !strncmp (str, "rt", 2))
+    {
+      klass = str[0] == 'r' ? 1 : 2;
+      str += 2;
+      if (*str == '/')
+        {
+          level = strtol (str + 1, &end, 10);
+          if (end == str + 1 || level < 0 || level > 7)
+            return -1;
+          str = end;
+        }
+    }
+  else
+    return -1;
+
+  if (*str != '\0')
+    return -1;
+  *ioprio = klass << IOPRIO_CLASS_SHIFT | level;
+
+  return 0;
+}
+
+static int
+check_ioprio (const char *str)
+{
+  int ioprio;
+
+  return parse_ioprio (str, &ioprio);
+}
+
+static int
+parse_sched (const char *str)
+{
+  if (!strcmp (str, "other"))
+    return SCHED_OTHER;
+  if (!strcmp (str, "batch"))
+    return SCHED_BATCH;
+  if (!strcmp (str, "idle"))
+    return SCHED_IDLE;
+
+  return -1;
+}
+
+static int
+check_sched (const char *str)
+{
+  return parse_sched (str) < 0 ? -1 : 0;
+}
+
+/*
+ * One address of 'listen=', 'len' bytes of 'str': a path with a '/' for
+ * a unix socket, else 'host:port', or a port on the loopback.
+ */
+static int
+parse_listen (const char              *str,
+              int                      len,
+              struct sockaddr_storage *addr,
+              socklen_t               *addr_len)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+  char                buf[PATH_MAX];
+  const char         *host;
+  char               *port;
+  char               *end;
+  long                n;
+
+  if (len <= 0 || len >= sizeof (buf))
+    return -1;
+  memcpy (buf, str, len);
+  buf[len] = '\0';
+  memset (addr, 0x00, sizeof (*addr));
+
+  if (strchr (buf, '/'))
+    {
+      struct sockaddr_un *sun = (struct sockaddr_un *) addr;
+
+      if (len >= sizeof (sun->sun_path))
+        return -1;
+      sun->sun_family = AF_UNIX;
+      memcpy (sun->sun_path, buf, len + 1);
+      *addr_len = sizeof (*sun);
+      return 0;
+    }
+
+  port = strrchr (buf, ':');
+  if (port)
+    {
+      *port++ = '\0';
+      host = buf;
+    }
+  else
+    {
+      port = buf;
+      host = "127.0.0.1";
+    }
+  n = strtol (port, &end, 10);
+  if (end == port || *end || n <= 0 || n > 65535
+      || inet_pton (AF_INET, host, &sin->sin_addr) != 1)
+    return -1;
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons (n);
+  *addr_len = sizeof (*sin);
+
+  return 0;
+}
+
+static int
+check_listen (const char *str)
+{
+  struct sockaddr_storage addr;
+  socklen_t               addr_len;
+  int                     count;
+  int                     len;
+
+  for (count = 0; count == 0 || *str; count++)
+    {
+      len = strcspn (str, ",");
+      if (count == LISTEN_MAX || parse_listen (str, len, &addr, &addr_len))
+        return -1;
+      str += len;
+      if (*str == ',')
+        str++;
+    }
+
+  return 0;
+}
+
+/*
+ * Options of the same name, applied in the child before exec, see
+ * place_child().  'numa' binds the memory to the nodes, and the cpus to
+ * theirs unless 'cpus' is given as well.
+ */
+typedef struct _TaskPlace TaskPlace;
+struct _TaskPlace
+{
+  const char *key;
+  int       (*check) (const char *str);
+};
+
+static const TaskPlace task_places[PLACE_COUNT] =
+{
+  { "cpus",   check_cpus },
+  { "numa",   check_nodes },
+  { "nice",   check_nice },
+  { "ioprio", check_ioprio },
+  { "sched",  check_sched },
+};
+
+/* live tasks on each cpu of 'spread_cpus', for 'cpus=spread'. */
+static cpu_set_t spread_cpus;
+static int       spread_load[CPU_SETSIZE];
+
+static int
+watch_add (Watch        *watch,
+           int           fd,
+           unsigned int  events,
+           WatchFunc     func,
+           void         *data)
+{
+  struct epoll_event ev;
+
+  watch->fd = fd;
+  watch->func = func;
+  watch->data = data;
+
+  memset (&ev, 0x00, sizeof (ev));
+  ev.events = events;
+  ev.data.ptr = watch;
+  if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+    {
+      MSG ("failed to watch fd %d: %s\n", fd, STRERROR);
+      watch->fd = -1;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* remove 'watch' and close its fd. */
+static void
+watch_close (Watch *watch)
+{
+  if (watch->fd < 0)
+    return;
+
+  epoll_ctl (epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+  close (watch->fd);
+  watch->fd = -1;
+}
+
+/* the first used slot from 'from' up to 'to', or -1. */
+static int
+wheel_find (int from,
+            int to)
+{
+  int i;
+
+  for (i = from; i < to; )
+    {
+      unsigned long long word = wheel.used[i / 64] >> (i % 64);
+
+      if (word)
+        {
+          i += __builtin_ctzll (word);
+          return i < to ? i : -1;
+        }
+      i = (i / 64 + 1) * 64;
+    }
+
+  return -1;
+}
+
+/*
+ * The slot of a timer due at 'tick', on the lowest level whose span
+ * covers it from 'wheel.tick'.  Level 0 has a slot per tick, a slot of
+ * level n covers all the slots of level n - 1.  Past due timers go to the
+ * slot about to run, those beyond the last level to its farthest slot.
+ */
+static int
+wheel_slot (long long tick)
+{
+  long long delta;
+  int       level;
+  int       shift;
+
+  delta = tick - wheel.tick;
+  if (delta < 0)
+    return wheel.tick & (WHEEL_SLOTS0 - 1);
+  if (delta < WHEEL_SLOTS0)
+    return tick & (WHEEL_SLOTS0 - 1);
+
+  if (delta > WHEEL_SPAN)
+    tick = wheel.tick + WHEEL_SPAN;
+  for (level = 1; level < WHEEL_LEVELS - 1; level++)
+    if (delta < 1LL << (WHEEL_BITS0 + level * WHEEL_BITS))
+      break;
+  shift = WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+
+  return WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS
+    + ((tick >> shift) & (WHEEL_SLOTS - 1));
+}
+
+static void
+wheel_add (Timer *timer)
+{
+  int slot;
+
+  slot = wheel_slot (timer->tick);
+  timer->slot = slot;
+  timer->next = wheel.slots[slot];
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = &wheel.slots[slot];
+  wheel.slots[slot] = timer;
+  wheel.used[slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void
+wheel_unlink (Timer *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->pprev = NULL;
+  timer->next = NULL;
+
+  /* also right for a timer of a list taken out, see handle_timers(). */
+  if (!wheel.slots[timer->slot])
+    wheel.used[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+}
+
+/* take out the timers of 'slot', into a list of their own. */
+static Timer *
+wheel_take (int    slot,
+            Timer **list)
+{
+  *list = wheel.slots[slot];
+  wheel.slots[slot] = NULL;
+  wheel.used[slot / 64] &= ~(1ULL << (slot % 64));
+  if (*list)
+    (*list)->pprev = list;
+
+  return *list;
+}
+
+/*
+ * At every wrap of level 0, move the timers of the next slot of level 1
+ * down, and so on up while the levels wrap as well.  Every timer moves
+ * down at most once per level, that is O(1) per timer.
+ */
+static void
+wheel_cascade (void)
+{
+  int level;
+
+  for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      Timer *list;
+      int    shift;
+      int    index;
+
+      shift = WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+      index = (wheel.tick >> shift) & (WHEEL_SLOTS - 1);
+      wheel_take (WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS + index, &list);
+      while (list)
+        {
+          Timer *timer = list;
+
+          wheel_unlink (timer);
+          wheel_add (timer);
+        }
+      if (index)
+        break;
+    }
+}
+
+/*
+ * The first tick something is due at: a timer of level 0, or a cascade
+ * of a used slot above, which may bring timers due right at it.  A few
+ * bitmap words instead of looking at the timers.
+ */
+static long long
+wheel_next (void)
+{
+  long long next;
+  int       index;
+  int       level;
+  int       slot;
+
+  if (!wheel.count)
+    return -1;
+
+  next = LLONG_MAX;
+  index = wheel.tick & (WHEEL_SLOTS0 - 1);
+  slot = wheel_find (index, WHEEL_SLOTS0);
+  if (slot >= 0)
+    next = wheel.tick + slot - index;
+  else if ((slot = wheel_find (0, index)) >= 0)
+    /* the ones behind 'index' are due after the wrap. */
+    next = wheel.tick - index + WHEEL_SLOTS0 + slot;
+
+  for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      long long block;
+      int       base;
+      int       shift;
+
+      shift = WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+      base = WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS;
+      if (!wheel.used[base / 64])
+        continue;
+
+      /* the next cascade of each slot, starting with this block. */
+      block = (wheel.tick + (1LL << shift) - 1) >> shift;
+      index = block & (WHEEL_SLOTS - 1);
+      slot = wheel_find (base + index, base + WHEEL_SLOTS);
+      if (slot < 0)
+        slot = wheel_find (base, base + index) + WHEEL_SLOTS;
+      block += slot - base - index;
+      if (next > block << shift)
+        next = block << shift;
+    }
+
+  return next;
+}
+
+/* arm the timerfd for the first tick with something due. */
+static void
+timer_arm (void)
+{
+  struct itimerspec its;
+  long long         next;
+
+  next = wheel_next ();
+  if (next == wheel.armed)
+    return;
+  wheel.armed = next;
+
+  memset (&its, 0x00, sizeof (its));
+  if (next >= 0)
+    {
+      /* zero would disarm it. */
+      its.it_value.tv_sec = next * WHEEL_TICK / 1000000000LL;
+      its.it_value.tv_nsec = next * WHEEL_TICK % 1000000000LL;
+      if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+    }
+
+  if (timerfd_settime (timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+    MSG ("failed to arm timer: %s\n", STRERROR);
+}
+
+static int
+timer_pending (Timer *timer)
+{
+  return timer->pprev != NULL;
+}
+
+/* a stopped timer leaves the timerfd armed, which costs a wakeup at most. */
+static void
+timer_stop (Timer *timer)
+{
+  if (!timer->pprev)
+    return;
+
+  wheel_unlink (timer);
+  wheel.count--;
+}
+
+/* call 'func' once after 'msec' milliseconds. */
+static void
+timer_start (Timer     *timer,
+             long long  msec,
+             TimerFunc  func,
+             void      *data)
+{
+  long long now;
+
+  timer_stop (timer);
+
+  now = now_ns ();
+  if (!wheel.count)
+    wheel.tick = now / WHEEL_TICK;
+  wheel.count++;
+
+  timer->expire = now + msec * 1000000LL;
+  timer->tick = (timer->expire + WHEEL_TICK - 1) / WHEEL_TICK;
+  timer->func = func;
+  timer->data = data;
+  wheel_add (timer);
+
+  if (wheel.armed < 0 || timer->tick < wheel.armed)
+    timer_arm ();
+}
+
+/*
+ * Run the wheel up to now, a tick at a time where timers are due and
+ * straight to the next used slot or wrap where not.
+ */
+static void
+handle_timers (Watch        *watch,
+               unsigned int  events)
+{
+  unsigned long long expirations;
+  long long          now;
+
+  if (read (watch->fd, &expirations, sizeof (expirations)) < 0
+      && errno != EAGAIN)
+    MSG ("failed to read timer: %s\n", STRERROR);
+
+  now = now_ns () / WHEEL_TICK;
+  wheel.armed = -1;
+  while (wheel.count > 0 && wheel.tick <= now)
+    {
+      Timer *list;
+      int    index;
+      int    slot;
+
+      index = wheel.tick & (WHEEL_SLOTS0 - 1);
+      if (!index)
+        wheel_cascade ();
+
+      if (!wheel_take (index, &list))
+        {
+          slot = wheel_find (index + 1, WHEEL_SLOTS0);
+          wheel.tick += (slot >= 0 ? slot : WHEEL_SLOTS0) - index;
+          if (wheel.tick > now + 1)
+            wheel.tick = now + 1;
+          continue;
+        }
+
+      /* timers started from here go to the next tick at the earliest. */
+      wheel.tick++;
+      while (list)
+        {
+          Timer *timer = list;
+
+          wheel_unlink (timer);
+          wheel.count--;
+          timer->func (timer);
+        }
+    }
+  if (!wheel.count)
+    wheel.tick = now + 1;
+
+  timer_arm ();
+}
+
+static Config *
+config_ref (Config *config)
+{
+  config->refs++;
+
+  return config;
+}
+
+static void
+config_unref (Config *config)
+{
+  int i;
+
+  if (!config || --config->refs > 0)
+    return;
+
+  for (i = 1; i < config->paths_len; i += 2)
+    free (config->paths[i]);
+  free (config->paths);
+  free (config->argv);
+  munmap (config->data, config->size + 1);
+  free (config);
+}
+
+static unsigned int
+hash_id (const char *id)
+{
+  unsigned int h;
+
+  /* FNV-1a */
+  for (h = 2166136261u; *id; id++)
+    h = (h ^ (unsigned char) *id) * 16777619u;
+
+  return h;
+}
+
+static unsigned int
+hash_pid (pid_t pid)
+{
+  return (unsigned int) pid * 2654435761u;
+}
+
+static int
+registry_grow_ids (Registry *reg)
+{
+  Task **table;
+  int    size;
+  int    i;
+
+  size = reg->id_size ? reg->id_size * 2 : 64;
+  table = calloc (size, sizeof (Task *));
+  if (!table)
+    return -1;
+
+  for (i = 0; i < reg->task_count; i++)
+    {
+      unsigned int h;
+
+      h = hash_id (reg->tasks[i]->id) & (size - 1);
+      while (table[h])
+        h = (h + 1) & (size - 1);
+      table[h] = reg->tasks[i];
+    }
+
+  free (reg->id_table);
+  reg->id_table = table;
+  reg->id_size = size;
+
+  return 0;
+}
+
+static int
+registry_grow_pids (Registry *reg)
+{
+  Task **table;
+  int    size;
+  int    i;
+
+  size = reg->pid_size ? reg->pid_size * 2 : 64;
+  table = calloc (size, sizeof (Task *));
+  if (!table)
+    return -1;
+
+  for (i = 0; i < reg->pid_size; i++)
+    {
+      Task        *task;
+      unsigned int h;
+
+      task = reg->pid_table[i];
+      if (!task)
+        continue;
+      h = hash_pid (task->pid) & (size - 1);
+      while (table[h])
+        h = (h + 1) & (size - 1);
+      table[h] = task;
+    }
+
+  free (reg->pid_table);
+  reg->pid_table = table;
+  reg->pid_size = size;
+
+  return 0;
+}
+
+static Task **
+registry_lookup (Registry   *reg,
+                 const char *id)
+{
+  unsigned int h;
+
+  if (!reg->id_size)
+    return NULL;
+
+  h = hash_id (id) & (reg->id_size - 1);
+  while (reg->id_table[h])
+    {
+      if (!strcmp (reg->id_table[h]->id, id))
+        return &reg->id_table[h];
+      h = (h + 1) & (reg->id_size - 1);
+    }
+
+  return NULL;
+}
+
+static Task *
+lookup_task (const char *id)
+{
+  Task **slot;
+
+  slot = registry_lookup (&registry, id);
+
+  return slot ? *slot : NULL;
+}
+
+static Task *
+lookup_task_by_pid (pid_t pid)
+{
+  unsigned int h;
+
+  if (!registry.pid_size || pid <= 0)
+    return NULL;
+
+  h = hash_pid (pid) & (registry.pid_size - 1);
+  while (registry.pid_table[h])
+    {
+      if (registry.pid_table[h]->pid == pid)
+        return registry.pid_table[h];
+      h = (h + 1) & (registry.pid_size - 1);
+    }
+
+  return NULL;
+}
+
+static void
+unlink_task_pid (Task *task)
+{
+  unsigned int mask;
+  unsigned int h;
+  unsigned int j;
+
+  if (!registry.pid_size || task->pid <= 0)
+    return;
+
+  mask = registry.pid_size - 1;
+  h = hash_pid (task->pid) & mask;
+  while (registry.pid_table[h] != task)
+    {
+      if (!registry.pid_table[h])
+        return;
+      h = (h + 1) & mask;
+    }
+
+  /* backward shift deletion, no tombstones. */
+  registry.pid_table[h] = NULL;
+  registry.pid_count--;
+  for (j = (h + 1) & mask; registry.pid_table[j]; j = (j + 1) & mask)
+    {
+      unsigned int home;
+
+      home = hash_pid (registry.pid_table[j]->pid) & mask;
+      if (((j - home) & mask) >= ((j - h) & mask))
+        {
+          registry.pid_table[h] = registry.pid_table[j];
+          registry.pid_table[j] = NULL;
+          h = j;
+        }
+    }
+}
+
+/* every change of 'task->pid' goes through here to keep 'pid_table' valid. */
+static void
+set_task_pid (Task  *task,
+              pid_t  pid)
+{
+  unsigned int h;
+
+  unlink_task_pid (task);
+  task->pid = pid;
+  if (pid <= 0)
+    return;
+
+  if ((registry.pid_count + 1) * 2 > registry.pid_size
+      && registry_grow_pids (&registry))
+    {
+      MSG ("failed to grow pid table: %s\n", STRERROR);
+      return;
+    }
+
+  h = hash_pid (pid) & (registry.pid_size - 1);
+  while (registry.pid_table[h])
+    h = (h + 1) & (registry.pid_size - 1);
+  registry.pid_table[h] = task;
+  registry.pid_count++;
+}
+
+/* double the records, the file first so that readers can always map them. */
+static int
+grow_board (void)
+{
+  void   *data;
+  size_t  size;
+  int    *free_list;
+  int     max;
+
+  max = board_max ? board_max * 2 : 64;
+  size = sizeof (BoardHeader) + max * sizeof (BoardRecord);
+
+  free_list = realloc (board_free, max * sizeof (int));
+  if (!free_list)
+    return -1;
+  board_free = free_list;
+
+  if (ftruncate (board_fd, size))
+    return -1;
+  if (board)
+    data = mremap (board, board_size, size, MREMAP_MAYMOVE);
+  else
+    data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, board_fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+
+  board = data;
+  board_size = size;
+  board_max = max;
+
+  return 0;
+}
+
+static void
+setup_board (void)
+{
+  if (!board_file)
+    {
+      snprintf (board_path, sizeof (board_path), "/dev/shm/procman.%d",
+                (int) getpid ());
+      board_file = board_path;
+    }
+
+  board_fd = open (board_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (board_fd < 0)
+    {
+      MSG ("no status board, failed to open '%s': %s\n", board_file, STRERROR);
+      return;
+    }
+
+  if (grow_board ())
+    {
+      MSG ("no status board, failed to map '%s': %s\n", board_file, STRERROR);
+      close (board_fd);
+      board_fd = -1;
+      unlink (board_file);
+      return;
+    }
+
+  board->version = BOARD_VERSION;
+  board->record_size = sizeof (BoardRecord);
+  board->pid = getpid ();
+  board->start_time = realtime_ns ();
+  __atomic_store_n (&board->magic, BOARD_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void
+close_board (void)
+{
+  if (!board)
+    return;
+
+  munmap (board, board_size);
+  board = NULL;
+  close (board_fd);
+  board_fd = -1;
+  unlink (board_file);
+}
+
+/* publish 'task' on the status board, no syscalls and no waiting. */
+static void
+board_update (Task *task)
+{
+  BoardRecord value;
+
+  if (!board || task->board < 0)
+    return;
+
+  value.state = task->state;
+  value.pid = task->pid;
+  value.restarts = task->restarts;
+  value.exit_status = task->exit_status;
+  strncpy (value.id.str, task->id, BOARD_ID_LEN);
+  value.spawn_time = task->spawn_realtime;
+  value.uptime = task->uptime;
+  value.queue_delay = task->queue_delay;
+  board_write (&BOARD_RECORDS (board)[task->board], &value);
+  stats.board_updates++;
+}
+
+static void
+board_add (Task *task)
+{
+  unsigned int count;
+
+  task->board = -1;
+  if (!board)
+    return;
+
+  if (board_free_len > 0)
+    {
+      task->board = board_free[--board_free_len];
+      board_update (task);
+      return;
+    }
+
+  count = board->count;
+  if ((int) count == board_max && grow_board ())
+    {
+      MSG ("failed to grow status board: %s\n", STRERROR);
+      return;
+    }
+
+  /* readers only look below 'count', so the record goes first. */
+  task->board = count;
+  board_update (task);
+  __atomic_store_n (&board->count, count + 1, __ATOMIC_RELEASE);
+}
+
+static void
+board_remove (Task *task)
+{
+  BoardRecord value;
+
+  if (!board || task->board < 0)
+    return;
+
+  memset (&value, 0x00, sizeof (value));
+  value.state = -1;
+  value.exit_status = -1;
+  board_write (&BOARD_RECORDS (board)[task->board], &value);
+  board_free[board_free_len++] = task->board;
+  task->board = -1;
+}
+
+/* every change of 'task->state' goes through here to keep the board valid. */
+static void
+set_task_state (Task      *task,
+                TaskState  state)
+{
+  task->state = state;
+  board_update (task);
+}
+
+static void
+set_task_held (Task *task,
+               int   held)
+{
+  if (task->held == held)
+    return;
+  task->held = held;
+  held_tasks += held ? 1 : -1;
+}
+
+/* an uninitialized record, from the free list or the last slab. */
+static Task *
+slab_alloc_task (void)
+{
+  TaskSlab *slab;
+  Task     *task;
+
+  task = task_free;
+  if (task)
+    {
+      task_free = task->replaces;
+      task_records++;
+      return task;
+    }
+
+  slab = task_slabs;
+  if (!slab || slab->used == TASK_SLAB)
+    {
+      slab = mmap (NULL, sizeof (TaskSlab), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (slab == MAP_FAILED)
+        return NULL;
+      slab->next = task_slabs;
+      slab->used = 0;
+      task_slabs = slab;
+      task_slab_count++;
+    }
+
+  task_records++;
+
+  return &slab->tasks[slab->used++];
+}
+
+static void
+slab_free_task (Task *task)
+{
+  task->replaces = task_free;
+  task_free = task;
+  task_records--;
+}
+
+static void
+append_task (Task *task)
+{
+  Task        *new_task;
+  unsigned int h;
+
+  if (registry.task_count == registry.task_max)
+    {
+      Task **tasks;
+      int    max;
+
+      max = registry.task_max ? registry.task_max * 2 : 64;
+      tasks = realloc (registry.tasks, max * sizeof (Task *));
+      if (!tasks)
+        {
+          MSG ("failed to allocate a task: %s\n", STRERROR);
+          return;
+        }
+      registry.tasks = tasks;
+      registry.task_max = max;
+    }
+
+  if ((registry.task_count + 1) * 2 > registry.id_size
+      && registry_grow_ids (&registry))
+    {
+      MSG ("failed to allocate a task: %s\n", STRERROR);
+      return;
+    }
+
+  new_task = slab_alloc_task ();
+  if (!new_task)
+    {
+      MSG ("failed to allocate a task: %s\n", STRERROR);
+      return;
+    }
+
+  *new_task = *task;
+  new_task->seq = registry.task_count;
+  new_task->config = config_ref (registry.config);
+  new_task->notify_fd = -1;
+  new_task->pidfd = -1;
+  new_task->pid_watch.fd = -1;
+  new_task->notify_watch.fd = -1;
+  new_task->log_watch.fd = -1;
+  new_task->log_fd = -1;
+  new_task->cpu = -1;
+  new_task->exit_status = -1;
+  board_add (new_task);
+
+  h = hash_id (new_task->id) & (registry.id_size - 1);
+  while (registry.id_table[h])
+    h = (h + 1) & (registry.id_size - 1);
+  registry.id_table[h] = new_task;
+
+  registry.tasks[registry.task_count++] = new_task;
+}
+
+/* replicas=N makes 'id.0' to 'id.<N-1>' out of one entry. */
+static void
+append_replicas (Task *task)
+{
+  char id[ID_MAX + 1];
+  int  i;
+
+  if (!task->replicas)
+    {
+      append_task (task);
+      return;
+    }
+
+  strcpy (id, task->id);
+  for (i = 0; i < task->replicas; i++)
+    {
+      snprintf (task->id, sizeof (task->id), "%s.%d", id, i);
+      task->replica = i;
+      append_task (task);
+    }
+}
+
+/* higher 'order' is launched first, ties keep the config file order. */
+static int
+compare_task_order (const void *a,
+                    const void *b)
+{
+  const Task *ta = *(const Task **) a;
+  const Task *tb = *(const Task **) b;
+
+  if (ta->order != tb->order)
+    return ta->order > tb->order ? -1 : 1;
+
+  return ta->seq - tb->seq;
+}
+
+/*
+ * Split the optional options field off 'str'.
+ *
+ * The field sits between pipe-id and command, and is a whitespace
+ * separated list of 'key=value' pairs where a value can be double quoted
+ * to hold spaces or colons.  If 'str' does not start with such a list
+ * followed by ':', it is all command and NULL is returned.
+ */
+static char *
+split_options (char  *str,
+               char **command)
+{
+  char *p;
+
+  p = str;
+  for (;;)
+    {
+      while (isspace (*p))
+        p++;
+      if (*p == ':')
+        break;
+
+      if (!islower (*p))
+        return NULL;
+      while (islower (*p) || isdigit (*p) || *p == '.' || *p == '-')
+        p++;
+      if (*p != '=')
+        return NULL;
+      p++;
+
+      if (*p == '"')
+        {
+          p = strchr (p + 1, '"');
+          if (!p)
+            return NULL;
+          p++;
+        }
+      else
+        while (*p && *p != ':' && !isspace (*p))
+          p++;
+
+      if (*p != ':' && !isspace (*p))
+        return NULL;
+    }
+
+  *p = '\0';
+  *command = p + 1;
+
+  return str;
+}
+
+/* Get the next 'key=value' pair from the options field. */
+static int
+next_option (char **str,
+             char **key,
+             char **value)
+{
+  char *p;
+
+  p = *str;
+  while (isspace (*p))
+    p++;
+  if (*p == '\0')
+    return 0;
+
+  *key = p;
+  p = strchr (p, '=');
+  *p++ = '\0';
+
+  if (*p == '"')
+    {
+      *value = ++p;
+      p = strchr (p, '"');
+    }
+  else
+    {
+      *value = p;
+      while (*p && !isspace (*p))
+        p++;
+    }
+  if (*p)
+    *p++ = '\0';
+
+  *str = p;
+
+  return 1;
+}
+
+static int
+set_task_option (Task *task,
+                 char *key,
+                 char *value)
+{
+  if (!strcmp (key, "after"))
+    {
+      task->after = value;
+    }
+  else if (!strcmp (key, "requires"))
+    {
+      task->requires = value;
+    }
+  else if (!strcmp (key, "ready-timeout"))
+    {
+      if (parse_duration (value, &task->ready_timeout))
+        return -1;
+    }
+  else if (!strcmp (key, "grace"))
+    {
+      if (parse_duration (value, &task->grace))
+        return -1;
+    }
+  else if (!strcmp (key, "input"))
+    {
+      if (check_valid_id (value))
+        return -1;
+      task->input = value;
+    }
+  else if (!strcmp (key, "pipe-size"))
+    {
+      if (parse_size (value, &task->pipe_size))
+        return -1;
+    }
+  else if (!strcmp (key, "backoff"))
+    {
+      if (parse_duration (value, &task->backoff))
+        return -1;
+    }
+  else if (!strcmp (key, "backoff-max"))
+    {
+      if (parse_duration (value, &task->backoff_max))
+        return -1;
+    }
+  else if (!strcmp (key, "stable"))
+    {
+      if (parse_duration (value, &task->stable))
+        return -1;
+    }
+  else if (!strcmp (key, "restart-limit"))
+    {
+      if (parse_limit (value, &task->limit_burst, &task->limit_period))
+        return -1;
+    }
+  else if (!strcmp (key, "quarantine"))
+    {
+      if (parse_limit (value, &task->quarantine_count,
+                       &task->quarantine_window))
+        return -1;
+    }
+  else if (!strncmp (key, "cpu.", 4)
+           || !strncmp (key, "memory.", 7)
+           || !strncmp (key, "io.", 3))
+    {
+      int i;
+
+      for (i = 0; i < LIMIT_COUNT; i++)
+        if (!strcmp (key, cgroup_limits[i].file))
+          break;
+      if (i == LIMIT_COUNT || cgroup_limits[i].check (value))
+        return -1;
+      task->limits[i] = value;
+    }
+  else if (!strcmp (key, "cpus") || !strcmp (key, "numa")
+           || !strcmp (key, "nice") || !strcmp (key, "ioprio")
+           || !strcmp (key, "sched"))
+    {
+      int i;
+
+      for (i = 0; i < PLACE_COUNT; i++)
+        if (!strcmp (key, task_places[i].key))
+          break;
+      if (task_places[i].check (value))
+        return -1;
+      task->places[i] = value;
+    }
+  else if (!strcmp (key, "listen"))
+    {
+      if (check_listen (value))
+        return -1;
+      task->listen = value;
+    }
+  else if (!strcmp (key, "replicas"))
+    {
+      char *end;
+      long  n;
+
+      n = strtol (value, &end, 10);
+      if (end == value || *end || n < 1 || n > REPLICAS_MAX)
+        return -1;
+      task->replicas = n;
+    }
+  else if (!strcmp (key, "zygote"))
+    {
+      if (!strcasecmp (value, "yes"))
+        task->zygote = 1;
+      else if (!strcasecmp (value, "no"))
+        task->zygote = 0;
+      else
+        return -1;
+    }
+  else if (!strcmp (key, "overlap"))
+    {
+      if (!strcasecmp (value, "yes"))
+        task->overlap = 1;
+      else if (!strcasecmp (value, "no"))
+        task->overlap = 0;
+      else
+        return -1;
+    }
+  else if (!strcmp (key, "every"))
+    {
+      if (parse_duration (value, &task->every) || task->every <= 0)
+        return -1;
+    }
+  else if (!strcmp (key, "at"))
+    {
+      if (parse_calendar (value, &task->calendar))
+        return -1;
+    }
+  else if (!strcmp (key, "timeout"))
+    {
+      if (parse_duration (value, &task->timeout))
+        return -1;
+    }
+  else if (!strcmp (key, "priority"))
+    {
+      char *end;
+      long  n;
+
+      n = strtol (value, &end, 10);
+      if (end == value || *end || n < -1000 || n > 1000)
+        return -1;
+      task->priority = n;
+    }
+  else if (!strcmp (key, "overrun"))
+    {
+      if (!strcasecmp (value, "skip"))
+        task->overrun = OVERRUN_SKIP;
+      else if (!strcasecmp (value, "queue"))
+        task->overrun = OVERRUN_QUEUE;
+      else if (!strcasecmp (value, "kill-previous"))
+        task->overrun = OVERRUN_KILL;
+      else
+        return -1;
+    }
+  else if (!strcmp (key, "ready"))
+    {
+      if (!strcasecmp (value, "spawn"))
+        task->ready = READY_SPAWN;
+      else if (!strcasecmp (value, "notify"))
+        task->ready = READY_NOTIFY;
+      else
+        return -1;
+    }
+  else
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Map 'filename' privately and writable, so the parser can cut it into
+ * strings in place, with a '\0' after the last byte.  Truncating a file
+ * drops even the private copies of its pages, so with 'copy' the file is
+ * read into the mapping instead: the config file is edited in place while
+ * tasks still point into it, the snapshot only ever replaced by rename().
+ */
+static Config *
+map_config (const char *filename,
+            int         copy)
+{
+  Config     *config;
+  struct stat st;
+  char       *data;
+  int         fd;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* the extra byte comes from the anonymous mapping below the file. */
+  data = mmap (NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (copy)
+    {
+      ssize_t n;
+      off_t   len;
+
+      /* a file shrunk meanwhile leaves '\0's, read as an empty line. */
+      for (len = 0; len < st.st_size; len += n)
+        {
+          n = read (fd, data + len, st.st_size - len);
+          if (n < 0 && errno == EINTR)
+            n = 0;
+          else if (n <= 0)
+            break;
+        }
+    }
+  else if (st.st_size > 0
+           && mmap (data, st.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+      munmap (data, st.st_size + 1);
+      close (fd);
+      return NULL;
+    }
+  close (fd);
+  data[st.st_size] = '\0';
+
+  config = calloc (1, sizeof (Config));
+  if (!config)
+    {
+      munmap (data, st.st_size + 1);
+      return NULL;
+    }
+  config->data = data;
+  config->size = st.st_size;
+  config->refs = 1;
+
+  return config;
+}
+
+/* of the config file and PATH, which resolve_command() depends on. */
+static unsigned long long
+hash_config (Config *config)
+{
+  unsigned long long h;
+  const char        *p;
+  size_t             i;
+
+  /* FNV-1a */
+  h = 14695981039346656037ull;
+  for (i = 0; i < config->size; i++)
+    h = (h ^ (unsigned char) config->data[i]) * 1099511628211ull;
+  for (p = getenv ("PATH"); p && *p; p++)
+    h = (h ^ (unsigned char) *p) * 1099511628211ull;
+
+  return h;
+}
+
+static int
+push_argv (Config *config,
+           char   *arg)
+{
+  if (config->argv_len == config->argv_max)
+    {
+      char **argv;
+      int    max;
+
+      max = config->argv_max ? config->argv_max * 2 : 256;
+      argv = realloc (config->argv, max * sizeof (char *));
+      if (!argv)
+        return -1;
+      config->argv = argv;
+      config->argv_max = max;
+    }
+
+  config->argv[config->argv_len++] = arg;
+
+  return 0;
+}
+
+/*
+ * Cut 'str' into arguments in place and append them to the argv table of
+ * 'config', ended by NULL.  Returns the index of the first one, the table
+ * may still move, so Task.argv is set when the whole config is read.
+ */
+static int
+split_command (Config *config,
+               char   *str)
+{
+  int index;
+
+  index = config->argv_len;
+  while (*str)
+    {
+      if (push_argv (config, str))
+        return -1;
+      while (*str && !isspace (*str))
+        str++;
+      if (*str)
+        *str++ = '\0';
+      while (isspace (*str))
+        str++;
+    }
+  if (push_argv (config, NULL))
+    return -1;
+
+  if (0)
+    {
+      int n;
+
+      for (n = index; config->argv[n] != NULL; n++)
+        MSG ("  argv[%d]:%s\n", n - index, config->argv[n]);
+    }
+
+  return index;
+}
+
+/*
+ * Find the executable for 'name' in PATH the way execvp() does, so that
+ * it is done once at load time instead of on every spawn.  Results are
+ * cached per config since most tasks run the same few programs.  NULL if
+ * not found, then PATH is searched again at spawn time.
+ */
+static char *
+resolve_command (Config *config,
+                 char   *name)
+{
+  const char *path;
+  const char *p;
+  char        buf[PATH_MAX];
+  char       *found;
+  int         i;
+
+  if (strchr (name, '/'))
+    return name;
+
+  for (i = 0; i < config->paths_len; i += 2)
+    if (!strcmp (config->paths[i], name))
+      return config->paths[i + 1];
+
+  path = getenv ("PATH");
+  if (!path)
+    path = "/bin:/usr/bin";
+
+  found = NULL;
+  for (p = path; p && !found; )
+    {
+      const char *e;
+      int         len;
+
+      e = strchr (p, ':');
+      len = e ? e - p : (int) strlen (p);
+      if (len == 0)
+        snprintf (buf, sizeof (buf), "%s", name);
+      else
+        snprintf (buf, sizeof (buf), "%.*s/%s", len, p, name);
+      if (!access (buf, X_OK))
+        found = strdup (buf);
+      p = e ? e + 1 : NULL;
+    }
+
+  if (config->paths_len + 2 > config->paths_max)
+    {
+      char **paths;
+      int    max;
+
+      max = config->paths_max ? config->paths_max * 2 : 16;
+      paths = realloc (config->paths, max * sizeof (char *));
+      if (!paths)
+        return found;
+      config->paths = paths;
+      config->paths_max = max;
+    }
+  config->paths[config->paths_len++] = name;
+  config->paths[config->paths_len++] = found;
+
+  return found;
+}
+
+/* the diagnostics of parse_config(), see SnapshotHeader. */
+static char  *config_notes;
+static size_t config_notes_len;
+
+static void
+config_msg (const char *format,
+            ...)
+{
+  va_list ap;
+  char    buf[512];
+  char   *notes;
+  int     len;
+
+  va_start (ap, format);
+  len = vsnprintf (buf, sizeof (buf), format, ap);
+  va_end (ap);
+  if (len < 0)
+    return;
+  if (len >= (int) sizeof (buf))
+    len = sizeof (buf) - 1;
+
+  fputs (buf, stderr);
+  notes = realloc (config_notes, config_notes_len + len + 1);
+  if (!notes)
+    return;
+  memcpy (notes + config_notes_len, buf, len + 1);
+  config_notes = notes;
+  config_notes_len += len;
+}
+
+static char *
+snapshot_name (const char *filename)
+{
+  char *name;
+
+  name = malloc (strlen (filename) + 8);
+  if (name)
+    sprintf (name, "%s.bin", filename);
+
+  return name;
+}
+
+/* string offset in the snapshot string table. */
+static unsigned int
+snapshot_string (char        **strings,
+                 unsigned int *len,
+                 unsigned int *max,
+                 const char   *str)
+{
+  unsigned int offset;
+  size_t       n;
+
+  if (!str)
+    return 0;
+
+  n = strlen (str) + 1;
+  if (*len + n > *max)
+    {
+      char        *p;
+      unsigned int m;
+
+      for (m = *max ? *max : 4096; *len + n > m; m *= 2)
+        ;
+      p = realloc (*strings, m);
+      if (!p)
+        return 0;
+      *strings = p;
+      *max = m;
+    }
+
+  offset = *len;
+  memcpy (*strings + offset, str, n);
+  *len += n;
+
+  return offset;
+}
+
+/* write the tasks just read from 'filename' as its snapshot. */
+static void
+write_snapshot (const char         *filename,
+                unsigned long long  hash)
+{
+  SnapshotHeader header;
+  SnapshotTask  *records;
+  unsigned int  *argv;
+  char          *strings;
+  unsigned int   strings_len;
+  unsigned int   strings_max;
+  unsigned int   argv_len;
+  unsigned int   notes;
+  char          *name;
+  char          *tmp;
+  FILE          *fp;
+  int            failed;
+  int            i;
+
+  /* replicas share the argv of the config but each records its own. */
+  argv_len = 0;
+  for (i = 0; i < registry.task_count; i++)
+    {
+      int j;
+
+      for (j = 0; registry.tasks[i]->argv[j]; j++)
+        argv_len++;
+      argv_len++;
+    }
+
+  records = calloc (registry.task_count + 1, sizeof (SnapshotTask));
+  argv = malloc ((argv_len + 1) * sizeof (unsigned int));
+  name = snapshot_name (filename);
+  tmp = name ? malloc (strlen (name) + 8) : NULL;
+  strings = NULL;
+  if (!records || !argv || !tmp)
+    goto out;
+
+  /* offset 0 is NULL. */
+  strings_len = 0;
+  strings_max = 0;
+  snapshot_string (&strings, &strings_len, &strings_max, "");
+
+  argv_len = 0;
+  for (i = 0; i < registry.task_count; i++)
+    {
+      Task         *task = registry.tasks[i];
+      SnapshotTask *r = &records[i];
+      int           j;
+
+      memcpy (r->id, task->id, sizeof (r->id));
+      memcpy (r->pipe_id, task->pipe_id, sizeof (r->pipe_id));
+      r->order = task->order;
+      r->action = task->action;
+      r->ready = task->ready;
+      r->piped = task->piped;
+      r->consumers = task->consumers;
+      r->pipe_size = task->pipe_size;
+      r->overlap = task->overlap;
+      r->zygote = task->zygote;
+      r->replica = task->replica;
+      r->replicas = task->replicas;
+      r->limit_burst = task->limit_burst;
+      r->quarantine_count = task->quarantine_count;
+      r->ready_timeout = task->ready_timeout;
+      r->backoff = task->backoff;
+      r->backoff_max = task->backoff_max;
+      r->stable = task->stable;
+      r->limit_period = task->limit_period;
+      r->quarantine_window = task->quarantine_window;
+      r->grace = task->grace;
+      r->overrun = task->overrun;
+      r->priority = task->priority;
+      r->every = task->every;
+      r->timeout = task->timeout;
+      r->calendar = task->calendar;
+
+      r->argv = argv_len;
+      for (j = 0; task->argv[j]; j++)
+        argv[argv_len++] = snapshot_string (&strings, &strings_len,
+                                            &strings_max, task->argv[j]);
+      argv[argv_len++] = 0;
+      r->path = snapshot_string (&strings, &strings_len, &strings_max,
+                                 task->path);
+      r->after = snapshot_string (&strings, &strings_len, &strings_max,
+                                  task->after);
+      r->requires = snapshot_string (&strings, &strings_len, &strings_max,
+                                     task->requires);
+      r->input = snapshot_string (&strings, &strings_len, &strings_max,
+                                  task->input);
+      r->listen = snapshot_string (&strings, &strings_len, &strings_max,
+                                   task->listen);
+      for (j = 0; j < LIMIT_COUNT; j++)
+        r->limits[j] = snapshot_string (&strings, &strings_len, &strings_max,
+                                        task->limits[j]);
+      for (j = 0; j < PLACE_COUNT; j++)
+        r->places[j] = snapshot_string (&strings, &strings_len, &strings_max,
+                                        task->places[j]);
+    }
+  notes = snapshot_string (&strings, &strings_len, &strings_max,
+                           config_notes);
+  if (!strings)
+    goto out;
+
+  memset (&header, 0x00, sizeof (header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.hash = hash;
+  header.task_size = sizeof (SnapshotTask);
+  header.task_count = registry.task_count;
+  header.argv_count = argv_len;
+  header.strings_size = strings_len;
+  header.notes = notes;
+
+  /* rename() it in place, so a reader never maps a partial one. */
+  sprintf (tmp, "%s.tmp", name);
+  fp = fopen (tmp, "w");
+  if (!fp)
+    goto out;
+  failed = fwrite (&header, sizeof (header), 1, fp) != 1
+    || fwrite (records, sizeof (SnapshotTask), header.task_count, fp)
+       != header.task_count
+    || fwrite (argv, sizeof (unsigned int), argv_len, fp) != argv_len
+    || fwrite (strings, 1, strings_len, fp) != strings_len;
+  /* the FILE is gone either way. */
+  if (fclose (fp))
+    failed = 1;
+  if (failed || rename (tmp, name))
+    {
+      MSG ("failed to write snapshot '%s': %s\n", name, STRERROR);
+      unlink (tmp);
+    }
+
+ out:
+  free (records);
+  free (argv);
+  free (strings);
+  free (name);
+  free (tmp);
+}
+
+/*
+ * Map the snapshot of 'filename' if it is up to date, and make a task of
+ * each record.  Tasks point right into the mapping, only the argv vectors
+ * need a table of pointers.
+ */
+static int
+read_snapshot (const char         *filename,
+               unsigned long long  hash)
+{
+  SnapshotHeader *header;
+  SnapshotTask   *records;
+  unsigned int   *argv;
+  const char     *strings;
+  Config         *config;
+  char           *name;
+  unsigned int    i;
+
+  name = snapshot_name (filename);
+  config = name ? map_config (name, 0) : NULL;
+  free (name);
+  if (!config)
+    return -1;
+
+  header = (SnapshotHeader *) config->data;
+  if (config->size < sizeof (SnapshotHeader)
+      || header->magic != SNAPSHOT_MAGIC
+      || header->version != SNAPSHOT_VERSION
+      || header->hash != hash
+      || header->task_size != sizeof (SnapshotTask)
+      || config->size != sizeof (SnapshotHeader)
+                         + (size_t) header->task_count * sizeof (SnapshotTask)
+                         + (size_t) header->argv_count * sizeof (unsigned int)
+                         + header->strings_size
+      || header->strings_size == 0)
+    goto invalid;
+
+  records = (SnapshotTask *) (header + 1);
+  argv = (unsigned int *) (records + header->task_count);
+  strings = (const char *) (argv + header->argv_count);
+  if (strings[header->strings_size - 1] != '\0')
+    goto invalid;
+  for (i = 0; i < header->argv_count; i++)
+    if (argv[i] >= header->strings_size)
+      goto invalid;
+  if (header->argv_count && argv[header->argv_count - 1])
+    goto invalid;
+  if (header->notes >= header->strings_size)
+    goto invalid;
+  if (header->notes)
+    fputs (strings + header->notes, stderr);
+
+  config->argv = malloc ((header->argv_count + 1) * sizeof (char *));
+  if (!config->argv)
+    goto invalid;
+  for (i = 0; i < header->argv_count; i++)
+    config->argv[i] = argv[i] ? (char *) strings + argv[i] : NULL;
+  config->argv_len = header->argv_count;
+
+  registry.config = config;
+  for (i = 0; i < header->task_count; i++)
+    {
+      SnapshotTask *r = &records[i];
+      Task          task;
+      int           j;
+
+      for (j = 0; j < LIMIT_COUNT; j++)
+        if (r->limits[j] >= header->strings_size)
+          break;
+      if (j < LIMIT_COUNT)
+        continue;
+      for (j = 0; j < PLACE_COUNT; j++)
+        if (r->places[j] >= header->strings_size)
+          break;
+      if (j < PLACE_COUNT
+          || r->argv >= header->argv_count
+          || r->path >= header->strings_size
+          || r->after >= header->strings_size
+          || r->requires >= header->strings_size
+          || r->input >= header->strings_size
+          || r->listen >= header->strings_size
+          || r->id[TASK_ID_MAX] || r->pipe_id[ID_MAX])
+        continue;
+
+      memset (&task, 0x00, sizeof (task));
+      memcpy (task.id, r->id, sizeof (task.id));
+      memcpy (task.pipe_id, r->pipe_id, sizeof (task.pipe_id));
+      task.order = r->order;
+      task.action = r->action;
+      task.ready = r->ready;
+      task.piped = r->piped;
+      task.consumers = r->consumers;
+      task.pipe_size = r->pipe_size;
+      task.overlap = r->overlap;
+      task.zygote = r->zygote;
+      task.replica = r->replica;
+      task.replicas = r->replicas;
+      task.limit_burst = r->limit_burst;
+      task.quarantine_count = r->quarantine_count;
+      task.ready_timeout = r->ready_timeout;
+      task.backoff = r->backoff;
+      task.backoff_max = r->backoff_max;
+      task.stable = r->stable;
+      task.limit_period = r->limit_period;
+      task.quarantine_window = r->quarantine_window;
+      task.grace = r->grace;
+      task.overrun = r->overrun;
+      task.priority = r->priority;
+      task.every = r->every;
+      task.timeout = r->timeout;
+      task.calendar = r->calendar;
+      task.argv = config->argv + r->argv;
+      task.path = r->path ? (char *) strings + r->path : NULL;
+      task.after = r->after ? (char *) strings + r->after : NULL;
+      task.requires = r->requires ? (char *) strings + r->requires : NULL;
+      task.input = r->input ? (char *) strings + r->input : NULL;
+      task.listen = r->listen ? (char *) strings + r->listen : NULL;
+      for (j = 0; j < LIMIT_COUNT; j++)
+        task.limits[j] = r->limits[j] ? (char *) strings + r->limits[j] : NULL;
+      for (j = 0; j < PLACE_COUNT; j++)
+        task.places[j] = r->places[j] ? (char *) strings + r->places[j] : NULL;
+
+      append_task (&task);
+    }
+  config_unref (config);
+
+  return 0;
+
+ invalid:
+  config_unref (config);
+
+  return -1;
+}
+
+/* a record of 'o' as it comes from the config, without any state. */
+static void
+copy_entry (Task       *task,
+            const Task *o)
+{
+  memset (task, 0x00, sizeof (*task));
+  memcpy (task->id, o->id, sizeof (task->id));
+  memcpy (task->pipe_id, o->pipe_id, sizeof (task->pipe_id));
+  task->order = o->order;
+  task->action = o->action;
+  task->ready = o->ready;
+  task->piped = o->piped;
+  task->consumers = o->consumers;
+  task->pipe_size = o->pipe_size;
+  task->overlap = o->overlap;
+  task->zygote = o->zygote;
+  task->replica = o->replica;
+  task->replicas = o->replicas;
+  task->limit_burst = o->limit_burst;
+  task->quarantine_count = o->quarantine_count;
+  task->ready_timeout = o->ready_timeout;
+  task->backoff = o->backoff;
+  task->backoff_max = o->backoff_max;
+  task->stable = o->stable;
+  task->limit_period = o->limit_period;
+  task->quarantine_window = o->quarantine_window;
+  task->grace = o->grace;
+  task->overrun = o->overrun;
+  task->priority = o->priority;
+  task->every = o->every;
+  task->timeout = o->timeout;
+  task->calendar = o->calendar;
+  task->config = o->config;
+  task->argv = o->argv;
+  task->path = o->path;
+  task->after = o->after;
+  task->requires = o->requires;
+  task->input = o->input;
+  task->listen = o->listen;
+  memcpy (task->limits, o->limits, sizeof (task->limits));
+  memcpy (task->places, o->places, sizeof (task->places));
+}
+
+/*
+ * 'scale' of the control socket overrides replicas= of an entry, until
+ * the entry is changed in the config file.
+ */
+typedef struct _Scale Scale;
+struct _Scale
+{
+  char id[ID_MAX + 1];
+  int  count;
+  int  config;                  /* replicas= it overrides */
+  Task entry;                   /* replica 0, for a scale up from 0 */
+};
+
+static Scale *scales;
+static int    scales_len;
+static int    scales_max;
+
+static void free_task (Task *task);
+
+/* the Scale of replica 'id', or of entry 'id' if 'len' is its length. */
+static Scale *
+lookup_scale (const char *id,
+              int         len)
+{
+  int i;
+
+  for (i = 0; i < scales_len; i++)
+    if (!strncmp (scales[i].id, id, len) && scales[i].id[len] == '\0')
+      return &scales[i];
+
+  return NULL;
+}
+
+/*
+ * Drop the replicas beyond the count of their Scale, and clone the missing
+ * ones from replica 0, before the startup order is set up.  A Scale keeps
+ * its own record of replica 0 (and a reference to its Config), so the
+ * entry survives a scale to 0.
+ */
+static void
+apply_scales (void)
+{
+  Config *config;
+  Scale  *scale;
+  int     n;
+  int     i;
+
+  if (!scales_len)
+    return;
+
+  n = 0;
+  for (i = 0; i < registry.task_count; i++)
+    {
+      Task *task = registry.tasks[i];
+
+      scale = NULL;
+      if (task->replicas)
+        scale = lookup_scale (task->id, strchr (task->id, '.') - task->id);
+      if (scale && scale->config != task->replicas)
+        scale->count = -1;
+      if (scale && scale->count >= 0)
+        {
+          /* the entry as of this config, for a scale up from 0. */
+          if (task->replica == 0)
+            {
+              config = scale->entry.config;
+              copy_entry (&scale->entry, task);
+              config_ref (scale->entry.config);
+              config_unref (config);
+            }
+          task->replicas = scale->count;
+          if (task->replica >= scale->count)
+            {
+              free_task (task);
+              continue;
+            }
+        }
+      registry.tasks[n++] = task;
+    }
+  registry.task_count = n;
+
+  memset (registry.id_table, 0x00, registry.id_size * sizeof (Task *));
+  for (i = 0; i < registry.task_count; i++)
+    {
+      unsigned int h;
+
+      h = hash_id (registry.tasks[i]->id) & (registry.id_size - 1);
+      while (registry.id_table[h])
+        h = (h + 1) & (registry.id_size - 1);
+      registry.id_table[h] = registry.tasks[i];
+    }
+
+  for (n = 0, i = 0; i < scales_len; i++)
+    {
+      Task *first;
+      Task  task;
+      char  id[TASK_ID_MAX + 1];
+      int   j;
+
+      /* the config changed under it. */
+      scale = &scales[i];
+      if (scale->count < 0)
+        {
+          config_unref (scale->entry.config);
+          continue;
+        }
+      scales[n++] = *scale;
+
+      snprintf (id, sizeof (id), "%s.0", scale->id);
+      first = lookup_task (id);
+      if (!first)
+        continue;
+      /* of replica 0, a kept one may be from an older config. */
+      config = registry.config;
+      registry.config = first->config;
+      for (j = 0; j < scale->count && j < REPLICAS_MAX; j++)
+        {
+          task = *first;
+          snprintf (task.id, sizeof (task.id), "%s.%d", scale->id, j);
+          if (lookup_task (task.id))
+            continue;
+          task.replica = j;
+          append_task (&task);
+        }
+      registry.config = config;
+    }
+  scales_len = n;
+
+  /* the clones go at the end of their level, 'seq' indexes them anew. */
+  qsort (registry.tasks, registry.task_count, sizeof (Task *),
+         compare_task_order);
+  for (i = 0; i < registry.task_count; i++)
+    registry.tasks[i]->seq = i;
+}
+
+/*
+ * The tasks of the loaded config again, for a scale without reading the
+ * file: a fresh record of each entry, replica 0 of a scaled one from its
+ * Scale, then apply_scales() as read_config() does.
+ */
+static int
+expand_config (Registry *old)
+{
+  char *added;
+  int   failed;
+  int   i;
+
+  added = calloc (scales_len + 1, 1);
+  if (!added)
+    return -1;
+
+  failed = 0;
+  for (i = 0; i < old->task_count + scales_len; i++)
+    {
+      Task  *o;
+      Task   task;
+      Scale *scale;
+      int    count;
+
+      if (i < old->task_count)
+        {
+          o = old->tasks[i];
+          scale = NULL;
+          if (o->replicas)
+            scale = lookup_scale (o->id, strchr (o->id, '.') - o->id);
+        }
+      else
+        {
+          /* scaled to 0, not in 'old'. */
+          scale = &scales[i - old->task_count];
+          o = &scale->entry;
+        }
+      if (scale)
+        {
+          if (added[scale - scales])
+            continue;
+          added[scale - scales] = 1;
+          o = &scale->entry;
+        }
+
+      copy_entry (&task, o);
+      if (scale)
+        task.replicas = scale->config;
+      count = registry.task_count;
+      registry.config = task.config;
+      append_task (&task);
+      registry.config = NULL;
+      if (registry.task_count == count)
+        failed = 1;
+    }
+  free (added);
+
+  apply_scales ();
+
+  return failed ? -1 : 0;
+}
+
+/*
+ * Parse the config file, mapped and cut into strings in place, so there
+ * is no copy or allocation per field.
+ */
+static int
+parse_config (Config *config)
+{
+  char *line;
+  char *next;
+  char *end;
+  int   line_nr;
+  int   i;
+
+  registry.config = config;
+
+  line_nr = 0;
+  end = config->data + config->size;
+  for (line = config->data; line < end; line = next)
+    {
+      Task  task;
+      char *p;
+      char *s;
+
+      p = memchr (line, '\n', end - line);
+      if (p)
+        {
+          *p = '\0';
+          next = p + 1;
+        }
+      else
+        next = end;
+
+      line_nr++;
+      memset (&task, 0x00, sizeof (task));
+      task.backoff = 100;
+      task.backoff_max = 30 * 1000;
+      task.stable = 1000;
+      task.limit_burst = 10;
+      task.limit_period = 1000;
+      task.quarantine_count = 5;
+      task.quarantine_window = 60 * 1000;
+      task.grace = -1;
+
+      if (0)
+        MSG ("config[%3d] %s\n", line_nr, line);
+
+      line = strstrip (line);
+
+      /* comment or empty line */
+      if (line[0] == '#' || line[0] == '\0')
+        continue;
+
+      /* id */
+      s = line;
+      p = strchr (s, ':');
+      if (!p){
+        config_msg ("id part");
+        goto invalid_line;
+      }
+      *p = '\0';
+      s = strstrip (s);
+      if (check_valid_id (s))
+        {
+          config_msg ("invalid id '%s' in line %d, ignored\n", s, line_nr);
+          continue;
+        }
+      snprintf (task.id, sizeof (task.id), "%s.0", s);
+      if (lookup_task (s) || lookup_task (task.id))
+        {
+          config_msg ("duplicate id '%s' in line %d, ignored\n", s, line_nr);
+          continue;
+        }
+      strcpy (task.id, s);
+
+      /* action */
+      s = p + 1;
+      p = strchr (s, ':');
+      if (!p){
+        config_msg ("action part");
+        goto invalid_line;
+      }
+      *p = '\0';
+      s = strstrip (s);
+      if (!strcasecmp (s, "once"))
+        task.action = ACTION_ONCE;
+      else if (!strcasecmp (s, "respawn"))
+        task.action = ACTION_RESPAWN;
+      else if (!strcasecmp (s, "interval"))
+        task.action = ACTION_INTERVAL;
+      else if (!strcasecmp (s, "calendar"))
+        task.action = ACTION_CALENDAR;
+      else
+        {
+          config_msg ("invalid action '%s' in line %d, ignored\n", s, line_nr);
+          continue;
+        }
+
+      /* order */  //txt에 있는 order를 task구조체의 order에 넣기 위한 부분
+      s = p + 1;
+      p = strchr (s, ':');
+      if (!p){
+        config_msg ("order part");
+        goto invalid_line;
+      }
+      *p = '\0';
+      s = strstrip (s);
+      if(s == NULL) // order가 공백이라면 4자리 랜덤 숫자를 삽입하여 임의의 순서에 시작될 수 있도록 한다.
+          task.order = rand()%10000;
+      else{          // char*인 s를 atoi를 이용하여 int형으로 변형하고 order에 넣는다.
+          if(atoi(s)/10000 == 0)
+              task.order = atoi(s);
+          else
+              config_msg ("invalid order '%d' in line %d, ignored\n", atoi(s), line_nr);
+      }
+
+      /* pipe-id */
+      s = p + 1;
+      p = strchr (s, ':');
+      if (!p){
+        config_msg ("pipe-id part");
+        goto invalid_line;
+      }
+      *p = '\0';
+      s = strstrip (s);
+      if (s[0] != '\0')
+        {
+          Task *t;
+
+          if (check_valid_id (s))
+            {
+              config_msg ("invalid pipe-id '%s' in line %d, ignored\n", s, line_nr);
+              continue;
+            }
+
+          t = lookup_task (s);
+          if (!t)
+            {
+              config_msg ("unknown pipe-id '%s' in line %d, ignored\n", s, line_nr);
+              continue;
+            }
+          if (task.action == ACTION_RESPAWN || t->action == ACTION_RESPAWN)
+            {
+              config_msg ("pipe not allowed for 'respawn' tasks in line %d, "
+                          "ignored\n", line_nr);
+              continue;
+            }
+          if (task.action != ACTION_ONCE || t->action != ACTION_ONCE)
+            {
+              config_msg ("pipe not allowed for scheduled tasks in line %d, "
+                          "ignored\n", line_nr);
+              continue;
+            }
+          if (t->piped || t->consumers || t->input)
+            {
+              config_msg ("pipe not allowed for already piped tasks in line %d, ignored\n", line_nr);
+              continue;
+            }
+
+          strcpy (task.pipe_id, s);
+          task.piped = 1;
+        }
+
+      /* options */
+      s = p + 1;
+      if (split_options (s, &p))
+        {
+          char *key;
+          char *value;
+          int   invalid;
+
+          invalid = 0;
+          while (!invalid && next_option (&s, &key, &value))
+            if (set_task_option (&task, key, value))
+              {
+                config_msg ("invalid option '%s=%s' in line %d, ignored\n",
+                            key, value, line_nr);
+                invalid = 1;
+              }
+          if (invalid)
+            continue;
+          s = p;
+        }
+
+      if (task.action == ACTION_INTERVAL && !task.every)
+        {
+          config_msg ("'interval' task without every= in line %d, ignored\n",
+                      line_nr);
+          continue;
+        }
+      if (task.action == ACTION_CALENDAR && !task.calendar.minutes)
+        {
+          config_msg ("'calendar' task without at= in line %d, ignored\n",
+                      line_nr);
+          continue;
+        }
+
+      if (task.replicas && (task.piped || task.input))
+        {
+          config_msg ("replicas not allowed for piped tasks in line %d, "
+                      "ignored\n", line_nr);
+          continue;
+        }
+      /* replicas go to the least loaded cpus unless told otherwise. */
+      if (task.replicas && !task.places[PLACE_CPUS])
+        task.places[PLACE_CPUS] = "spread";
+
+      /* input */
+      if (task.input)
+        {
+          Task *t;
+
+          t = lookup_task (task.input);
+          if (!t)
+            {
+              config_msg ("unknown input '%s' in line %d, ignored\n",
+                          task.input, line_nr);
+              continue;
+            }
+          if (task.action == ACTION_RESPAWN || t->action == ACTION_RESPAWN)
+            {
+              config_msg ("pipe not allowed for 'respawn' tasks in line %d, "
+                          "ignored\n", line_nr);
+              continue;
+            }
+          if (task.action != ACTION_ONCE || t->action != ACTION_ONCE)
+            {
+              config_msg ("pipe not allowed for scheduled tasks in line %d, "
+                          "ignored\n", line_nr);
+              continue;
+            }
+          if (task.piped || t->piped)
+            {
+              config_msg ("pipe not allowed for already piped tasks in line %d, ignored\n", line_nr);
+              continue;
+            }
+        }
+
+      /* command */
+      s = strstrip (s);
+      if (s[0] == '\0')
+        {
+          config_msg ("empty command in line %d, ignored\n", line_nr);
+          continue;
+        }
+
+      task.argv_index = split_command (config, s);
+      if (task.argv_index < 0)
+        {
+          config_msg ("failed to parse command '%s' in line %d, ignored\n",
+                      s, line_nr);
+          continue;
+        }
+      task.path = resolve_command (config, config->argv[task.argv_index]);
+
+      if (task.piped)
+        lookup_task (task.pipe_id)->piped = 1;
+      if (task.input)
+        lookup_task (task.input)->consumers++;
+
+      if (0)
+        MSG ("id:%s pipe-id:%s action:%d command:%s\n",
+             task.id, task.pipe_id, task.action, s);
+
+      append_replicas (&task);
+      continue;
+
+    invalid_line:
+      config_msg ("invalid format in line %d, ignored\n", line_nr);
+    }
+
+  /* the argv table does not move anymore. */
+  for (i = 0; i < registry.task_count; i++)
+    registry.tasks[i]->argv = config->argv + registry.tasks[i]->argv_index;
+
+  qsort (registry.tasks, registry.task_count, sizeof (Task *),
+         compare_task_order);
+
+  return 0;
+}
+
+static int
+read_config (const char *filename)
+{
+  Config            *config;
+  unsigned long long hash;
+  long long          start;
+  int                from_snapshot;
+
+  start = now_ns ();
+
+  config = map_config (filename, 1);
+  if (!config)
+    return -1;
+
+  hash = hash_config (config);
+  from_snapshot = !read_snapshot (filename, hash);
+  if (!from_snapshot)
+    {
+      parse_config (config);
+      write_snapshot (filename, hash);
+      free (config_notes);
+      config_notes = NULL;
+      config_notes_len = 0;
+    }
+  apply_scales ();
+  config_unref (config);
+  registry.config = NULL;
+
+  if (show_stats)
+    MSG ("loaded %d tasks from '%s'%s in %.1f ms\n", registry.task_count,
+         filename, from_snapshot ? " snapshot" : "",
+         (now_ns () - start) / 1e6);
+
+  return 0;
+}
+
+static int
+add_dependency (Task *from,
+                Task *to,
+                int   required)
+{
+  if (from->deps_len == from->deps_max)
+    {
+      Dep *deps;
+      int  max;
+
+      max = from->deps_max ? from->deps_max * 2 : 4;
+      deps = realloc (from->deps, max * sizeof (Dep));
+      if (!deps)
+        {
+          MSG ("failed to allocate a dependency: %s\n", STRERROR);
+          return -1;
+        }
+      from->deps = deps;
+      from->deps_max = max;
+    }
+
+  from->deps[from->deps_len].task = to;
+  from->deps[from->deps_len].required = required;
+  from->deps_len++;
+  to->waiting++;
+
+  return 0;
+}
+
+/* 'list' is a comma separated list of task ids. */
+static void
+add_dependencies (Task       *task,
+                  const char *list,
+                  int         required)
+{
+  const char *p;
+  const char *end;
+
+  if (!list)
+    return;
+
+  /* in place, the list may be longer than any buffer. */
+  for (p = list; p; p = *end ? end + 1 : NULL)
+    {
+      const char *start;
+      const char *stop;
+      Task       *t;
+      char        s[TASK_ID_MAX + 1];
+
+      end = p + strcspn (p, ",");
+      for (start = p; start < end && isspace (*start); start++)
+        ;
+      for (stop = end; stop > start && isspace (stop[-1]); stop--)
+        ;
+      if (start == stop)
+        continue;
+      if (stop - start > TASK_ID_MAX)
+        {
+          MSG ("unknown dependency '%.*s' of task '%s', ignored\n",
+               (int) (stop - start), start, task->id);
+          continue;
+        }
+      memcpy (s, start, stop - start);
+      s[stop - start] = '\0';
+
+      t = lookup_task (s);
+      if (!t && strlen (s) <= ID_MAX)
+        {
+          char id[TASK_ID_MAX + 1];
+          int  i;
+
+          /* an entry with replicas= means all of them. */
+          for (i = 0; ; i++)
+            {
+              snprintf (id, sizeof (id), "%s.%d", s, i);
+              t = lookup_task (id);
+              if (!t)
+                break;
+              if (t != task && add_dependency (t, task, required))
+                break;
+            }
+          /* or none at all, if scaled to 0. */
+          if (i > 0 || lookup_scale (s, strlen (s)))
+            continue;
+        }
+      if (!t || t == task)
+        {
+          MSG ("unknown dependency '%s' of task '%s', ignored\n", s, task->id);
+          continue;
+        }
+      add_dependency (t, task, required);
+    }
+}
+
+static int
+add_edge (Task *task)
+{
+  Task  *producer;
+  Relay *relay;
+  Edge  *edge;
+
+  producer = lookup_task (task->input);
+  if (!producer)
+    return 0;
+
+  /* kept by a reload, with its pipes. */
+  if (task->input_edge)
+    return add_dependency (producer, task, 1);
+
+  relay = producer->relay;
+  if (!relay)
+    {
+      relay = calloc (1, sizeof (Relay));
+      if (!relay)
+        return -1;
+      relay->edges = calloc (producer->consumers, sizeof (Edge *));
+      if (!relay->edges)
+        {
+          free (relay);
+          return -1;
+        }
+      relay->producer = producer;
+      relay->fd = -1;
+      relay->watch.fd = -1;
+      producer->relay = relay;
+    }
+
+  edge = calloc (1, sizeof (Edge));
+  if (!edge)
+    return -1;
+  edge->relay = relay;
+  edge->consumer = task;
+  edge->fd = -1;
+  edge->watch.fd = -1;
+  relay->edges[relay->edges_len++] = edge;
+  task->input_edge = edge;
+
+  return add_dependency (producer, task, 1);
+}
+
+static void
+count_edge (Edge      *edge,
+            long long  bytes)
+{
+  edge->last = now_ns ();
+  if (!edge->bytes)
+    edge->first = edge->last;
+  edge->bytes += bytes;
+}
+
+/* close the consumer's stdin, it sees EOF once it drained its pipe. */
+static void
+close_edge (Edge *edge)
+{
+  double secs;
+
+  if (edge->closed)
+    return;
+  edge->closed = 1;
+  watch_close (&edge->watch);
+  edge->fd = -1;
+  trace_event (TRACE_PIPE_CLOSE, edge->consumer, edge->bytes, 0);
+
+  if (!show_stats)
+    return;
+
+  secs = (edge->last - edge->first) / 1e9;
+  MSG ("pipe '%s' -> '%s': %lld bytes, %.1f MB/s\n",
+       edge->relay->producer->id, edge->consumer->id, edge->bytes,
+       secs > 0 ? edge->bytes / secs / (1024 * 1024) : 0.0);
+}
+
+/* close the producer's stdout, it gets EPIPE on its next write. */
+static void
+close_relay (Relay *relay)
+{
+  int i;
+
+  watch_close (&relay->watch);
+  relay->fd = -1;
+  for (i = 0; i < relay->edges_len; i++)
+    close_edge (relay->edges[i]);
+}
+
+/*
+ * Move whatever is in the producer's pipe to the consumers, until either
+ * side would block.  A single consumer gets it with splice().  With more
+ * consumers, tee() always copies from the head of the producer's pipe and
+ * may be short, so 'ahead' counts the bytes each consumer already has:
+ * only consumers with nothing ahead get more, and the head is dropped to
+ * /dev/null once every consumer has it.  A slow consumer holds the others
+ * back by at most one pipe of data.
+ */
+static void
+relay_data (Relay *relay)
+{
+  while (relay->fd >= 0)
+    {
+      Edge   *last;
+      ssize_t n;
+      int     live;
+      int     progress;
+      int     consumed;
+      int     i;
+
+      last = NULL;
+      live = 0;
+      for (i = 0; i < relay->edges_len; i++)
+        {
+          Edge *edge = relay->edges[i];
+
+          if (edge->closed)
+            continue;
+          /* consumers not started yet, keep the data in the pipe. */
+          if (edge->fd < 0)
+            return;
+          last = edge;
+          live++;
+        }
+
+      if (!live)
+        {
+          close_relay (relay);
+          return;
+        }
+
+      if (live == 1)
+        {
+          n = splice (relay->fd, NULL, last->fd, NULL, 1 << 30,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n > 0)
+            {
+              count_edge (last, n);
+              continue;
+            }
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n < 0 && errno == EPIPE)
+            {
+              close_edge (last);
+              continue;
+            }
+          /* no data and no writers left. */
+          if (n == 0)
+            close_relay (relay);
+          else if (errno != EAGAIN)
+            {
+              MSG ("failed to splice() from '%s': %s\n",
+                   relay->producer->id, STRERROR);
+              close_relay (relay);
+            }
+          return;
+        }
+
+      progress = 0;
+      for (i = 0; i < relay->edges_len; i++)
+        {
+          Edge *edge = relay->edges[i];
+
+          if (edge->closed || edge->ahead > 0)
+            continue;
+          n = tee (relay->fd, edge->fd, 1 << 30, SPLICE_F_NONBLOCK);
+          if (n > 0)
+            {
+              edge->ahead = n;
+              count_edge (edge, n);
+              progress = 1;
+            }
+          else if (n == 0)
+            {
+              /* no data and no writers left. */
+              close_relay (relay);
+              return;
+            }
+          else if (errno == EPIPE)
+            {
+              close_edge (edge);
+              progress = 1;
+            }
+        }
+
+      /* drop what every consumer got. */
+      consumed = INT_MAX;
+      for (i = 0; i < relay->edges_len; i++)
+        if (!relay->edges[i]->closed && consumed > relay->edges[i]->ahead)
+          consumed = relay->edges[i]->ahead;
+      if (consumed > 0 && consumed != INT_MAX)
+        {
+          n = splice (relay->fd, NULL, null_fd, NULL, consumed,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+          if (n < 0)
+            {
+              MSG ("failed to splice() from '%s': %s\n",
+                   relay->producer->id, STRERROR);
+              close_relay (relay);
+              return;
+            }
+          for (i = 0; i < relay->edges_len; i++)
+            relay->edges[i]->ahead -= n;
+          progress = 1;
+        }
+
+      if (!progress)
+        return;
+    }
+}
+
+static void
+handle_relay (Watch        *watch,
+              unsigned int  events)
+{
+  Relay *relay = watch->data;
+
+  if (events & (EPOLLHUP | EPOLLERR))
+    relay->hup = 1;
+  relay_data (relay);
+}
+
+static void
+handle_edge (Watch        *watch,
+             unsigned int  events)
+{
+  Edge *edge = watch->data;
+
+  /* the consumer closed its stdin. */
+  if (events & EPOLLERR)
+    close_edge (edge);
+  relay_data (edge->relay);
+}
+
+static int
+open_pipe (int fds[2],
+           int size)
+{
+  if (pipe2 (fds, O_CLOEXEC))
+    return -1;
+
+  if (size > 0 && fcntl (fds[0], F_SETPIPE_SZ, size) < 0)
+    MSG ("failed to set pipe size %d: %s\n", size, STRERROR);
+
+  return 0;
+}
+
+static void
+start_relay (Task *task,
+             int   fd)
+{
+  Relay *relay = task->relay;
+
+  fcntl (fd, F_SETFL, O_NONBLOCK);
+  relay->fd = fd;
+  if (watch_add (&relay->watch, fd, EPOLLIN | EPOLLET, handle_relay, relay))
+    {
+      close (fd);
+      relay->fd = -1;
+    }
+}
+
+static void
+start_edge (Task *task,
+            int   fd)
+{
+  Edge *edge = task->input_edge;
+
+  fcntl (fd, F_SETFL, O_NONBLOCK);
+  edge->fd = fd;
+  trace_event (TRACE_PIPE_OPEN, task, 0, 0);
+  if (watch_add (&edge->watch, fd, EPOLLOUT | EPOLLET, handle_edge, edge))
+    {
+      close (fd);
+      edge->fd = -1;
+      edge->closed = 1;
+    }
+  relay_data (edge->relay);
+}
+
+static void
+push_ready_task (Task *task)
+{
+  startup.queue[startup.queue_len++] = task;
+}
+
+/*
+ * Mark 'task' as started (or failed to start) and release whatever was
+ * waiting for it.  Required dependents of a failed task fail as well.
+ */
+static void
+release_task (Task *task)
+{
+  if (task->released)
+    return;
+  task->released = 1;
+  startup.done[startup.done_len++] = task;
+
+  while (startup.done_len > 0)
+    {
+      Task *t;
+      int   level;
+      int   i;
+
+      t = startup.done[--startup.done_len];
+
+      /* a consumer which never starts must not hold up the others. */
+      if (t->state == TASK_FAILED && t->input_edge && t->input_edge->fd < 0)
+        {
+          close_edge (t->input_edge);
+          relay_data (t->input_edge->relay);
+        }
+
+      for (i = 0; i < t->deps_len; i++)
+        {
+          Task *d = t->deps[i].task;
+
+          if (d->released)
+            continue;
+
+          if (t->state == TASK_FAILED && t->deps[i].required)
+            {
+              MSG ("task '%s' not started, required task '%s' failed\n",
+                   d->id, t->id);
+              set_task_state (d, TASK_FAILED);
+              d->released = 1;
+              startup.done[startup.done_len++] = d;
+            }
+          else if (--d->waiting == 0)
+            push_ready_task (d);
+        }
+
+      level = t->level;
+      if (--startup.level_pending[level] == 0 && level + 1 < startup.levels)
+        for (i = startup.level_start[level + 1];
+             i < startup.level_start[level + 2];
+             i++)
+          {
+            Task *n = registry.tasks[i];
+
+            if (!n->released && --n->waiting == 0)
+              push_ready_task (n);
+          }
+    }
+}
+
+/*
+ * Kahn's algorithm on a copy of the counters, anything left over is in
+ * (or stuck behind) a dependency cycle and will not be started.
+ */
+static void
+check_dependency_cycles (void)
+{
+  Task **stack;
+  int   *waiting;
+  int   *pending;
+  int    stack_len;
+  int    visited;
+  int    i;
+
+  stack = malloc (registry.task_count * sizeof (Task *));
+  waiting = malloc (registry.task_count * sizeof (int));
+  pending = malloc (startup.levels * sizeof (int));
+  if (!stack || !waiting || !pending)
+    {
+      MSG ("failed to check dependency cycles: %s\n", STRERROR);
+      goto out;
+    }
+
+  stack_len = 0;
+  for (i = 0; i < registry.task_count; i++)
+    {
+      Task *task = registry.tasks[i];
+
+      waiting[task->seq] = task->waiting
+        - (task->replaces && !task->replaces->handoff);
+      if (!waiting[task->seq])
+        stack[stack_len++] = task;
+    }
+  memcpy (pending, startup.level_pending, startup.levels * sizeof (int));
+
+  visited = 0;
+  while (stack_len > 0)
+    {
+      Task *t;
+      int   level;
+
+      t = stack[--stack_len];
+      visited++;
+
+      for (i = 0; i < t->deps_len; i++)
+        if (--waiting[t->deps[i].task->seq] == 0)
+          stack[stack_len++] = t->deps[i].task;
+
+      level = t->level;
+      if (--pending[level] == 0 && level + 1 < startup.levels)
+        for (i = startup.level_start[level + 1];
+             i < startup.level_start[level + 2];
+             i++)
+          if (--waiting[registry.tasks[i]->seq] == 0)
+            stack[stack_len++] = registry.tasks[i];
+    }
+
+  if (visited < registry.task_count)
+    for (i = 0; i < registry.task_count; i++)
+      {
+        Task *task = registry.tasks[i];
+
+        if (waiting[task->seq] <= 0 || task->released)
+          continue;
+        MSG ("dependency cycle at task '%s', ignored\n", task->id);
+        set_task_state (task, TASK_FAILED);
+        release_task (task);
+      }
+
+ out:
+  free (stack);
+  free (waiting);
+  free (pending);
+}
+
+static int
+prepare_startup (void)
+{
+  int n;
+  int i;
+
+  free (startup.queue);
+  free (startup.done);
+  free (startup.level_start);
+  free (startup.level_pending);
+  startup.queue_head = 0;
+  startup.queue_len = 0;
+  startup.done_len = 0;
+  startup.starting = 0;
+
+  n = registry.task_count;
+  startup.queue = calloc (n + 1, sizeof (Task *));
+  startup.done = calloc (n + 1, sizeof (Task *));
+  startup.level_start = calloc (n + 2, sizeof (int));
+  startup.level_pending = calloc (n + 1, sizeof (int));
+  if (!startup.queue || !startup.done
+      || !startup.level_start || !startup.level_pending)
+    return -1;
+
+  /* the launch order view is sorted by 'order', so levels are contiguous. */
+  startup.levels = 0;
+  for (i = 0; i < n; i++)
+    {
+      Task *task = registry.tasks[i];
+
+      if (i == 0 || task->order != registry.tasks[i - 1]->order)
+        startup.level_start[startup.levels++] = i;
+      task->level = startup.levels - 1;
+      /* a replaced task also waits for its old instance, unless overlapping. */
+      task->waiting = (task->level > 0)
+        + (task->replaces && !task->replaces->handoff);
+      task->released = 0;
+      task->deps_len = 0;
+      startup.level_pending[task->level]++;
+    }
+  startup.level_start[startup.levels] = n;
+
+  for (i = 0; i < n; i++)
+    {
+      Task *task = registry.tasks[i];
+
+      /* the task without pipe-id creates the pipes, so it goes first. */
+      if (task->piped && task->pipe_id[0] != '\0')
+        {
+          Task *sibling;
+
+          sibling = lookup_task (task->pipe_id);
+          if (sibling)
+            add_dependency (sibling, task, 1);
+        }
+      add_dependencies (task, task->after, 0);
+      add_dependencies (task, task->requires, 1);
+
+      /* the producer creates the relay, so it goes first. */
+      if (task->input && add_edge (task))
+        return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    if (!registry.tasks[i]->waiting)
+      push_ready_task (registry.tasks[i]);
+
+  check_dependency_cycles ();
+
+  return 0;
+}
+
+static void
+close_notify (Task *task)
+{
+  watch_close (&task->notify_watch);
+  task->notify_fd = -1;
+}
+
+/* task finished its start, successfully or not. */
+static void stop_task (Task *task);
+
+/* the next instance is up, stop the one it replaces. */
+static void
+finish_handoff (Task *task)
+{
+  Task *o = task->replaces;
+
+  if (!o || o->handoff != 1)
+    return;
+
+  o->handoff = 2;
+  stop_task (o);
+}
+
+/* from a reap with a restart straight after to ready, see Zygote. */
+static void
+ready_sample (Task *task,
+              int   failed)
+{
+  long long elapsed;
+
+  if (!task->down_time)
+    return;
+
+  elapsed = now_ns () - task->down_time;
+  task->down_time = 0;
+  if (failed)
+    return;
+
+  stats.ready_samples++;
+  stats.ready_time += elapsed;
+  if (stats.ready_time_max < elapsed)
+    stats.ready_time_max = elapsed;
+}
+
+static void
+task_started (Task *task,
+              int   failed)
+{
+  if (task->state != TASK_STARTING)
+    return;
+
+  set_task_state (task, failed ? TASK_FAILED : TASK_RUNNING);
+  timer_stop (&task->ready_timer);
+  ready_sample (task, failed);
+  if (!failed)
+    {
+      trace_event (TRACE_READY, task, 0, 0);
+      finish_handoff (task);
+    }
+  if (task->released)
+    return;
+
+  if (failed)
+    MSG ("task '%s' failed to become ready\n", task->id);
+
+  startup.starting--;
+  release_task (task);
+}
+
+static void
+read_notify (Watch        *watch,
+             unsigned int  events)
+{
+  Task   *task = watch->data;
+  char    buf[256];
+  ssize_t len;
+
+  if (watch->fd < 0)
+    return;
+
+  len = read (task->notify_fd, buf, sizeof (buf) - 1);
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (len > 0)
+    {
+      char *p;
+
+      buf[len] = '\0';
+      if (strstr (buf, "READY=1"))
+        task_started (task, 0);
+      /* sd_notify() style, for the exit to reap latency. */
+      p = strstr (buf, "MONOTONIC_USEC=");
+      if (p && strstr (buf, "STOPPING=1"))
+        task->exit_time = strtoll (p + 15, NULL, 10) * 1000;
+      return;
+    }
+
+  /* closed before being ready. */
+  close_notify (task);
+  task_started (task, 1);
+}
+
+static void
+ready_timeout (Timer *timer)
+{
+  Task *task = timer->data;
+
+  MSG ("task '%s' not ready in %lld ms\n", task->id, task->ready_timeout);
+  close_notify (task);
+  task_started (task, 1);
+}
+
+static int
+cgroup_write (int         dir_fd,
+              const char *file,
+              const char *value)
+{
+  ssize_t len;
+  int     fd;
+
+  fd = openat (dir_fd, file, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  len = write (fd, value, strlen (value));
+  close (fd);
+
+  return len < 0 ? -1 : 0;
+}
+
+/*
+ * Create the group of procman below its own cgroup on the cgroup2 mount.
+ * The group itself never holds a process, so controllers can be enabled
+ * for the leaves in it.
+ */
+static void
+setup_cgroups (void)
+{
+  char  line[PATH_MAX * 2];
+  char  mount[PATH_MAX];
+  char  own[PATH_MAX];
+  char *path;
+  FILE *fp;
+
+  mount[0] = '\0';
+  path = NULL;
+
+  fp = fopen ("/proc/self/mountinfo", "r");
+  if (fp)
+    {
+      while (fgets (line, sizeof (line), fp))
+        if (strstr (line, " - cgroup2 ")
+            && sscanf (line, "%*s %*s %*s %*s %4095s", mount) == 1)
+          break;
+      fclose (fp);
+    }
+
+  fp = fopen ("/proc/self/cgroup", "r");
+  if (fp)
+    {
+      while (fgets (own, sizeof (own), fp))
+        if (!strncmp (own, "0::", 3))
+          {
+            own[strcspn (own, "\n")] = '\0';
+            path = strcmp (own + 3, "/") ? own + 3 : "";
+            break;
+          }
+      fclose (fp);
+    }
+
+  if (mount[0] == '\0' || !path)
+    return;
+
+  if (snprintf (cgroup_path, sizeof (cgroup_path), "%s%s/procman.%d",
+                mount, path, (int) getpid ()) >= sizeof (cgroup_path)
+      || mkdir (cgroup_path, 0755))
+    {
+      if (show_stats)
+        MSG ("no cgroups, failed to create '%s': %s\n", cgroup_path, STRERROR);
+      return;
+    }
+
+  cgroup_fd = open (cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cgroup_fd < 0)
+    rmdir (cgroup_path);
+}
+
+/*
+ * Remove the leaves left and the group.  Processes just signalled get
+ * 50 ms to leave, then whatever is left goes with cgroup.kill, and takes a
+ * moment to leave as well.  Leaves still populated after that stay.
+ */
+static void
+cleanup_cgroups (void)
+{
+  struct dirent *ent;
+  DIR           *dir;
+  int            fd;
+  int            busy;
+  int            tries;
+
+  if (cgroup_fd < 0)
+    return;
+
+  fd = dup (cgroup_fd);
+  dir = fd >= 0 ? fdopendir (fd) : NULL;
+  if (dir)
+    {
+      for (tries = 0; tries < 10; tries++)
+        {
+          busy = 0;
+          rewinddir (dir);
+          while ((ent = readdir (dir)))
+            if (ent->d_type == DT_DIR && ent->d_name[0] != '.'
+                && unlinkat (cgroup_fd, ent->d_name, AT_REMOVEDIR)
+                && errno == EBUSY)
+              {
+                busy++;
+                if (tries == 5)
+                  {
+                    int leaf_fd;
+
+                    leaf_fd = openat (cgroup_fd, ent->d_name,
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (leaf_fd >= 0)
+                      {
+                        cgroup_write (leaf_fd, "cgroup.kill", "1");
+                        close (leaf_fd);
+                      }
+                  }
+              }
+          if (!busy)
+            break;
+          usleep (10 * 1000);
+        }
+      closedir (dir);
+    }
+  else if (fd >= 0)
+    close (fd);
+
+  close (cgroup_fd);
+  cgroup_fd = -1;
+  rmdir (cgroup_path);
+}
+
+static void
+set_cgroup_limit (Task       *task,
+                  int         leaf_fd,
+                  int         limit,
+                  const char *value)
+{
+  const CgroupLimit *l = &cgroup_limits[limit];
+  char               buf[32];
+
+  /* enabling it again does nothing, and the group never has processes. */
+  snprintf (buf, sizeof (buf), "+%s", l->controller);
+  if (cgroup_write (cgroup_fd, "cgroup.subtree_control", buf))
+    MSG ("controller '%s' not available, %s of task '%s' ignored\n",
+         l->controller, l->file, task->id);
+  else if (cgroup_write (leaf_fd, l->file, value))
+    MSG ("failed to set %s '%s' of task '%s': %s\n",
+         l->file, value, task->id, STRERROR);
+}
+
+/*
+ * Open the leaf of 'task', created with its limits on the first spawn.
+ * Leaves are only open while in use, a live task holds no fd for it.
+ */
+static int
+open_task_cgroup (Task *task)
+{
+  int fd;
+  int i;
+
+  if (cgroup_fd < 0)
+    {
+      for (i = 0; i < LIMIT_COUNT; i++)
+        if (task->limits[i] && !task->spawn_time)
+          {
+            MSG ("no cgroups, limits of task '%s' ignored\n", task->id);
+            break;
+          }
+      return -1;
+    }
+
+  if (!task->cgroup
+      && mkdirat (cgroup_fd, task->id, 0755) && errno != EEXIST)
+    {
+      MSG ("failed to create cgroup of task '%s': %s\n", task->id, STRERROR);
+      return -1;
+    }
+  /* out of fds it runs without, like without a pidfd. */
+  fd = openat (cgroup_fd, task->id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != EMFILE && errno != ENFILE)
+        MSG ("failed to open cgroup of task '%s': %s\n", task->id, STRERROR);
+      return -1;
+    }
+
+  if (!task->cgroup)
+    for (i = 0; i < LIMIT_COUNT; i++)
+      if (task->limits[i])
+        set_cgroup_limit (task, fd, i, task->limits[i]);
+  task->cgroup = 1;
+
+  return fd;
+}
+
+static void
+signal_task (Task *task,
+             int   signo)
+{
+  trace_event (TRACE_SIGNAL, task, signo, 0);
+  kill (task->pid, signo);
+}
+
+/*
+ * Signal every process in the leaf of 'task' one by one.  Some kernels
+ * kill anything cloned into a cgroup after a write to its cgroup.kill, so
+ * that is only used on leaves being removed, see close_task_cgroup().
+ */
+static void
+kill_task_cgroup (Task *task,
+                  int   signo)
+{
+  FILE *fp;
+  int   fd;
+  int   pid;
+  int   n = 0;
+
+  if (!task->cgroup)
+    return;
+
+  fd = openat (cgroup_fd, task->id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  fp = fdopen (openat (fd, "cgroup.procs", O_RDONLY | O_CLOEXEC), "r");
+  close (fd);
+  if (!fp)
+    return;
+  while (fscanf (fp, "%d", &pid) == 1)
+    {
+      /* once per leaf, the leftovers are usually gone already. */
+      if (!n++)
+        trace_event (TRACE_SIGNAL, task, signo, 0);
+      kill (pid, signo);
+    }
+  fclose (fp);
+}
+
+/*
+ * The task is done for good, remove its leaf.  If something outlived the
+ * task, cgroup.kill takes the whole subtree at once, and the leaf goes in
+ * cleanup_cgroups().
+ */
+static void
+close_task_cgroup (Task *task)
+{
+  int fd;
+
+  if (!task->cgroup)
+    return;
+
+  if (unlinkat (cgroup_fd, task->id, AT_REMOVEDIR) && errno == EBUSY)
+    {
+      fd = openat (cgroup_fd, task->id, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0 || cgroup_write (fd, "cgroup.kill", "1"))
+        kill_task_cgroup (task, SIGKILL);
+      if (fd >= 0)
+        close (fd);
+    }
+  task->cgroup = 0;
+}
+
+/*
+ * fork() right into the cgroup 'fd', so the child never runs outside of
+ * it, or move it there before it execs on kernels without clone3().
+ */
+static pid_t
+clone_into_cgroup (int fd)
+{
+  struct clone_args args;
+  pid_t             pid;
+
+  memset (&args, 0x00, sizeof (args));
+  args.flags = CLONE_INTO_CGROUP;
+  args.exit_signal = SIGCHLD;
+  args.cgroup = fd;
+
+  pid = syscall (SYS_clone3, &args, sizeof (args));
+  if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+    return pid;
+
+  pid = fork ();
+  if (pid == 0 && cgroup_write (fd, "cgroup.procs", "0"))
+    MSG ("failed to move into cgroup: %s\n", STRERROR);
+
+  return pid;
+}
+
+/* wake the writer for new data in 'log', or to close it. */
+static void
+queue_log (Log *log)
+{
+  pthread_mutex_lock (&log_lock);
+  if (!log->queued)
+    {
+      log->queued = 1;
+      log->next = log_queue;
+      log_queue = log;
+      pthread_cond_signal (&log_cond);
+    }
+  pthread_mutex_unlock (&log_lock);
+}
+
+/*
+ * Read the output pipe of 'task' into its ring until it would block or
+ * the ring is full.  A full ring sets 'full', and the writer hands the
+ * log back on 'log_resume' once it moved the tail.
+ */
+static void
+drain_log (Task *task)
+{
+  Log          *log = task->log;
+  struct iovec  iov[2];
+  unsigned int  tail;
+  unsigned int  space;
+  unsigned int  offset;
+  ssize_t       len;
+  int           read_any;
+
+  read_any = 0;
+  for (;;)
+    {
+      tail = __atomic_load_n (&log->tail, __ATOMIC_ACQUIRE);
+      space = LOG_RING - (log->head - tail);
+      if (space == 0)
+        {
+          /* the writer checks 'full' after moving the tail. */
+          __atomic_store_n (&log->full, 1, __ATOMIC_SEQ_CST);
+          if (__atomic_load_n (&log->tail, __ATOMIC_SEQ_CST) == tail)
+            {
+              stats.log_stalls++;
+              break;
+            }
+          __atomic_store_n (&log->full, 0, __ATOMIC_RELAXED);
+          continue;
+        }
+
+      offset = log->head & (LOG_RING - 1);
+      iov[0].iov_base = log->ring + offset;
+      iov[0].iov_len = LOG_RING - offset < space ? LOG_RING - offset : space;
+      iov[1].iov_base = log->ring;
+      iov[1].iov_len = space - iov[0].iov_len;
+
+      len = readv (task->log_watch.fd, iov, iov[1].iov_len ? 2 : 1);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        break;
+
+      __atomic_store_n (&log->head, log->head + len, __ATOMIC_RELEASE);
+      stats.log_bytes += len;
+      read_any = 1;
+    }
+
+  if (read_any)
+    queue_log (log);
+}
+
+static void
+handle_log_pipe (Watch        *watch,
+                 unsigned int  events)
+{
+  Task *task = watch->data;
+
+  if (watch->fd >= 0)
+    drain_log (task);
+}
+
+/* a Log for the output pipe of 'task', which procman reads and keeps. */
+static int
+attach_task_log (Task *task,
+                 int   read_fd,
+                 int   write_fd)
+{
+  Log *log;
+
+  log = calloc (1, sizeof (Log));
+  if (log)
+    log->ring = malloc (LOG_RING);
+  if (!log || !log->ring)
+    {
+      MSG ("failed to allocate log of task '%s': %s\n", task->id, STRERROR);
+      free (log);
+      return -1;
+    }
+
+  if (watch_add (&task->log_watch, read_fd, EPOLLIN | EPOLLET,
+                 handle_log_pipe, task))
+    {
+      free (log->ring);
+      free (log);
+      return -1;
+    }
+
+  strcpy (log->id, task->id);
+  log->file = -1;
+  log->task = task;
+  task->log = log;
+  task->log_fd = write_fd;
+
+  return 0;
+}
+
+static int
+open_task_log (Task *task)
+{
+  int fds[2];
+
+  if (!log_dir || task->log)
+    return task->log ? task->log_fd : -1;
+
+  /* procman keeps the write end, so the pipe outlives every run. */
+  if (pipe2 (fds, O_CLOEXEC))
+    {
+      MSG ("failed to pipe() for log of task '%s': %s\n", task->id, STRERROR);
+      return -1;
+    }
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  if (attach_task_log (task, fds[0], fds[1]))
+    {
+      close (fds[0]);
+      close (fds[1]);
+      return -1;
+    }
+
+  return fds[1];
+}
+
+/* the writer writes out what is left of the ring, and frees the Log. */
+static void
+retire_task_log (Task *task)
+{
+  Log *log = task->log;
+
+  task->log = NULL;
+  log->task = NULL;
+  __atomic_store_n (&log->closed, 1, __ATOMIC_RELEASE);
+  queue_log (log);
+}
+
+static void
+close_task_log (Task *task)
+{
+  if (!task->log)
+    return;
+
+  drain_log (task);
+  watch_close (&task->log_watch);
+  close (task->log_fd);
+  retire_task_log (task);
+}
+
+static void
+handle_log_events (Watch        *watch,
+                   unsigned int  events)
+{
+  unsigned long long count;
+  Log               *resume;
+  Log               *done;
+  Log               *log;
+
+  read (watch->fd, &count, sizeof (count));
+
+  /* together, so that a log on both is resumed before it is freed. */
+  pthread_mutex_lock (&log_lock);
+  resume = log_resume;
+  done = log_done;
+  log_resume = log_done = NULL;
+  pthread_mutex_unlock (&log_lock);
+
+  /* the writer may queue a log for resume again once it is off the list. */
+  while (resume)
+    {
+      log = resume;
+      pthread_mutex_lock (&log_lock);
+      resume = log->next_resume;
+      log->resuming = 0;
+      pthread_mutex_unlock (&log_lock);
+      if (log->task)
+        drain_log (log->task);
+    }
+
+  while (done)
+    {
+      log = done;
+      done = log->next;
+      free (log->ring);
+      free (log);
+    }
+}
+
+/* writer thread from here on, it must not allocate (see clone_into_cgroup()). */
+static void
+open_log_file (Log *log)
+{
+  struct stat st;
+  char        path[PATH_MAX];
+  char        old[PATH_MAX + 2];
+
+  snprintf (path, sizeof (path), "%s/%s.log", log_dir, log->id);
+  if (log->file >= 0)
+    {
+      close (log->file);
+      snprintf (old, sizeof (old), "%s.1", path);
+      rename (path, old);
+    }
+
+  log->file = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  log->size = 0;
+  if (log->file >= 0 && !fstat (log->file, &st))
+    log->size = st.st_size;
+}
+
+static void
+write_log_iov (Log          *log,
+               struct iovec *iov,
+               int           iov_len)
+{
+  ssize_t len;
+
+  if (log->file < 0 || log->size >= log_max)
+    open_log_file (log);
+  if (log->file < 0)
+    {
+      stats.log_errors++;
+      return;
+    }
+
+  len = writev (log->file, iov, iov_len);
+  if (len < 0)
+    stats.log_errors++;
+  else
+    log->size += len;
+  stats.log_writes++;
+}
+
+/* the tail moved, resume draining if the event loop stopped. */
+static int
+advance_log (Log          *log,
+             unsigned int  tail)
+{
+  __atomic_store_n (&log->tail, tail, __ATOMIC_SEQ_CST);
+
+  return __atomic_exchange_n (&log->full, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Write the complete lines in the ring of 'log', each behind 'stamp', in
+ * as few writev() calls as possible.  The rest of a line goes as well if
+ * it fills the ring or 'flush' is set.  Returns the head it got to.
+ */
+static unsigned int
+write_log (Log        *log,
+           const char *stamp,
+           int         stamp_len,
+           int         flush,
+           int        *resume)
+{
+  struct iovec iov[IOV_MAX];
+  unsigned int head;
+  unsigned int start;
+  unsigned int pos;
+  int          iov_len;
+
+  head = __atomic_load_n (&log->head, __ATOMIC_ACQUIRE);
+  start = pos = log->tail;
+  iov_len = 0;
+  while (pos != head)
+    {
+      unsigned int offset = pos & (LOG_RING - 1);
+      unsigned int len;
+      char        *nl;
+
+      len = LOG_RING - offset < head - pos ? LOG_RING - offset : head - pos;
+      nl = memchr (log->ring + offset, '\n', len);
+      pos += nl ? nl - (log->ring + offset) + 1 : len;
+      if (!nl && (pos != head || (!flush && head - start < LOG_RING)))
+        continue;
+
+      iov[iov_len].iov_base = (char *) stamp;
+      iov[iov_len++].iov_len = stamp_len;
+      offset = start & (LOG_RING - 1);
+      if (offset + (pos - start) > LOG_RING)
+        {
+          iov[iov_len].iov_base = log->ring + offset;
+          iov[iov_len++].iov_len = LOG_RING - offset;
+          iov[iov_len].iov_base = log->ring;
+          iov[iov_len++].iov_len = pos - start - (LOG_RING - offset);
+        }
+      else
+        {
+          iov[iov_len].iov_base = log->ring + offset;
+          iov[iov_len++].iov_len = pos - start;
+        }
+      if (!nl)
+        {
+          iov[iov_len].iov_base = "\n";
+          iov[iov_len++].iov_len = 1;
+        }
+      stats.log_lines++;
+      start = pos;
+
+      if (iov_len > IOV_MAX - 4)
+        {
+          write_log_iov (log, iov, iov_len);
+          iov_len = 0;
+          *resume |= advance_log (log, start);
+        }
+    }
+
+  if (iov_len > 0)
+    write_log_iov (log, iov, iov_len);
+  *resume |= advance_log (log, start);
+
+  return head;
+}
+
+static int
+make_stamp (char *buf,
+            int   size)
+{
+  struct timespec ts;
+  struct tm       tm;
+  int             len;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  localtime_r (&ts.tv_sec, &tm);
+  len = strftime (buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+  len += snprintf (buf + len, size - len, ".%03ld ", ts.tv_nsec / 1000000);
+
+  return len;
+}
+
+static void *
+log_writer (void *data)
+{
+  char stamp[64];
+  int  stamp_len;
+  Log *list;
+  Log *next;
+  Log *log;
+
+  pthread_mutex_lock (&log_lock);
+  for (;;)
+    {
+      int notify;
+
+      while (!log_queue && !log_stop)
+        pthread_cond_wait (&log_cond, &log_lock);
+      if (!log_queue)
+        break;
+      list = log_queue;
+      log_queue = NULL;
+      pthread_mutex_unlock (&log_lock);
+
+      /* one timestamp for the whole batch. */
+      stamp_len = make_stamp (stamp, sizeof (stamp));
+      notify = 0;
+      for (log = list; log; log = next)
+        {
+          unsigned int head;
+          int          closed;
+          int          resume;
+
+          next = log->next;
+          closed = __atomic_load_n (&log->closed, __ATOMIC_ACQUIRE);
+          resume = 0;
+          head = write_log (log, stamp, stamp_len, closed, &resume);
+
+          pthread_mutex_lock (&log_lock);
+          if (closed)
+            {
+              if (log->file >= 0)
+                close (log->file);
+              log->next = log_done;
+              log_done = log;
+              notify = 1;
+            }
+          else
+            {
+              if (resume && !log->resuming)
+                {
+                  log->resuming = 1;
+                  log->next_resume = log_resume;
+                  log_resume = log;
+                  notify = 1;
+                }
+              /* more came in meanwhile, or it got closed. */
+              if (__atomic_load_n (&log->head, __ATOMIC_ACQUIRE) != head
+                  || log->closed)
+                {
+                  log->next = log_queue;
+                  log_queue = log;
+                }
+              else
+                log->queued = 0;
+            }
+          pthread_mutex_unlock (&log_lock);
+        }
+
+      if (notify)
+        {
+          unsigned long long one = 1;
+
+          write (log_event_fd, &one, sizeof (one));
+        }
+      pthread_mutex_lock (&log_lock);
+    }
+  pthread_mutex_unlock (&log_lock);
+
+  return NULL;
+}
+
+static void
+setup_logs (void)
+{
+  if (!log_dir)
+    return;
+
+  if (mkdir (log_dir, 0755) && errno != EEXIST)
+    {
+      MSG ("no logs, failed to create '%s': %s\n", log_dir, STRERROR);
+      log_dir = NULL;
+      return;
+    }
+
+  log_event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (log_event_fd < 0 || watch_add (&log_event_watch, log_event_fd, EPOLLIN,
+                                     handle_log_events, NULL))
+    {
+      MSG ("no logs, failed to create eventfd: %s\n", STRERROR);
+      log_dir = NULL;
+      return;
+    }
+
+  /* before the thread, localtime_r() would allocate otherwise. */
+  tzset ();
+  if (pthread_create (&log_thread, NULL, log_writer, NULL))
+    {
+      MSG ("no logs, failed to start the writer\n");
+      watch_close (&log_event_watch);
+      log_dir = NULL;
+    }
+}
+
+/* flush and join the writer. */
+static void
+stop_log_writer (void)
+{
+  pthread_mutex_lock (&log_lock);
+  log_stop = 1;
+  pthread_cond_signal (&log_cond);
+  pthread_mutex_unlock (&log_lock);
+  pthread_join (log_thread, NULL);
+  log_stop = 0;
+}
+
+static void
+stop_logs (void)
+{
+  int i;
+
+  if (!log_dir)
+    return;
+
+  for (i = 0; i < registry.task_count; i++)
+    close_task_log (registry.tasks[i]);
+
+  stop_log_writer ();
+  log_dir = NULL;
+}
+
+static void *
+trace_writer (void *data)
+{
+  struct timespec deadline;
+  long long       n;
+
+  pthread_mutex_lock (&trace_lock);
+  while (!trace_stop)
+    {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += TRACE_FLUSH * 1000000LL;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+      pthread_cond_timedwait (&trace_cond, &trace_lock, &deadline);
+      pthread_mutex_unlock (&trace_lock);
+
+      n = trace_flush (trace_ring, trace_fd);
+      if (n > 0)
+        trace_written += n;
+
+      pthread_mutex_lock (&trace_lock);
+    }
+  pthread_mutex_unlock (&trace_lock);
+
+  n = trace_flush (trace_ring, trace_fd);
+  if (n > 0)
+    trace_written += n;
+
+  return NULL;
+}
+
+static void
+setup_trace (void)
+{
+  TraceHeader header;
+
+  if (!trace_file)
+    return;
+
+  trace_ring = mmap (NULL, sizeof (TraceRing), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (trace_ring == MAP_FAILED)
+    {
+      MSG ("no trace, failed to map its ring: %s\n", STRERROR);
+      trace_ring = NULL;
+      return;
+    }
+
+  memset (&header, 0x00, sizeof (header));
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.event_size = sizeof (TraceEvent);
+  header.pid = getpid ();
+  header.start_time = stats.start;
+  header.start_realtime = realtime_ns () - (now_ns () - stats.start);
+
+  trace_stop = 0;
+  trace_fd = open (trace_file, O_WRONLY | O_CREAT | O_CLOEXEC
+                   | (trace_append ? O_APPEND : O_TRUNC), 0644);
+  if (trace_fd < 0
+      || (!trace_append
+          && trace_write_all (trace_fd, (char *) &header, sizeof (header)))
+      || pthread_create (&trace_thread, NULL, trace_writer, NULL))
+    {
+      MSG ("no trace, failed to write '%s': %s\n", trace_file, STRERROR);
+      if (trace_fd >= 0)
+        close (trace_fd);
+      munmap (trace_ring, sizeof (TraceRing));
+      trace_ring = NULL;
+    }
+}
+
+/* flush the rest of the ring and stop the thread. */
+static void
+stop_trace (void)
+{
+  if (!trace_ring)
+    return;
+
+  pthread_mutex_lock (&trace_lock);
+  trace_stop = 1;
+  pthread_cond_signal (&trace_cond);
+  pthread_mutex_unlock (&trace_lock);
+  pthread_join (trace_thread, NULL);
+  close (trace_fd);
+}
+
+/* bind the sockets of 'listen=' which are not open yet. */
+static int
+open_listeners (Task *task)
+{
+  const char *p;
+  int         len;
+  int         i;
+
+  if (!task->listen_count)
+    for (p = task->listen; task->listen_count == 0 || *p; p += len)
+      {
+        if (*p == ',')
+          p++;
+        len = strcspn (p, ",");
+        task->listen_fds[task->listen_count++] = -1;
+      }
+
+  for (i = 0, p = task->listen; i < task->listen_count; i++, p += len + 1)
+    {
+      struct sockaddr_storage addr;
+      socklen_t               addr_len;
+      struct stat             st;
+      int                     one = 1;
+      int                     fd;
+
+      len = strcspn (p, ",");
+      if (task->listen_fds[i] >= 0 || parse_listen (p, len, &addr, &addr_len))
+        continue;
+
+      fd = socket (addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+        {
+          MSG ("failed to create socket for task '%s': %s\n",
+               task->id, STRERROR);
+          return -1;
+        }
+      /* a socket left over by a killed procman. */
+      if (addr.ss_family == AF_UNIX)
+        {
+          const char *path = ((struct sockaddr_un *) &addr)->sun_path;
+
+          if (!stat (path, &st) && S_ISSOCK (st.st_mode))
+            unlink (path);
+        }
+      else
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+      if (bind (fd, (struct sockaddr *) &addr, addr_len)
+          || listen (fd, SOMAXCONN))
+        {
+          MSG ("failed to listen on '%.*s' for task '%s': %s\n",
+               len, p, task->id, STRERROR);
+          close (fd);
+          return -1;
+        }
+      task->listen_fds[i] = fd;
+    }
+
+  return 0;
+}
+
+static void
+close_task_listeners (Task *task)
+{
+  const char *p;
+  int         len;
+  int         i;
+
+  for (i = 0, p = task->listen; i < task->listen_count; i++, p += len + 1)
+    {
+      struct sockaddr_storage addr;
+      socklen_t               addr_len;
+
+      len = strcspn (p, ",");
+      if (task->listen_fds[i] < 0)
+        continue;
+      close (task->listen_fds[i]);
+      if (!parse_listen (p, len, &addr, &addr_len)
+          && addr.ss_family == AF_UNIX)
+        unlink (((struct sockaddr_un *) &addr)->sun_path);
+    }
+  task->listen_count = 0;
+}
+
+static void
+close_listeners (void)
+{
+  int i;
+
+  for (i = 0; i < registry.task_count; i++)
+    close_task_listeners (registry.tasks[i]);
+}
+
+/* a replacement takes over the sockets of the addresses it still has. */
+static void
+take_listeners (Task *n,
+                Task *o)
+{
+  const char *p;
+  const char *q;
+  int         len;
+  int         qlen;
+  int         i;
+  int         j;
+
+  if (!n->listen || !o->listen_count)
+    return;
+
+  for (p = n->listen; n->listen_count == 0 || *p; p += len)
+    {
+      if (*p == ',')
+        p++;
+      len = strcspn (p, ",");
+      i = n->listen_count++;
+      n->listen_fds[i] = -1;
+
+      for (j = 0, q = o->listen; j < o->listen_count; j++, q += qlen + 1)
+        {
+          qlen = strcspn (q, ",");
+          if (qlen == len && !memcmp (p, q, len) && o->listen_fds[j] >= 0)
+            {
+              n->listen_fds[i] = o->listen_fds[j];
+              o->listen_fds[j] = -1;
+              break;
+            }
+        }
+    }
+}
+
+/*
+ * In the child, the sockets go to fd 3 and up with LISTEN_FDS and
+ * LISTEN_PID set, as sd_listen_fds() expects them.
+ */
+static void
+pass_listeners (Task *task,
+                int  *notify_fd)
+{
+  char buf[COMMAND_LEN];
+  int  fds[LISTEN_MAX];
+  int  n = task->listen_count;
+  int  i;
+
+  if (*notify_fd >= 0 && *notify_fd < 3 + n)
+    *notify_fd = fcntl (*notify_fd, F_DUPFD_CLOEXEC, 3 + n);
+  for (i = 0; i < n; i++)
+    fds[i] = fcntl (task->listen_fds[i], F_DUPFD_CLOEXEC, 3 + n);
+  for (i = 0; i < n; i++)
+    dup2 (fds[i], 3 + i);
+
+  snprintf (buf, sizeof (buf), "%d", n);
+  setenv ("LISTEN_FDS", buf, 1);
+  snprintf (buf, sizeof (buf), "%d", getpid ());
+  setenv ("LISTEN_PID", buf, 1);
+  snprintf (buf, sizeof (buf), "%s", task->listen);
+  for (i = 0; buf[i]; i++)
+    if (buf[i] == ',')
+      buf[i] = ':';
+  setenv ("LISTEN_FDNAMES", buf, 1);
+}
+
+/*
+ * Get the stdin and stdout of a piped 'task', and the task which owns the
+ * pipes, all four of its pipe fds are closed in the child.
+ */
+static Task *
+get_task_pipes (Task *task,
+                int  *in,
+                int  *out)
+{
+  Task *owner;
+
+  if (!task->piped)
+    return NULL;
+
+  if (task->pipe_id[0] == '\0')
+    {
+      owner = task;
+      *in = owner->pipe_b[0];
+      *out = owner->pipe_a[1];
+    }
+  else
+    {
+      owner = lookup_task (task->pipe_id);
+      if (!owner || !owner->piped)
+        return NULL;
+      *in = owner->pipe_a[0];
+      *out = owner->pipe_b[1];
+    }
+
+  return owner;
+}
+
+static int
+has_places (Task *task)
+{
+  int i;
+
+  for (i = 0; i < PLACE_COUNT; i++)
+    if (task->places[i])
+      return 1;
+
+  return 0;
+}
+
+/* the least used cpu for a 'cpus=spread' task. */
+static void
+spread_task (Task *task)
+{
+  int cpu;
+  int i;
+
+  if (!task->places[PLACE_CPUS] || strcmp (task->places[PLACE_CPUS], "spread")
+      || task->cpu >= 0)
+    return;
+
+  cpu = -1;
+  for (i = 0; i < CPU_SETSIZE; i++)
+    if (CPU_ISSET (i, &spread_cpus)
+        && (cpu < 0 || spread_load[i] < spread_load[cpu]))
+      cpu = i;
+  if (cpu < 0)
+    return;
+
+  spread_load[cpu]++;
+  task->cpu = cpu;
+}
+
+static void
+unspread_task (Task *task)
+{
+  if (task->cpu < 0)
+    return;
+
+  spread_load[task->cpu]--;
+  task->cpu = -1;
+}
+
+/* the cpus of NUMA 'nodes', from sysfs. */
+static void
+get_node_cpus (const char *nodes,
+               cpu_set_t  *cpus)
+{
+  cpu_set_t set;
+  int       node;
+
+  CPU_ZERO (cpus);
+  parse_cpu_list (nodes, &set);
+  for (node = 0; node < CPU_SETSIZE; node++)
+    {
+      cpu_set_t node_cpus;
+      char      path[64];
+      char      buf[1024];
+      FILE     *fp;
+
+      if (!CPU_ISSET (node, &set))
+        continue;
+
+      snprintf (path, sizeof (path),
+                "/sys/devices/system/node/node%d/cpulist", node);
+      fp = fopen (path, "r");
+      if (!fp)
+        continue;
+      if (fgets (buf, sizeof (buf), fp) && !parse_cpu_list (buf, &node_cpus))
+        CPU_OR (cpus, cpus, &node_cpus);
+      fclose (fp);
+    }
+}
+
+/* the placement of 'task', see apply_placement(). */
+static void
+get_placement (Task      *task,
+               Placement *place)
+{
+  const char *str;
+
+  memset (place, 0x00, sizeof (*place));
+
+  str = task->places[PLACE_CPUS];
+  if (str && task->cpu >= 0)
+    CPU_SET (task->cpu, &place->cpus);
+  else if (str && strcmp (str, "spread"))
+    parse_cpu_list (str, &place->cpus);
+  else if (task->places[PLACE_NUMA])
+    get_node_cpus (task->places[PLACE_NUMA], &place->cpus);
+  if (CPU_COUNT (&place->cpus) > 0)
+    place->set |= PLACE_SET_CPUS;
+
+  str = task->places[PLACE_NUMA];
+  if (str)
+    {
+      parse_cpu_list (str, &place->nodes);
+      place->set |= PLACE_SET_NODES;
+    }
+
+  str = task->places[PLACE_NICE];
+  if (str)
+    {
+      place->nice = atoi (str);
+      place->set |= PLACE_SET_NICE;
+    }
+
+  str = task->places[PLACE_IOPRIO];
+  if (str && !parse_ioprio (str, &place->ioprio))
+    place->set |= PLACE_SET_IOPRIO;
+
+  str = task->places[PLACE_SCHED];
+  if (str)
+    {
+      place->policy = parse_sched (str);
+      place->set |= PLACE_SET_SCHED;
+    }
+}
+
+/*
+ * Apply the placement of 'task' to the child itself, before exec, so
+ * that nothing it runs or forks starts out of place.  posix_spawn() has
+ * no way to do this, so placed tasks are forked.
+ */
+static void
+place_child (Task *task)
+{
+  Placement place;
+
+  get_placement (task, &place);
+  apply_placement (&place, task->id);
+}
+
+/* the old path, copies procman itself before exec. */
+static pid_t
+fork_task (Task *task,
+           int   stdin_fd,
+           int   stdout_fd,
+           int   output_fd,
+           int   notify_fd,
+           int   leaf_fd)
+{
+  pid_t pid;
+
+  if (leaf_fd >= 0)
+    pid = clone_into_cgroup (leaf_fd);
+  else
+    pid = fork ();
+  if (pid < 0)
+    {
+      MSG ("failed to fork() for program '%s': %s\n", task->id, STRERROR);
+      return -1;
+    }
+
+  /* child process */
+  if (pid == 0)
+    {
+      Task *owner;
+      int   in;
+      int   out;
+
+      owner = get_task_pipes (task, &in, &out);
+      if (owner)
+        {
+          dup2 (out, 1);
+          dup2 (in, 0);
+          close (owner->pipe_a[0]);
+          close (owner->pipe_a[1]);
+          close (owner->pipe_b[0]);
+          close (owner->pipe_b[1]);
+        }
+      if (stdout_fd >= 0)
+        dup2 (stdout_fd, 1);
+      if (stdin_fd >= 0)
+        dup2 (stdin_fd, 0);
+      if (output_fd >= 0)
+        {
+          if (!owner && stdout_fd < 0)
+            dup2 (output_fd, 1);
+          dup2 (output_fd, 2);
+        }
+
+      if (task->listen_count > 0)
+        pass_listeners (task, &notify_fd);
+
+      if (task->replicas)
+        {
+          char buf[16];
+
+          snprintf (buf, sizeof (buf), "%d", task->replica);
+          setenv ("REPLICA", buf, 1);
+          snprintf (buf, sizeof (buf), "%d", task->replicas);
+          setenv ("REPLICAS", buf, 1);
+        }
+
+      if (notify_fd >= 0)
+        {
+          char fd[16];
+
+          fcntl (notify_fd, F_SETFD, 0);
+          snprintf (fd, sizeof (fd), "%d", notify_fd);
+          setenv ("NOTIFY_FD", fd, 1);
+        }
+
+      place_child (task);
+
+      signal (SIGPIPE, SIG_DFL);
+      sigprocmask (SIG_SETMASK, &orig_mask, NULL);
+
+      if (task->path)
+        execv (task->path, task->argv);
+      else
+        execvp (task->argv[0], task->argv);
+      MSG ("failed to execute command '%s': %s\n", task->argv[0], STRERROR);
+      exit (-1);
+    }
+
+  return pid;
+}
+
+/* environ with NOTIFY_FD set to 'notify_fd'. */
+static char **
+make_notify_envp (int notify_fd)
+{
+  char **envp;
+  char  *var;
+  int    n;
+  int    i;
+
+  for (n = 0; environ[n]; n++)
+    ;
+
+  envp = malloc ((n + 2) * sizeof (char *) + 32);
+  if (!envp)
+    return NULL;
+  var = (char *) (envp + n + 2);
+  snprintf (var, 32, "NOTIFY_FD=%d", notify_fd);
+
+  for (n = 0, i = 0; environ[i]; i++)
+    if (strncmp (environ[i], "NOTIFY_FD=", 10))
+      envp[n++] = environ[i];
+  envp[n++] = var;
+  envp[n] = NULL;
+
+  return envp;
+}
+
+/*
+ * posix_spawn() runs the child on a vfork()-like clone, so the address
+ * space of procman is never copied, and the pipes are set up with file
+ * actions instead of code in the child.
+ */
+static pid_t
+posix_spawn_task (Task *task,
+                  int   stdin_fd,
+                  int   stdout_fd,
+                  int   output_fd,
+                  int   notify_fd,
+                  int   leaf_fd)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t          attr;
+  sigset_t                   sigdef;
+  char                     **envp;
+  Task                      *owner;
+  pid_t                      pid;
+  int                        in;
+  int                        out;
+  int                        err;
+
+  envp = environ;
+  if (notify_fd >= 0)
+    {
+      envp = make_notify_envp (notify_fd);
+      if (!envp)
+        {
+          MSG ("failed to allocate environment for program '%s': %s\n",
+               task->id, STRERROR);
+          return -1;
+        }
+    }
+
+  posix_spawn_file_actions_init (&actions);
+  owner = get_task_pipes (task, &in, &out);
+  if (owner)
+    {
+      posix_spawn_file_actions_adddup2 (&actions, out, 1);
+      posix_spawn_file_actions_adddup2 (&actions, in, 0);
+      posix_spawn_file_actions_addclose (&actions, owner->pipe_a[0]);
+      posix_spawn_file_actions_addclose (&actions, owner->pipe_a[1]);
+      posix_spawn_file_actions_addclose (&actions, owner->pipe_b[0]);
+      posix_spawn_file_actions_addclose (&actions, owner->pipe_b[1]);
+    }
+  if (stdout_fd >= 0)
+    posix_spawn_file_actions_adddup2 (&actions, stdout_fd, 1);
+  if (stdin_fd >= 0)
+    posix_spawn_file_actions_adddup2 (&actions, stdin_fd, 0);
+  if (output_fd >= 0)
+    {
+      if (!owner && stdout_fd < 0)
+        posix_spawn_file_actions_adddup2 (&actions, output_fd, 1);
+      posix_spawn_file_actions_adddup2 (&actions, output_fd, 2);
+    }
+  /* dup2() onto itself clears FD_CLOEXEC. */
+  if (notify_fd >= 0)
+    posix_spawn_file_actions_adddup2 (&actions, notify_fd, notify_fd);
+
+  posix_spawnattr_init (&attr);
+  /* procman ignores SIGPIPE for the pipelines, its children must not. */
+  sigemptyset (&sigdef);
+  sigaddset (&sigdef, SIGPIPE);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setsigmask (&attr, &orig_mask);
+  posix_spawnattr_setsigdefault (&attr, &sigdef);
+#if SPAWN_CGROUP
+  if (leaf_fd >= 0)
+    {
+      posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF
+                                       | POSIX_SPAWN_SETCGROUP);
+      posix_spawnattr_setcgroup_np (&attr, leaf_fd);
+    }
+#endif
+
+  if (task->path)
+    err = posix_spawn (&pid, task->path, &actions, &attr, task->argv, envp);
+  else
+    err = posix_spawnp (&pid, task->argv[0], &actions, &attr, task->argv, envp);
+
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  if (envp != environ)
+    free (envp);
+
+  if (err)
+    {
+      MSG ("failed to execute command '%s': %s\n", task->argv[0],
+           strerror (err));
+      errno = err;
+      return -1;
+    }
+
+  return pid;
+}
+
+/* the child's ends, and ours too if it did not start. */
+static void
+close_spawn (Spawn *spawn,
+             int    started)
+{
+  if (spawn->leaf >= 0)
+    close (spawn->leaf);
+  if (spawn->in[0] >= 0)
+    close (spawn->in[0]);
+  if (spawn->out[1] >= 0)
+    close (spawn->out[1]);
+  if (started)
+    return;
+
+  if (spawn->notify[0] >= 0)
+    {
+      close (spawn->notify[0]);
+      close (spawn->notify[1]);
+    }
+  if (spawn->in[1] >= 0)
+    close (spawn->in[1]);
+  if (spawn->out[0] >= 0)
+    close (spawn->out[0]);
+}
+
+/*
+ * Zygotes.
+ *
+ * A zygote=yes task is forked by a template, a copy of its command run
+ * with ZYGOTE_FD which does its startup work once and then waits for
+ * requests, see zygote.h.  The children are cloned with CLONE_PARENT, so
+ * procman reaps, signals and places them like any other; only the exec
+ * and the startup are skipped.  Tasks with the same command, such as
+ * replicas, share a template.  Until the template says hello, and for
+ * ZYGOTE_RETRY ms after it died, the spawns are cold.  Piped tasks and
+ * listeners are never forked by one, their fds are set up by fork_task().
+ *
+ * A request does not wait for the reply: the task stays 'starting' in
+ * 'waiting', which the replies come back in the order of, and goes cold
+ * if there is none within ZYGOTE_REPLY ms or the template is gone.
+ */
+#define ZYGOTE_RETRY 1000       /* ms */
+#define ZYGOTE_REPLY 1000       /* ms */
+
+struct _Zygote
+{
+  Zygote    *next;
+  Config    *config;            /* holds 'argv' and 'path' */
+  char     **argv;              /* the key of its class */
+  char      *path;
+  char       id[ID_MAX + 1];    /* of the first task, for messages */
+  pid_t      pid;               /* of the template, 0 once reaped */
+  int        ready;             /* said hello */
+  int        users;             /* tasks with it as zygote_class */
+  Watch      watch;
+  long long  start_time;
+  Task     **waiting;           /* requests sent, NULL once cancelled */
+  int        waiting_len;
+  int        waiting_max;
+};
+
+static Zygote *zygotes;
+static int     zygote_waiting;  /* tasks, for upgrade_blocked() */
+static int     reaps_held;      /* see held_reap() */
+
+static void zygote_replied (Task *task, pid_t pid);
+
+static int
+same_command (Zygote *z,
+              Task   *task)
+{
+  int i;
+
+  if (!z->path != !task->path || (z->path && strcmp (z->path, task->path)))
+    return 0;
+  for (i = 0; z->argv[i] && task->argv[i]; i++)
+    if (strcmp (z->argv[i], task->argv[i]))
+      return 0;
+
+  return !z->argv[i] && !task->argv[i];
+}
+
+/*
+ * Whether the reapers leave the unknown child 'pid' alone, as it may be
+ * forked for a request whose reply is not read yet.  They go on with
+ * the next SIGCHLD, see unwait_zygote().
+ */
+static int
+held_reap (pid_t pid)
+{
+  Zygote *z;
+
+  if (!zygote_waiting)
+    return 0;
+  for (z = zygotes; z; z = z->next)
+    if (z->pid == pid)
+      return 0;
+
+  reaps_held = 1;
+  return 1;
+}
+
+/* a reply less to wait for. */
+static void
+unwait_zygote (void)
+{
+  if (--zygote_waiting == 0 && reaps_held)
+    {
+      reaps_held = 0;
+      raise (SIGCHLD);
+    }
+}
+
+/* the oldest request of 'z', NULL if it was cancelled. */
+static Task *
+next_waiting (Zygote *z)
+{
+  Task *task = z->waiting[0];
+
+  z->waiting_len--;
+  memmove (z->waiting, z->waiting + 1, z->waiting_len * sizeof (Task *));
+
+  return task;
+}
+
+/* the requests which 'z' will not answer go cold. */
+static void
+flush_zygote (Zygote *z)
+{
+  while (z->waiting_len > 0)
+    {
+      Task *task = next_waiting (z);
+
+      if (task)
+        zygote_replied (task, 0);
+    }
+}
+
+static void
+read_zygote (Watch        *watch,
+             unsigned int  events)
+{
+  Zygote      *z = watch->data;
+  ZygoteReply  reply;
+  ssize_t      len;
+  Task        *task;
+
+  /* the replies to a burst of requests come together. */
+  while ((len = recv (watch->fd, &reply, sizeof (reply), MSG_DONTWAIT))
+         == sizeof (reply))
+    {
+      if (!z->ready)
+        {
+          z->ready = 1;
+          continue;
+        }
+      if (!z->waiting_len)
+        continue;
+
+      task = next_waiting (z);
+      if (!task)
+        {
+          /* stopped while it was forked. */
+          if (reply.pid > 0)
+            kill (reply.pid, SIGKILL);
+          continue;
+        }
+      if (reply.pid <= 0)
+        MSG ("zygote of task '%s' failed to fork: %s\n", z->id,
+             strerror (reply.error));
+      zygote_replied (task, reply.pid > 0 ? reply.pid : 0);
+
+      /* stopped from zygote_replied(). */
+      if (watch->fd < 0)
+        return;
+    }
+  if (len < 0 && errno == EAGAIN)
+    return;
+
+  MSG ("zygote of task '%s' is gone\n", z->id);
+  watch_close (&z->watch);
+  z->ready = 0;
+  flush_zygote (z);
+}
+
+static void
+start_zygote (Zygote *z)
+{
+  pid_t pid;
+  int   sv[2];
+
+  z->start_time = now_ns ();
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+    {
+      MSG ("failed to socketpair() for zygote of task '%s': %s\n", z->id,
+           STRERROR);
+      return;
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      MSG ("failed to fork() for zygote of task '%s': %s\n", z->id, STRERROR);
+      close (sv[0]);
+      close (sv[1]);
+      return;
+    }
+
+  /* child process */
+  if (pid == 0)
+    {
+      char fd[16];
+
+      fcntl (sv[1], F_SETFD, 0);
+      snprintf (fd, sizeof (fd), "%d", sv[1]);
+      setenv ("ZYGOTE_FD", fd, 1);
+
+      signal (SIGPIPE, SIG_DFL);
+      sigprocmask (SIG_SETMASK, &orig_mask, NULL);
+
+      if (z->path)
+        execv (z->path, z->argv);
+      else
+        execvp (z->argv[0], z->argv);
+      MSG ("failed to execute zygote '%s': %s\n", z->argv[0], STRERROR);
+      exit (-1);
+    }
+
+  close (sv[1]);
+  z->pid = pid;
+  z->ready = 0;
+  stats.zygote_starts++;
+  if (watch_add (&z->watch, sv[0], EPOLLIN, read_zygote, z))
+    {
+      close (sv[0]);
+      kill (pid, SIGKILL);
+    }
+}
+
+/* closing the socket is enough, but a template may still be starting. */
+static void
+stop_zygote (Zygote *z)
+{
+  watch_close (&z->watch);
+  z->ready = 0;
+  if (z->pid > 0)
+    kill (z->pid, SIGKILL);
+  flush_zygote (z);
+}
+
+static void
+free_zygote (Zygote *z)
+{
+  Zygote **p;
+
+  for (p = &zygotes; *p; p = &(*p)->next)
+    if (*p == z)
+      {
+        *p = z->next;
+        break;
+      }
+  config_unref (z->config);
+  free (z->waiting);
+  free (z);
+}
+
+/* the template of 'task' if it is ready, started if it is not running. */
+static Zygote *
+get_zygote (Task *task)
+{
+  Zygote *z = task->zygote_class;
+
+  if (!z)
+    {
+      for (z = zygotes; z; z = z->next)
+        if (same_command (z, task))
+          break;
+      if (!z)
+        {
+          z = calloc (1, sizeof (Zygote));
+          if (!z)
+            return NULL;
+          z->config = config_ref (task->config);
+          z->argv = task->argv;
+          z->path = task->path;
+          strcpy (z->id, task->id);
+          z->watch.fd = -1;
+          z->next = zygotes;
+          zygotes = z;
+        }
+      z->users++;
+      task->zygote_class = z;
+    }
+
+  if (!z->pid && now_ns () - z->start_time >= ZYGOTE_RETRY * 1000000LL)
+    start_zygote (z);
+
+  return z->ready ? z : NULL;
+}
+
+static void
+release_zygote (Task *task)
+{
+  Zygote *z = task->zygote_class;
+
+  task->zygote_class = NULL;
+  if (!z || --z->users > 0)
+    return;
+
+  stop_zygote (z);
+  if (!z->pid)
+    free_zygote (z);
+}
+
+/* whether 'pid' was a template, from the reaper. */
+static int
+reap_zygote (pid_t pid)
+{
+  Zygote *z;
+
+  for (z = zygotes; z; z = z->next)
+    if (z->pid == pid)
+      {
+        z->pid = 0;
+        watch_close (&z->watch);
+        z->ready = 0;
+        flush_zygote (z);
+        if (!z->users)
+          free_zygote (z);
+        return 1;
+      }
+
+  return 0;
+}
+
+/* before an upgrade or an exit, the templates are no tasks to hand over. */
+static void
+stop_zygotes (void)
+{
+  Zygote *z;
+
+  for (z = zygotes; z; z = z->next)
+    {
+      stop_zygote (z);
+      if (z->pid > 0)
+        waitpid (z->pid, NULL, 0);
+      z->pid = 0;
+    }
+}
+
+/* no reply within ZYGOTE_REPLY ms, the template is stuck. */
+static void
+zygote_timeout (Timer *timer)
+{
+  Task   *task = timer->data;
+  Zygote *z = task->zygote_class;
+
+  MSG ("zygote of task '%s' does not answer, restarting it\n", z->id);
+  stop_zygote (z);
+}
+
+/*
+ * Drop the request of 'task' before its reply, 1 if there was one.  A
+ * child forked for it meanwhile is killed by read_zygote().
+ */
+static int
+cancel_zygote_task (Task *task)
+{
+  Zygote *z = task->zygote_class;
+  int     i;
+
+  if (!timer_pending (&task->zygote_timer))
+    return 0;
+
+  timer_stop (&task->zygote_timer);
+  unwait_zygote ();
+  for (i = 0; i < z->waiting_len; i++)
+    if (z->waiting[i] == task)
+      z->waiting[i] = NULL;
+  close_spawn (&task->spawn, 0);
+  unspread_task (task);
+
+  return 1;
+}
+
+/*
+ * Ask the template of 'task' for a child with the fds of 'spawn', as
+ * fork_task() would set them up.  1 if the request went out, 0 if there
+ * is no template to ask, or it failed.
+ */
+static int
+zygote_task (Task  *task,
+             Spawn *spawn)
+{
+  ZygoteRequest   request;
+  struct msghdr   msg;
+  struct iovec    iov;
+  struct cmsghdr *cmsg;
+  union
+  {
+    struct cmsghdr header;
+    char           buf[CMSG_SPACE (ZYGOTE_FDS * sizeof (int))];
+  } control;
+  Zygote         *z;
+  int             fds[ZYGOTE_FDS];
+  int             count;
+  int             i;
+
+  if (task->piped || task->listen_count > 0)
+    return 0;
+
+  z = get_zygote (task);
+  if (!z)
+    {
+      stats.zygote_colds++;
+      return 0;
+    }
+
+  if (z->waiting_len == z->waiting_max)
+    {
+      Task **waiting;
+      int    max;
+
+      max = z->waiting_max ? z->waiting_max * 2 : 8;
+      waiting = realloc (z->waiting, max * sizeof (Task *));
+      if (!waiting)
+        {
+          stats.zygote_colds++;
+          return 0;
+        }
+      z->waiting = waiting;
+      z->waiting_max = max;
+    }
+
+  memset (&request, 0x00, sizeof (request));
+  snprintf (request.id, sizeof (request.id), "%s", task->id);
+  get_placement (task, &request.place);
+  if (task->replicas)
+    request.env_len = snprintf (request.env, sizeof (request.env),
+                                "REPLICA=%d%cREPLICAS=%d", task->replica,
+                                '\0', task->replicas) + 1;
+
+  fds[ZYGOTE_STDIN] = spawn->in[0];
+  fds[ZYGOTE_STDOUT] = spawn->out[1] >= 0 ? spawn->out[1] : spawn->output;
+  fds[ZYGOTE_STDERR] = spawn->output;
+  fds[ZYGOTE_NOTIFY] = spawn->notify[1];
+  fds[ZYGOTE_CGROUP] = spawn->leaf;
+  for (i = 0, count = 0; i < ZYGOTE_FDS; i++)
+    if (fds[i] >= 0)
+      {
+        request.fds |= 1 << i;
+        fds[count++] = fds[i];
+      }
+
+  memset (&msg, 0x00, sizeof (msg));
+  iov.iov_base = &request;
+  iov.iov_len = sizeof (request);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (count > 0)
+    {
+      memset (&control, 0x00, sizeof (control));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE (count * sizeof (int));
+      cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (count * sizeof (int));
+      memcpy (CMSG_DATA (cmsg), fds, count * sizeof (int));
+    }
+
+  if (sendmsg (z->watch.fd, &msg, MSG_NOSIGNAL) != sizeof (request))
+    {
+      MSG ("zygote of task '%s' does not answer, restarting it\n", z->id);
+      stop_zygote (z);
+      stats.zygote_colds++;
+      return 0;
+    }
+
+  /* the fds stay open for a cold spawn, until the reply. */
+  task->spawn = *spawn;
+  z->waiting[z->waiting_len++] = task;
+  zygote_waiting++;
+  timer_start (&task->zygote_timer, ZYGOTE_REPLY, zygote_timeout, task);
+  set_task_state (task, TASK_STARTING);
+
+  return 1;
+}
+
+static void
+kill_run (Timer *timer)
+{
+  Task *task = timer->data;
+
+  if (task->cgroup)
+    kill_task_cgroup (task, SIGKILL);
+  else
+    signal_task (task, SIGKILL);
+}
+
+/* end the current run, killing it if it outlives the grace period. */
+static void
+stop_run (Task *task)
+{
+  if (task->cgroup)
+    kill_task_cgroup (task, SIGTERM);
+  else
+    signal_task (task, SIGTERM);
+  timer_start (&task->run_timer,
+               task->grace >= 0 ? task->grace : teardown.grace,
+               kill_run, task);
+}
+
+static void
+run_timeout (Timer *timer)
+{
+  Task *task = timer->data;
+
+  MSG ("task '%s' timed out after %lld ms\n", task->id, task->timeout);
+  trace_event (TRACE_TIMEOUT, task, task->timeout, 0);
+  stats.timeouts++;
+  stop_run (task);
+}
+
+/*
+ * Admission control.
+ *
+ * With -A, a spawn waits while the "some avg10" pressure of cpu, memory
+ * or io (from /proc/pressure, or path=) is above its threshold, so a
+ * respawn storm or a mass startup does not fork into a thrashing machine.
+ * Waiting tasks are in a heap by priority, then by arrival, and while any
+ * waits the new spawns queue up behind them.  Every ADMIT_POLL ms the
+ * pressure is read again, and while it is below the thresholds up to
+ * 'batch' tasks are let through, since avg10 lags behind the spawns.
+ * Tasks with priority= above 0 never wait.
+ */
+#define ADMIT_POLL     100      /* ms */
+#define PRESSURE_COUNT 3
+
+typedef struct _Admission Admission;
+struct _Admission
+{
+  int       enabled;
+  char     *path;
+  double    limits[PRESSURE_COUNT];    /* avg10 percent, 0 to ignore */
+  double    pressure[PRESSURE_COUNT];
+  long long read_time;
+  int       batch;
+  Task    **queue;
+  int       len;
+  int       max;
+  long long seq;
+  Timer     timer;
+};
+
+static const char *pressure_names[PRESSURE_COUNT] = { "cpu", "memory", "io" };
+
+static Admission admission = { .path = "/proc/pressure", .batch = 16 };
+
+/*
+ * "cpu=80,memory=20,io=50,batch=16,path=/proc/pressure" of -A, on a copy
+ * since argv goes to the exec of an upgrade as it is.
+ */
+static int
+parse_admission (const char *spec)
+{
+  Admission parsed;
+  char     *str;
+  char     *save;
+  char     *s;
+  int       failed;
+
+  str = strdup (spec);
+  if (!str)
+    return -1;
+
+  /* into a copy, 'admission' is only set when all of it is valid. */
+  parsed = admission;
+  failed = 0;
+  for (s = strtok_r (str, ",", &save); s && !failed;
+       s = strtok_r (NULL, ",", &save))
+    {
+      char *value;
+      char *end;
+      int   i;
+
+      value = strchr (s, '=');
+      if (!value)
+        {
+          failed = 1;
+          continue;
+        }
+      *value++ = '\0';
+
+      for (i = 0; i < PRESSURE_COUNT; i++)
+        if (!strcmp (s, pressure_names[i]))
+          break;
+      if (i < PRESSURE_COUNT)
+        {
+          parsed.limits[i] = strtod (value, &end);
+          if (end == value || *end || parsed.limits[i] <= 0
+              || parsed.limits[i] > 100)
+            failed = 1;
+        }
+      else if (!strcmp (s, "batch"))
+        {
+          parsed.batch = strtol (value, &end, 10);
+          if (end == value || *end || parsed.batch < 1)
+            failed = 1;
+        }
+      else if (!strcmp (s, "path"))
+        {
+          if (parsed.path != admission.path)
+            free (parsed.path);
+          parsed.path = strdup (value);
+          if (!parsed.path)
+            failed = 1;
+        }
+      else
+        failed = 1;
+    }
+  free (str);
+
+  if (failed)
+    {
+      if (parsed.path != admission.path)
+        free (parsed.path);
+      return -1;
+    }
+  parsed.enabled = 1;
+  admission = parsed;
+
+  return 0;
+}
+
+static void
+read_pressure (void)
+{
+  char path[PATH_MAX];
+  char buf[256];
+  int  i;
+
+  for (i = 0; i < PRESSURE_COUNT; i++)
+    {
+      ssize_t len;
+      char   *p;
+      int     fd;
+
+      admission.pressure[i] = 0;
+      if (!admission.limits[i])
+        continue;
+
+      snprintf (path, sizeof (path), "%s/%s", admission.path,
+                pressure_names[i]);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      len = read (fd, buf, sizeof (buf) - 1);
+      close (fd);
+      if (len <= 0)
+        continue;
+      buf[len] = '\0';
+
+      p = strstr (buf, "some avg10=");
+      if (p)
+        admission.pressure[i] = strtod (p + 11, NULL);
+    }
+  admission.read_time = now_ns ();
+}
+
+/* at most ADMIT_POLL ms old. */
+static int
+pressure_high (void)
+{
+  int i;
+
+  if (now_ns () - admission.read_time >= ADMIT_POLL * 1000000LL)
+    read_pressure ();
+  for (i = 0; i < PRESSURE_COUNT; i++)
+    if (admission.limits[i] && admission.pressure[i] > admission.limits[i])
+      return 1;
+
+  return 0;
+}
+
+static void
+setup_admission (void)
+{
+  char path[PATH_MAX];
+  int  i;
+
+  if (!admission.enabled)
+    return;
+
+  for (i = 0; i < PRESSURE_COUNT; i++)
+    {
+      if (!admission.limits[i])
+        continue;
+      snprintf (path, sizeof (path), "%s/%s", admission.path,
+                pressure_names[i]);
+      if (access (path, R_OK))
+        MSG ("failed to read pressure file '%s': %s\n", path, STRERROR);
+    }
+  read_pressure ();
+}
+
+static int
+admit_before (const Task *a,
+              const Task *b)
+{
+  if (a->priority != b->priority)
+    return a->priority > b->priority;
+  return a->admit_seq < b->admit_seq;
+}
+
+static void
+admit_set (int   i,
+           Task *task)
+{
+  admission.queue[i] = task;
+  task->admit_index = i + 1;
+}
+
+static void
+admit_sift_up (int i)
+{
+  Task *task = admission.queue[i];
+
+  while (i > 0 && admit_before (task, admission.queue[(i - 1) / 2]))
+    {
+      admit_set (i, admission.queue[(i - 1) / 2]);
+      i = (i - 1) / 2;
+    }
+  admit_set (i, task);
+}
+
+static void
+admit_sift_down (int i)
+{
+  Task *task = admission.queue[i];
+
+  for (;;)
+    {
+      int child = i * 2 + 1;
+
+      if (child >= admission.len)
+        break;
+      if (child + 1 < admission.len
+          && admit_before (admission.queue[child + 1],
+                           admission.queue[child]))
+        child++;
+      if (!admit_before (admission.queue[child], task))
+        break;
+      admit_set (i, admission.queue[child]);
+      i = child;
+    }
+  admit_set (i, task);
+}
+
+/* returns whether it was waiting. */
+static int
+unqueue_task (Task *task)
+{
+  int i;
+
+  if (!task->admit_index)
+    return 0;
+
+  i = task->admit_index - 1;
+  task->admit_index = 0;
+  task->queued_time = 0;
+  if (i < --admission.len)
+    {
+      admit_set (i, admission.queue[admission.len]);
+      admit_sift_up (i);
+      admit_sift_down (admission.queue[i]->admit_index - 1);
+    }
+  if (!admission.len)
+    timer_stop (&admission.timer);
+
+  return 1;
+}
+
+static void admit_tasks (Timer *timer);
+
+static int
+queue_task (Task *task)
+{
+  if (admission.len == admission.max)
+    {
+      Task **queue;
+      int    max;
+
+      max = admission.max ? admission.max * 2 : 64;
+      queue = realloc (admission.queue, max * sizeof (Task *));
+      if (!queue)
+        return -1;
+      admission.queue = queue;
+      admission.max = max;
+    }
+
+  task->admit_seq = admission.seq++;
+  if (!task->queued_time)
+    task->queued_time = now_ns ();
+  admission.queue[admission.len++] = task;
+  admit_sift_up (admission.len - 1);
+
+  if (!timer_pending (&admission.timer))
+    timer_start (&admission.timer, ADMIT_POLL, admit_tasks, NULL);
+
+  return 0;
+}
+
+/*
+ * In front of every spawn: returns 1 if 'task' has to wait, or already
+ * does, see Admission.
+ */
+static int
+defer_spawn (Task *task)
+{
+  if (task->admit_index)
+    return 1;
+  if (task->admitted)
+    {
+      task->admitted = 0;
+      return 0;
+    }
+  if (!admission.enabled || task->priority > 0
+      || (!admission.len && !pressure_high ()))
+    return 0;
+  if (queue_task (task))
+    return 0;
+
+  trace_event (TRACE_DEFER, task, task->priority, 0);
+  stats.deferrals++;
+  set_task_pid (task, 0);
+  set_task_state (task, TASK_DEFERRED);
+
+  return 1;
+}
+
+static void handle_pidfd (Watch *watch, unsigned int events);
+
+/* take 'pid' as the child of 'spawn', or clean up after it if it is -1. */
+static int
+finish_spawn (Task  *task,
+              Spawn *spawn,
+              pid_t  pid)
+{
+  stats.spawn_time += now_ns () - spawn->start;
+  close_spawn (spawn, pid >= 0);
+
+  if (pid < 0)
+    {
+      trace_event (TRACE_SPAWN_FAILED, task, errno, 0);
+      set_task_pid (task, 0);
+      unspread_task (task);
+      return -1;
+    }
+
+  if (spawn->out[0] >= 0)
+    start_relay (task, spawn->out[0]);
+  if (spawn->in[1] >= 0)
+    start_edge (task, spawn->in[1]);
+
+  set_task_pid (task, pid);
+  if (task->spawn_time)
+    task->restarts++;
+  task->spawn_time = now_ns ();
+  task->spawn_realtime = realtime_ns ();
+  live_children++;
+  stats.spawns++;
+  trace_event (TRACE_SPAWN, task, task->spawn_time - spawn->start,
+               spawn->start);
+
+  /* the child is not reaped yet, so its pid can not be recycled here. */
+  if (use_pidfd)
+    {
+      int fd;
+
+      fd = syscall (SYS_pidfd_open, pid, 0);
+      if (fd >= 0)
+        {
+          fcntl (fd, F_SETFD, FD_CLOEXEC);
+          if (!watch_add (&task->pid_watch, fd, EPOLLIN, handle_pidfd, task))
+            task->pidfd = fd;
+          else
+            close (fd);
+        }
+    }
+  if (task->pidfd < 0)
+    sigchld_children++;
+
+  if (spawn->notify[0] >= 0)
+    {
+      close (spawn->notify[1]);
+      close_notify (task);
+      fcntl (spawn->notify[0], F_SETFL, O_NONBLOCK);
+      task->notify_fd = spawn->notify[0];
+      watch_add (&task->notify_watch, spawn->notify[0], EPOLLIN, read_notify,
+                 task);
+      set_task_state (task, TASK_STARTING);
+      if (task->ready_timeout > 0)
+        timer_start (&task->ready_timer, task->ready_timeout,
+                     ready_timeout, task);
+    }
+  else
+    {
+      set_task_state (task, TASK_RUNNING);
+      ready_sample (task, 0);
+      finish_handoff (task);
+    }
+  if (task->timeout > 0)
+    timer_start (&task->run_timer, task->timeout, run_timeout, task);
+
+  return 0;
+}
+
+/* fork or exec 'task' cold, without a template. */
+static int
+exec_task (Task  *task,
+           Spawn *spawn)
+{
+  pid_t pid;
+
+  if (use_fork || has_places (task) || task->listen_count > 0
+      || task->replicas || (spawn->leaf >= 0 && !SPAWN_CGROUP))
+    pid = fork_task (task, spawn->in[0], spawn->out[1], spawn->output,
+                     spawn->notify[1], spawn->leaf);
+  else
+    pid = posix_spawn_task (task, spawn->in[0], spawn->out[1], spawn->output,
+                            spawn->notify[1], spawn->leaf);
+
+  return finish_spawn (task, spawn, pid);
+}
+
+/*
+ * Start 'task', 0 once it runs or is on its way.  A zygote=yes task
+ * stays 'starting' until its template replies, see zygote_replied().
+ */
+static int
+spawn_task (Task *task)
+{
+  Spawn spawn;
+
+  if (0) MSG ("spawn program '%s'...\n", task->id);
+  if (defer_spawn (task))
+    return 0;
+
+  if (task->listen && open_listeners (task))
+    return -1;
+
+  spawn.notify[0] = spawn.notify[1] = -1;
+  if (task->ready == READY_NOTIFY && pipe2 (spawn.notify, O_CLOEXEC))
+    {
+      MSG ("failed to pipe() for program '%s': %s\n", task->id, STRERROR);
+      return -1;
+    }
+
+  if (task->piped && task->pipe_id[0] == '\0')
+    {
+      if (pipe (task->pipe_a))
+        {
+          task->piped = 0;
+          MSG ("failed to pipe() for prgoram '%s': %s\n", task->id, STRERROR);
+        }
+      if (pipe (task->pipe_b))
+        {
+          task->piped = 0;
+          MSG ("failed to pipe() for prgoram '%s': %s\n", task->id, STRERROR);
+        }
+      if (task->piped && task->pipe_size > 0)
+        {
+          fcntl (task->pipe_a[0], F_SETPIPE_SZ, task->pipe_size);
+          fcntl (task->pipe_b[0], F_SETPIPE_SZ, task->pipe_size);
+        }
+    }
+
+  spawn.in[0] = spawn.in[1] = spawn.out[0] = spawn.out[1] = -1;
+  if (task->relay && open_pipe (spawn.out, task->pipe_size))
+    MSG ("failed to pipe() for program '%s': %s\n", task->id, STRERROR);
+  if (task->input_edge)
+    {
+      int size;
+
+      /* the producer's pipe size, unless the consumer has one. */
+      size = task->pipe_size;
+      if (!size)
+        size = task->input_edge->relay->producer->pipe_size;
+      if (open_pipe (spawn.in, size))
+        MSG ("failed to pipe() for program '%s': %s\n", task->id, STRERROR);
+    }
+
+  spawn.output = open_task_log (task);
+  spawn.leaf = open_task_cgroup (task);
+  spread_task (task);
+
+  spawn.start = now_ns ();
+  if (task->zygote && zygote_task (task, &spawn))
+    return 0;
+
+  return exec_task (task, &spawn);
+}
+
+/*
+ * The reply of the template to the request of 'task', 'pid' is 0 to
+ * spawn it cold.  Whoever spawned it counted on a 'starting' task, so
+ * it is released here as start_tasks() would have.
+ */
+static void
+zygote_replied (Task  *task,
+                pid_t  pid)
+{
+  Spawn spawn = task->spawn;
+  int   failed;
+
+  timer_stop (&task->zygote_timer);
+  unwait_zygote ();
+  if (pid > 0)
+    {
+      stats.zygote_forks++;
+      failed = finish_spawn (task, &spawn, pid);
+    }
+  else
+    {
+      stats.zygote_colds++;
+      failed = exec_task (task, &spawn);
+    }
+
+  if (failed)
+    set_task_state (task, TASK_FAILED);
+  if ((failed || task->state != TASK_STARTING) && !task->released)
+    {
+      startup.starting--;
+      release_task (task);
+    }
+}
+
+/*
+ * Let waiting tasks through while the pressure is low, and finish their
+ * startup as start_tasks() would have.
+ */
+static void
+admit_tasks (Timer *timer)
+{
+  int n;
+
+  read_pressure ();
+  for (n = 0; n < admission.batch && admission.len > 0 && !pressure_high ();
+       n++)
+    {
+      Task     *task = admission.queue[0];
+      long long delay;
+
+      delay = now_ns () - task->queued_time;
+      unqueue_task (task);
+      task->queue_delay = delay;
+      stats.admissions++;
+      stats.queue_time += delay;
+      if (stats.queue_time_max < delay)
+        stats.queue_time_max = delay;
+      trace_event (TRACE_ADMIT, task, delay, 0);
+
+      task->admitted = 1;
+      if (spawn_task (task))
+        set_task_state (task, TASK_FAILED);
+      if (task->released)
+        continue;
+      if (task->state == TASK_STARTING)
+        startup.starting++;
+      else
+        release_task (task);
+    }
+
+  if (admission.len > 0)
+    timer_start (&admission.timer, ADMIT_POLL, admit_tasks, NULL);
+}
+
+static void run_scheduled (Timer *timer);
+
+/*
+ * Arm the next run of an 'interval' or 'calendar' task.  Intervals keep
+ * a fixed rate from the first run and drop the periods missed, calendar
+ * runs follow the wall clock.  Returns -1 if the calendar never matches.
+ */
+static int
+schedule_task (Task *task)
+{
+  long long now;
+  long long delay;
+
+  if (task->action == ACTION_INTERVAL)
+    {
+      long long period = task->every * 1000000LL;
+
+      now = now_ns ();
+      if (!task->next_run)
+        task->next_run = now;
+      else if (task->next_run <= now)
+        task->next_run += ((now - task->next_run) / period + 1) * period;
+    }
+  else
+    {
+      now = realtime_ns ();
+      task->next_run = calendar_next (&task->calendar, now);
+      if (task->next_run < 0)
+        {
+          MSG ("task '%s' has no next run\n", task->id);
+          return -1;
+        }
+    }
+
+  delay = (task->next_run - now + 999999) / 1000000;
+  if (!timer_pending (&task->schedule_timer))
+    scheduled_tasks++;
+  timer_start (&task->schedule_timer, delay, run_scheduled, task);
+
+  return 0;
+}
+
+/* returns whether a run was scheduled. */
+static int
+unschedule_task (Task *task)
+{
+  if (!timer_pending (&task->schedule_timer))
+    return 0;
+
+  timer_stop (&task->schedule_timer);
+  scheduled_tasks--;
+
+  return 1;
+}
+
+static void
+run_scheduled (Timer *timer)
+{
+  Task *task = timer->data;
+
+  scheduled_tasks--;
+  if (!running)
+    return;
+
+  /* the wall clock is behind the monotonic one the wheel runs on. */
+  if (task->action == ACTION_CALENDAR && realtime_ns () < task->next_run)
+    {
+      scheduled_tasks++;
+      timer_start (&task->schedule_timer,
+                   (task->next_run - realtime_ns () + 999999) / 1000000,
+                   run_scheduled, task);
+      return;
+    }
+
+  if (schedule_task (task))
+    set_task_state (task, task->pid > 0 ? task->state : TASK_FAILED);
+  stats.scheduled_runs++;
+
+  if (task->pid > 0)
+    {
+      switch (task->overrun)
+        {
+        case OVERRUN_QUEUE:
+          /* one run waits at most, the later ones are skipped. */
+          if (!task->restart)
+            {
+              task->restart = 1;
+              return;
+            }
+          break;
+        case OVERRUN_KILL:
+          if (!task->restart)
+            {
+              task->restart = 1;
+              stop_run (task);
+            }
+          return;
+        case OVERRUN_SKIP:
+          break;
+        }
+      trace_event (TRACE_SKIP, task, 0, 0);
+      stats.skipped_runs++;
+      return;
+    }
+
+  if (spawn_task (task))
+    set_task_state (task, TASK_FAILED);
+}
+
+/*
+ * Launch every task whose dependencies are satisfied, as long as the
+ * number of tasks still starting is below the parallelism cap.
+ */
+static void
+start_tasks (void)
+{
+  while (running
+         && startup.queue_head < startup.queue_len
+         && (!startup.max_jobs || startup.starting < startup.max_jobs))
+    {
+      Task *task;
+
+      task = startup.queue[startup.queue_head++];
+      if (task->released)
+        continue;
+
+      /* adopted from the image before while it was starting. */
+      if (task->pid > 0)
+        {
+          startup.starting++;
+          continue;
+        }
+
+      /* stopped from the control socket before its turn. */
+      if (task->held)
+        {
+          set_task_state (task, TASK_STOPPED);
+          release_task (task);
+          continue;
+        }
+
+      /* runs come from the wheel, the first interval one right away. */
+      if (task->action == ACTION_INTERVAL || task->action == ACTION_CALENDAR)
+        {
+          set_task_state (task, schedule_task (task) ? TASK_FAILED
+                                                     : TASK_SCHEDULED);
+          release_task (task);
+          continue;
+        }
+
+      if (spawn_task (task))
+        {
+          set_task_state (task, TASK_FAILED);
+          release_task (task);
+        }
+      else if (task->state == TASK_DEFERRED)
+        continue;
+      else if (task->state == TASK_STARTING)
+        startup.starting++;
+      else
+        release_task (task);
+    }
+}
+
+/*
+ * Restart policy of 'respawn' tasks.
+ *
+ * A run shorter than 'stable' is a failure, and consecutive failures back
+ * off exponentially from 'backoff' up to 'backoff_max' with jitter.  On
+ * top of that restarts take tokens from a bucket of 'limit_burst' refilled
+ * over 'limit_period', and 'quarantine_count' failures within
+ * 'quarantine_window' stop the task for good.  Returns the delay in
+ * milliseconds before the next restart, or -1 to quarantine.
+ */
+static long long
+get_restart_delay (Task      *task,
+                   long long  now)
+{
+  long long delay;
+
+  if (now - task->spawn_time >= task->stable * 1000000LL)
+    task->failures = 0;
+  else
+    {
+      task->failures++;
+
+      if (task->quarantine_count > 0)
+        {
+          if (now - task->window_start > task->quarantine_window * 1000000LL)
+            {
+              task->window_start = now;
+              task->window_failures = 0;
+            }
+          if (++task->window_failures >= task->quarantine_count)
+            return -1;
+        }
+    }
+
+  delay = 0;
+  if (task->failures > 0 && task->backoff > 0)
+    {
+      delay = task->backoff;
+      if (task->failures - 1 < 32)
+        delay <<= task->failures - 1;
+      else
+        delay = task->backoff_max;
+      if (delay > task->backoff_max)
+        delay = task->backoff_max;
+      /* jitter in [delay / 2, delay] so crash loops do not line up. */
+      delay = delay / 2 + rand () % (delay / 2 + 1);
+    }
+
+  if (task->limit_burst > 0 && task->limit_period > 0)
+    {
+      double rate;
+
+      /* tokens per millisecond, a token is taken even if we must wait. */
+      rate = (double) task->limit_burst / task->limit_period;
+      if (!task->tokens_time)
+        task->tokens = task->limit_burst;
+      else
+        {
+          task->tokens += (now - task->tokens_time) / 1000000.0 * rate;
+          if (task->tokens > task->limit_burst)
+            task->tokens = task->limit_burst;
+        }
+      task->tokens_time = now;
+      task->tokens -= 1;
+
+      if (task->tokens < 0 && delay < -task->tokens / rate + 1)
+        delay = -task->tokens / rate + 1;
+    }
+
+  return delay;
+}
+
+static void
+restart_task (Timer *timer)
+{
+  Task *task = timer->data;
+
+  restarting--;
+  if (!running)
+    return;
+
+  if (spawn_task (task))
+    set_task_state (task, TASK_EXITED);
+}
+
+static void
+free_task (Task *task)
+{
+  close_task_cgroup (task);
+  close_task_log (task);
+  close_task_listeners (task);
+  board_remove (task);
+  set_task_held (task, 0);
+  timer_stop (&task->run_timer);
+  unschedule_task (task);
+  unqueue_task (task);
+  cancel_zygote_task (task);
+  release_zygote (task);
+  config_unref (task->config);
+  free (task->deps);
+  slab_free_task (task);
+}
+
+static void
+bury_task (Task *task)
+{
+  if (dead_len == dead_max)
+    {
+      Task **tasks;
+      int    max;
+
+      max = dead_max ? dead_max * 2 : 64;
+      tasks = realloc (dead_tasks, max * sizeof (Task *));
+      if (!tasks)
+        return;
+      dead_tasks = tasks;
+      dead_max = max;
+    }
+
+  dead_tasks[dead_len++] = task;
+}
+
+static void
+free_dead_tasks (void)
+{
+  while (dead_len > 0)
+    free_task (dead_tasks[--dead_len]);
+}
+
+/* a task removed by a reload is gone, let its replacement start. */
+static void
+retire_task (Task *task)
+{
+  Task *n = task->replaced_by;
+
+  if (n)
+    {
+      n->replaces = NULL;
+      if (!task->handoff && !n->released && --n->waiting == 0)
+        push_ready_task (n);
+    }
+
+  bury_task (task);
+}
+
+/* past the grace period, or a second signal. */
+static void
+kill_stopping_task (Task *task)
+{
+  timer_stop (&task->stop_timer);
+  if (!task->stop_time)
+    task->stop_time = now_ns ();
+  if (!task->killed)
+    {
+      task->killed = 1;
+      teardown.killed++;
+    }
+
+  if (task->cgroup)
+    kill_task_cgroup (task, SIGKILL);
+  else
+    signal_task (task, SIGKILL);
+}
+
+static void
+stop_timeout (Timer *timer)
+{
+  Task *task = timer->data;
+
+  MSG ("task '%s' did not stop in %lld ms, killed\n", task->id,
+       (now_ns () - task->stop_time) / 1000000);
+  kill_stopping_task (task);
+}
+
+static void
+signal_stopping_task (Task *task)
+{
+  if (task->stop_time || task->pid <= 0)
+    return;
+
+  if (0) MSG ("kill program[%s] by SIGNAL(%d)\n", task->id, teardown.signo);
+  task->stop_time = now_ns ();
+  if (task->cgroup)
+    kill_task_cgroup (task, teardown.signo);
+  else
+    signal_task (task, teardown.signo);
+
+  timer_start (&task->stop_timer,
+               task->grace >= 0 ? task->grace : teardown.grace,
+               stop_timeout, task);
+}
+
+/* signal the highest live level, once the levels above it are gone. */
+static void
+advance_shutdown (void)
+{
+  int i;
+
+  while (teardown.level >= 0 && !teardown.level_alive[teardown.level])
+    teardown.level--;
+  if (teardown.level < 0)
+    return;
+
+  for (i = startup.level_start[teardown.level];
+       i < startup.level_start[teardown.level + 1];
+       i++)
+    {
+      Task *task = registry.tasks[i];
+
+      if (task->stopping && !task->stop_waiting)
+        signal_stopping_task (task);
+    }
+}
+
+/*
+ * Stop every task, see Shutdown.  The tasks are reaped by the event loop
+ * as usual, and main() returns once none is left.
+ */
+static void
+begin_shutdown (int signo)
+{
+  int n;
+  int i;
+  int j;
+
+  if (!running)
+    {
+      /* a second signal does not wait for the rest. */
+      MSG ("terminated by SIGNAL(%d) again, killing %d tasks\n",
+           signo, live_children);
+      for (i = 0; i < registry.pid_size; i++)
+        if (registry.pid_table[i])
+          kill_stopping_task (registry.pid_table[i]);
+      return;
+    }
+
+  if (1) MSG ("terminated by SIGNAL(%d)\n", signo);
+
+  running = 0;
+  teardown.signo = signo;
+  teardown.start = now_ns ();
+
+  n = registry.task_count;
+  teardown.prereqs = calloc (n + 1, sizeof (Task *));
+  teardown.prereq_start = calloc (n + 2, sizeof (int));
+  teardown.level_alive = calloc (startup.levels + 1, sizeof (int));
+
+  for (i = 0; i < n; i++)
+    {
+      Task *task = registry.tasks[i];
+
+      task->restart = 0;
+      if (timer_pending (&task->restart_timer))
+        {
+          timer_stop (&task->restart_timer);
+          restarting--;
+          set_task_state (task, TASK_EXITED);
+        }
+      timer_stop (&task->run_timer);
+      if (unschedule_task (task) && task->pid <= 0)
+        set_task_state (task, TASK_EXITED);
+      if (unqueue_task (task) || cancel_zygote_task (task))
+        set_task_state (task, TASK_EXITED);
+      task->stopping = task->pid > 0;
+      task->stop_waiting = 0;
+    }
+
+  if (!teardown.prereqs || !teardown.prereq_start || !teardown.level_alive)
+    {
+      /* every task at once then. */
+      MSG ("failed to order the shutdown: %s\n", STRERROR);
+      free (teardown.level_alive);
+      teardown.level_alive = NULL;
+    }
+  else
+    {
+      /* prereqs of the task with seq s at [prereq_start[s], [s + 1]). */
+      for (i = 0; i < n; i++)
+        {
+          Task *task = registry.tasks[i];
+
+          if (task->stopping)
+            teardown.level_alive[task->level]++;
+          for (j = 0; j < task->deps_len; j++)
+            if (task->deps[j].task->stopping)
+              {
+                task->stop_waiting++;
+                teardown.prereq_start[task->deps[j].task->seq + 2]++;
+              }
+        }
+      for (i = 2; i < n + 2; i++)
+        teardown.prereq_start[i] += teardown.prereq_start[i - 1];
+      for (i = 0; i < n; i++)
+        {
+          Task *task = registry.tasks[i];
+
+          for (j = 0; j < task->deps_len; j++)
+            {
+              Task *d = task->deps[j].task;
+
+              if (d->stopping)
+                teardown.prereqs[teardown.prereq_start[d->seq + 1]++] = task;
+            }
+        }
+    }
+
+  /* removed by a reload, already sent SIGTERM, and nothing waits for them. */
+  for (i = 0; i < registry.pid_size; i++)
+    {
+      Task *task = registry.pid_table[i];
+
+      if (!task)
+        continue;
+      task->stopping = 1;
+      if (task->removed || !teardown.level_alive)
+        signal_stopping_task (task);
+    }
+
+  if (teardown.level_alive)
+    {
+      teardown.level = startup.levels - 1;
+      advance_shutdown ();
+    }
+}
+
+/* reaped while shutting down, signal whatever it was holding up. */
+static void
+task_stopped (Task *task)
+{
+  long long elapsed;
+  int       i;
+
+  if (!task->stopping)
+    return;
+  task->stopping = 0;
+  teardown.stopped++;
+  timer_stop (&task->stop_timer);
+
+  if (task->stop_time)
+    {
+      elapsed = now_ns () - task->stop_time;
+      if (show_stats)
+        MSG ("task '%s' stopped in %.1f ms%s\n", task->id, elapsed / 1e6,
+             task->killed ? ", killed" : "");
+      if (teardown.slowest_time < elapsed)
+        {
+          teardown.slowest_time = elapsed;
+          strcpy (teardown.slowest, task->id);
+        }
+    }
+
+  if (task->removed || !teardown.level_alive)
+    return;
+
+  for (i = teardown.prereq_start[task->seq];
+       i < teardown.prereq_start[task->seq + 1];
+       i++)
+    {
+      Task *t = teardown.prereqs[i];
+
+      if (--t->stop_waiting == 0 && t->level == teardown.level)
+        signal_stopping_task (t);
+    }
+
+  if (--teardown.level_alive[task->level] == 0
+      && task->level == teardown.level)
+    advance_shutdown ();
+}
+
+/* 'task' has been reaped, respawn it or mark it exited. */
+static void
+reap_task (Task *task,
+           int   status)
+{
+  long long reaped;
+
+  if (0) MSG ("program[%s] terminated\n", task->id);
+
+  reaped = now_ns ();
+  live_children--;
+  stats.reaps++;
+  timer_stop (&task->run_timer);
+  task->exit_status = status;
+  task->uptime += reaped - task->spawn_time;
+
+  if (task->pidfd < 0)
+    sigchld_children--;
+  watch_close (&task->pid_watch);
+  task->pidfd = -1;
+
+  /* its last message may not have been read yet. */
+  if (task->notify_fd >= 0)
+    read_notify (&task->notify_watch, EPOLLIN);
+  if (task->exit_time)
+    trace_event (TRACE_EXIT, task, 0, task->exit_time);
+  trace_event (TRACE_REAP, task, status, reaped);
+  if (task->exit_time)
+    {
+      long long elapsed;
+
+      elapsed = reaped - task->exit_time;
+      stats.reap_samples++;
+      stats.reap_time += elapsed;
+      if (stats.reap_time_max < elapsed)
+        stats.reap_time_max = elapsed;
+      task->exit_time = 0;
+    }
+  close_notify (task);
+  task_started (task, 1);
+  unspread_task (task);
+  if (!running)
+    task_stopped (task);
+
+  /* a respawn starts in a clean leaf, others are closed below. */
+  if ((task->action == ACTION_RESPAWN || task->restart) && !task->removed
+      && !task->replaces)
+    kill_task_cgroup (task, SIGKILL);
+
+  if (task->removed)
+    {
+      set_task_pid (task, 0);
+      retire_task (task);
+      return;
+    }
+
+  if (task->restart)
+    {
+      task->restart = 0;
+      task->down_time = reaped;
+      if (running && !spawn_task (task))
+        return;
+      task->down_time = 0;
+    }
+  else if (task->held)
+    {
+      set_task_pid (task, 0);
+      set_task_state (task, TASK_STOPPED);
+      close_task_cgroup (task);
+      return;
+    }
+
+  if (running && task->action == ACTION_RESPAWN)
+    {
+      long long delay;
+
+      delay = get_restart_delay (task, reaped);
+      if (delay < 0)
+        {
+          MSG ("task '%s' is crash looping, quarantined\n", task->id);
+          trace_event (TRACE_QUARANTINE, task, 0, 0);
+          stats.quarantines++;
+          set_task_pid (task, 0);
+          set_task_state (task, TASK_QUARANTINED);
+          close_task_cgroup (task);
+          return;
+        }
+      if (delay > 0)
+        {
+          trace_event (TRACE_RESPAWN, task, delay, 0);
+          stats.backoffs++;
+          set_task_pid (task, 0);
+          set_task_state (task, TASK_BACKOFF);
+          restarting++;
+          timer_start (&task->restart_timer, delay, restart_task, task);
+          return;
+        }
+    }
+
+  if (running && task->action == ACTION_RESPAWN)
+    {
+      trace_event (TRACE_RESPAWN, task, 0, 0);
+      task->down_time = reaped;
+    }
+  if (running && task->action == ACTION_RESPAWN && !spawn_task (task))
+    {
+      long long elapsed;
+
+      elapsed = now_ns () - reaped;
+      stats.respawns++;
+      stats.respawn_time += elapsed;
+      if (stats.respawn_time_max < elapsed)
+        stats.respawn_time_max = elapsed;
+      return;
+    }
+
+  task->down_time = 0;
+  set_task_pid (task, 0);
+  if (timer_pending (&task->schedule_timer))
+    set_task_state (task, TASK_SCHEDULED);
+  else
+    set_task_state (task, task->state == TASK_FAILED ? TASK_FAILED
+                                                     : TASK_EXITED);
+  close_task_cgroup (task);
+}
+
+static void
+handle_pidfd (Watch        *watch,
+              unsigned int  events)
+{
+  Task *task = watch->data;
+  pid_t pid;
+  int   status;
+
+  if (task->pidfd != watch->fd || task->pid <= 0)
+    return;
+
+  pid = waitpid (task->pid, &status, WNOHANG);
+  if (pid <= 0)
+    return;
+
+  reap_task (task, status);
+}
+
+/* SIGCHLD fallback for the children without a pidfd. */
+static void
+wait_for_children (void)
+{
+  siginfo_t info;
+  Task     *task;
+  pid_t     pid;
+  int       status;
+  long long batch;
+
+  if (sigchld_children > 0)
+    stats.sigchld_signals++;
+
+  batch = 0;
+  while (sigchld_children > 0)
+    {
+      pid = -1;
+      if (zygote_waiting)
+        {
+          memset (&info, 0x00, sizeof (info));
+          if (waitid (P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT)
+              || info.si_pid <= 0
+              || (!lookup_task_by_pid (info.si_pid)
+                  && held_reap (info.si_pid)))
+            break;
+          pid = info.si_pid;
+        }
+      pid = waitpid (pid, &status, WNOHANG);
+      if (pid <= 0)
+        break;
+
+      task = lookup_task_by_pid (pid);
+      if (!task)
+        {
+          if (!reap_zygote (pid))
+            stats.orphans++;
+          continue;
+        }
+
+      /* SIGCHLD signals are coalesced, so reap until nothing is left. */
+      reap_task (task, status);
+      batch++;
+    }
+
+  stats.sigchld_reaps += batch;
+  if (stats.sigchld_batch_max < batch)
+    stats.sigchld_batch_max = batch;
+}
+
+/*
+ * As the subreaper, whatever the tasks leave behind is reparented to
+ * procman.  Peek at the exited children, and reap those which are no
+ * task until one is, that one goes through its pidfd.
+ */
+static void
+reap_orphans (void)
+{
+  siginfo_t info;
+
+  for (;;)
+    {
+      memset (&info, 0x00, sizeof (info));
+      if (waitid (P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT)
+          || info.si_pid <= 0 || lookup_task_by_pid (info.si_pid)
+          || held_reap (info.si_pid))
+        break;
+
+      waitpid (info.si_pid, NULL, WNOHANG);
+      if (!reap_zygote (info.si_pid))
+        stats.orphans++;
+    }
+}
+
+static int
+task_changed (Task *o,
+              Task *n)
+{
+  int i;
+
+  for (i = 0; o->argv[i] && n->argv[i]; i++)
+    if (strcmp (o->argv[i], n->argv[i]))
+      return 1;
+  if (o->argv[i] != n->argv[i])
+    return 1;
+
+  /* placement is only applied at spawn. */
+  for (i = 0; i < PLACE_COUNT; i++)
+    if ((o->places[i] || n->places[i])
+        && (!o->places[i] || !n->places[i]
+            || strcmp (o->places[i], n->places[i])))
+      return 1;
+
+  return ((o->listen || n->listen)
+          && (!o->listen || !n->listen || strcmp (o->listen, n->listen)))
+    || o->action != n->action
+    || o->ready != n->ready
+    || o->piped != n->piped
+    || strcmp (o->pipe_id, n->pipe_id)
+    || o->consumers != n->consumers
+    || o->pipe_size != n->pipe_size
+    || ((o->input || n->input)
+        && (!o->input || !n->input || strcmp (o->input, n->input)));
+}
+
+/* stop a task removed or changed by a reload. */
+static void
+stop_task (Task *task)
+{
+  task->removed = 1;
+
+  timer_stop (&task->ready_timer);
+  unschedule_task (task);
+  unqueue_task (task);
+  if (timer_pending (&task->restart_timer))
+    {
+      timer_stop (&task->restart_timer);
+      restarting--;
+    }
+  if (task->relay)
+    close_relay (task->relay);
+  if (task->input_edge)
+    close_edge (task->input_edge);
+  close_notify (task);
+  if (cancel_zygote_task (task) && !task->released)
+    {
+      startup.starting--;
+      release_task (task);
+    }
+
+  if (task->pid > 0)
+    signal_task (task, SIGTERM);
+  else
+    retire_task (task);
+}
+
+/* take over the config of 'n' into the running 'o'. */
+static void
+keep_task (Task *o,
+           Task *n)
+{
+  int leaf;
+  int i;
+
+  o->seq = n->seq;
+  o->order = n->order;
+  o->ready_timeout = n->ready_timeout;
+  o->backoff = n->backoff;
+  o->backoff_max = n->backoff_max;
+  o->stable = n->stable;
+  o->limit_burst = n->limit_burst;
+  o->limit_period = n->limit_period;
+  o->quarantine_count = n->quarantine_count;
+  o->quarantine_window = n->quarantine_window;
+  o->grace = n->grace;
+  o->overlap = n->overlap;
+  o->zygote = n->zygote;
+  o->replicas = n->replicas;
+  o->overrun = n->overrun;
+  o->timeout = n->timeout;
+  if (o->priority != n->priority)
+    {
+      o->priority = n->priority;
+      if (o->admit_index)
+        {
+          admit_sift_up (o->admit_index - 1);
+          admit_sift_down (o->admit_index - 1);
+        }
+    }
+
+  /* a new schedule counts from now. */
+  if (o->every != n->every
+      || memcmp (&o->calendar, &n->calendar, sizeof (o->calendar)))
+    {
+      o->every = n->every;
+      o->calendar = n->calendar;
+      o->next_run = 0;
+      if (unschedule_task (o) && schedule_task (o))
+        set_task_state (o, TASK_FAILED);
+    }
+
+  /* limits apply to the running task right away. */
+  leaf = o->cgroup ? open_task_cgroup (o) : -1;
+  for (i = 0; i < LIMIT_COUNT; i++)
+    {
+      if (leaf >= 0
+          && (o->limits[i] || n->limits[i])
+          && (!o->limits[i] || !n->limits[i]
+              || strcmp (o->limits[i], n->limits[i])))
+        set_cgroup_limit (o, leaf, i, n->limits[i] ? n->limits[i]
+                                                   : cgroup_limits[i].reset);
+      o->limits[i] = n->limits[i];
+    }
+  if (leaf >= 0)
+    close (leaf);
+  memcpy (o->places, n->places, sizeof (o->places));
+
+  /* move over to the new config, so the old one can be unmapped. */
+  o->argv = n->argv;
+  o->path = n->path;
+  o->after = n->after;
+  o->requires = n->requires;
+  o->input = n->input;
+  o->listen = n->listen;
+  config_unref (o->config);
+  o->config = config_ref (n->config);
+}
+
+/*
+ * Re-read the config file on SIGHUP and diff it against the running
+ * tasks by id.  Unchanged tasks keep their Task, pid and pipes; removed
+ * ones are stopped, new ones started, and a changed one is stopped and
+ * started again once its old instance has exited (or with overlap=yes,
+ * started first, see finish_handoff()).  Tasks connected by pipes are
+ * only kept together.  With 'rescale' the tasks come from the loaded
+ * config instead, for 'scale', see expand_config().  0 or -1, with the
+ * running tasks left alone.
+ */
+static int
+reload_config (int rescale)
+{
+  Registry   old;
+  Task     **match;
+  long long  start;
+  int        started;
+  int        stopped;
+  int        changed;
+  int        i;
+
+  start = now_ns ();
+
+  old = registry;
+  registry.tasks = NULL;
+  registry.task_count = 0;
+  registry.task_max = 0;
+  registry.id_table = NULL;
+  registry.id_size = 0;
+
+  if (rescale ? expand_config (&old) : read_config (config_file))
+    {
+      if (!rescale)
+        MSG ("failed to reload config file '%s': %s\n",
+             config_file, STRERROR);
+      for (i = 0; i < registry.task_count; i++)
+        free_task (registry.tasks[i]);
+      free (registry.tasks);
+      free (registry.id_table);
+      registry.tasks = old.tasks;
+      registry.task_count = old.task_count;
+      registry.task_max = old.task_max;
+      registry.id_table = old.id_table;
+      registry.id_size = old.id_size;
+      return -1;
+    }
+
+  /* by 'seq' of the new tasks. */
+  match = calloc (registry.task_count + 1, sizeof (Task *));
+  if (!match)
+    MSG ("failed to allocate reload table: %s\n", STRERROR);
+
+  for (i = 0; i < old.task_count; i++)
+    old.tasks[i]->removed = 1;
+
+  for (i = 0; match && i < registry.task_count; i++)
+    {
+      Task  *n = registry.tasks[i];
+      Task **slot;
+
+      slot = registry_lookup (&old, n->id);
+      if (slot && !task_changed (*slot, n))
+        match[n->seq] = *slot;
+    }
+
+  do
+    {
+      changed = 0;
+      for (i = 0; match && i < registry.task_count; i++)
+        {
+          Task *n = registry.tasks[i];
+          Task *peer[2];
+          int   j;
+
+          peer[0] = n->piped && n->pipe_id[0] ? lookup_task (n->pipe_id) : NULL;
+          peer[1] = n->input ? lookup_task (n->input) : NULL;
+          for (j = 0; j < 2; j++)
+            if (peer[j] && !match[n->seq] != !match[peer[j]->seq])
+              {
+                match[n->seq] = NULL;
+                match[peer[j]->seq] = NULL;
+                changed = 1;
+              }
+        }
+    }
+  while (changed);
+
+  started = 0;
+  for (i = 0; i < registry.task_count; i++)
+    {
+      Task  *n = registry.tasks[i];
+      Task  *o;
+      Task **slot;
+
+      o = match ? match[n->seq] : NULL;
+      if (!o)
         {
-          MSG ("invalid action '%s' in line %d, ignored\n", s, line_nr);
+          slot = registry_lookup (&old, n->id);
+          if (slot && (*slot)->pid > 0)
+            {
+              n->replaces = *slot;
+              (*slot)->replaced_by = n;
+              /* overlap=yes starts 'n' right away, in the same leaf. */
+              if (n->overlap && !n->piped && !n->input
+                  && !(*slot)->relay && !(*slot)->input_edge)
+                {
+                  (*slot)->handoff = 1;
+                  (*slot)->cgroup = 0;
+                }
+            }
+          if (slot)
+            take_listeners (n, *slot);
+          started++;
           continue;
         }
 
-      /* order */  //txt에 있는 order를 task구조체의 order에 넣기 위한 부분
-      s = p + 1;
-      p = strchr (s, ':');
-      if (!p){
-        MSG("order part");
-        goto invalid_line;
+      o->removed = 0;
+      keep_task (o, n);
+      registry.tasks[i] = o;
+      *registry_lookup (&registry, n->id) = o;
+      free_task (n);
+    }
+
+  stopped = 0;
+  for (i = 0; i < old.task_count; i++)
+    if (old.tasks[i]->removed)
+      {
+        /* or once its replacement is up, see finish_handoff(). */
+        if (!old.tasks[i]->handoff)
+          stop_task (old.tasks[i]);
+        stopped++;
       }
-      *p = '\0';
-      strstrip (s);
-      if(s == NULL) // order가 공백이라면 4자리 랜덤 숫자를 삽입하여 임의의 순서에 시작될 수 있도록 한다.
-          task.order = rand()%10000;
-      else{          // char*인 s를 atoi를 이용하여 int형으로 변형하고 order에 넣는다.
-          if(atoi(s)/10000 == 0)
-              task.order = atoi(s);
-          else
-              MSG ("invalid order '%d' in line %d, ignored\n", atoi(s), line_nr);
+
+  free (old.tasks);
+  free (old.id_table);
+
+  if (prepare_startup ())
+    MSG ("failed to prepare startup: %s\n", STRERROR);
+  else
+    for (i = 0; match && i < registry.task_count; i++)
+      {
+        Task *task = registry.tasks[i];
+
+        if (match[task->seq] == task)
+          release_task (task);
       }
+  free (match);
 
-      /* pipe-id */
-      s = p + 1;
-      p = strchr (s, ':');
-      if (!p){
-        MSG("pipe-id part");
-        goto invalid_line;
+  trace_event (TRACE_RELOAD, NULL, now_ns () - start, start);
+  MSG ("reloaded '%s' in %.1f ms: %d started, %d stopped, %d unchanged\n",
+       config_file, (now_ns () - start) / 1e6,
+       started, stopped, registry.task_count - started);
+  return 0;
+}
+
+static const char *task_states[] =
+{
+  "waiting", "starting", "running", "exited", "failed", "backoff",
+  "quarantined", "stopped", "scheduled", "deferred",
+};
+
+/* "TERM", "SIGTERM" or "15". */
+static int
+parse_signal (const char *str)
+{
+  char *end;
+  long  signo;
+  int   i;
+
+  signo = strtol (str, &end, 10);
+  if (end != str && *end == '\0')
+    return signo > 0 && signo < NSIG ? signo : -1;
+
+  if (!strncasecmp (str, "SIG", 3))
+    str += 3;
+  for (i = 1; i < NSIG; i++)
+    {
+      const char *name = sigabbrev_np (i);
+
+      if (name && !strcasecmp (name, str))
+        return i;
+    }
+
+  return -1;
+}
+
+static void
+client_printf (Client     *client,
+               const char *format,
+               ...)
+{
+  va_list args;
+  int     len;
+
+  for (;;)
+    {
+      va_start (args, format);
+      len = vsnprintf (client->out + client->out_len,
+                       client->out_max - client->out_len, format, args);
+      va_end (args);
+      if (len < 0)
+        return;
+      if (client->out_len + len < client->out_max)
+        break;
+
+      {
+        char   *out;
+        size_t  max;
+
+        max = client->out_max ? client->out_max * 2 : 4096;
+        while (max <= client->out_len + len)
+          max *= 2;
+        out = realloc (client->out, max);
+        if (!out)
+          return;
+        client->out = out;
+        client->out_max = max;
       }
-      *p = '\0';
-      strstrip (s);
-      if (s[0] != '\0')
+    }
+  client->out_len += len;
+}
+
+static int
+control_start (Client *client,
+               Task   *task,
+               int     signo)
+{
+  set_task_held (task, 0);
+
+  /* running, or still up to the startup engine. */
+  if (task->pid > 0 || timer_pending (&task->zygote_timer) || !task->released)
+    return 0;
+
+  if (timer_pending (&task->restart_timer))
+    {
+      timer_stop (&task->restart_timer);
+      restarting--;
+    }
+  task->failures = 0;
+  task->window_failures = 0;
+
+  if (task->action == ACTION_INTERVAL || task->action == ACTION_CALENDAR)
+    {
+      if (timer_pending (&task->schedule_timer))
+        return 0;
+      task->next_run = 0;
+      set_task_state (task, schedule_task (task) ? TASK_FAILED
+                                                 : TASK_SCHEDULED);
+      return task->state == TASK_SCHEDULED;
+    }
+
+  if (spawn_task (task))
+    {
+      set_task_state (task, TASK_FAILED);
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+control_stop (Client *client,
+              Task   *task,
+              int     signo)
+{
+  task->restart = 0;
+  if (task->held)
+    return 0;
+  set_task_held (task, 1);
+
+  if (timer_pending (&task->restart_timer))
+    {
+      timer_stop (&task->restart_timer);
+      restarting--;
+      set_task_state (task, TASK_STOPPED);
+      return 1;
+    }
+  if (unschedule_task (task) && task->pid <= 0)
+    {
+      set_task_state (task, TASK_STOPPED);
+      return 1;
+    }
+  if (unqueue_task (task))
+    {
+      set_task_state (task, TASK_STOPPED);
+      release_task (task);
+      return 1;
+    }
+  if (cancel_zygote_task (task))
+    {
+      set_task_state (task, TASK_STOPPED);
+      if (!task->released)
         {
-          Task *t;
+          startup.starting--;
+          release_task (task);
+        }
+      return 1;
+    }
+  if (task->pid > 0)
+    {
+      signal_task (task, SIGTERM);
+      return 1;
+    }
 
-          if (check_valid_id (s))
+  /* start_tasks() skips it. */
+  return !task->released;
+}
+
+/*
+ * For overlap=yes, move the running instance of 'task' to a removed copy,
+ * which is stopped once the next instance is up.  It shares the sockets
+ * and the leaf of 'task', and its output still goes to the same log.
+ */
+static Task *
+detach_task (Task *task)
+{
+  struct epoll_event ev;
+  Task              *o;
+
+  if (task->pid <= 0 || task->state != TASK_RUNNING || task->replaces
+      || task->piped || task->relay || task->input_edge)
+    return NULL;
+
+  o = slab_alloc_task ();
+  if (!o)
+    return NULL;
+  *o = *task;
+  config_ref (o->config);
+  o->deps = NULL;
+  o->deps_len = 0;
+  o->deps_max = 0;
+  o->log = NULL;
+  o->log_fd = -1;
+  o->log_watch.fd = -1;
+  o->listen_count = 0;
+  o->board = -1;
+  o->cgroup = 0;
+  o->held = 0;
+  o->restart = 0;
+  o->removed = 1;
+  o->handoff = 1;
+  o->replaces = NULL;
+  o->replaced_by = task;
+  o->zygote_class = NULL;
+  memset (&o->schedule_timer, 0x00, sizeof (o->schedule_timer));
+  memset (&o->run_timer, 0x00, sizeof (o->run_timer));
+  timer_stop (&task->run_timer);
+
+  /* its pidfd and pid now belong to the copy. */
+  if (o->pidfd >= 0)
+    {
+      memset (&ev, 0x00, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = &o->pid_watch;
+      o->pid_watch.data = o;
+      epoll_ctl (epoll_fd, EPOLL_CTL_MOD, o->pidfd, &ev);
+    }
+  task->pidfd = -1;
+  task->pid_watch.fd = -1;
+  set_task_pid (task, 0);
+  set_task_pid (o, o->pid);
+
+  task->uptime += now_ns () - task->spawn_time;
+  task->cpu = -1;
+  task->replaces = o;
+
+  return o;
+}
+
+static int
+control_restart (Client *client,
+                 Task   *task,
+                 int     signo)
+{
+  if (task->pid <= 0)
+    return control_start (client, task, signo);
+
+  set_task_held (task, 0);
+  if (task->overlap && detach_task (task))
+    {
+      if (spawn_task (task))
+        set_task_state (task, TASK_FAILED);
+      return 1;
+    }
+  if (!task->restart)
+    {
+      task->restart = 1;
+      signal_task (task, SIGTERM);
+    }
+
+  return 1;
+}
+
+static int
+control_signal (Client *client,
+                Task   *task,
+                int     signo)
+{
+  if (task->pid <= 0)
+    return 0;
+
+  signal_task (task, signo);
+
+  return 1;
+}
+
+static int
+control_status (Client *client,
+                Task   *task,
+                int     signo)
+{
+  client_printf (client, "%s %d %s %d\n", task->id, (int) task->pid,
+                 task_states[task->state], task->restarts);
+
+  return 1;
+}
+
+typedef struct _Command Command;
+struct _Command
+{
+  const char *name;
+  int       (*func) (Client *client, Task *task, int signo);
+  int         signal;           /* takes a signal first */
+  int         all;              /* no pattern means every task */
+};
+
+/*
+ * "scale id count" sets the replicas of entry 'id' and applies it like a
+ * reload, so the new replicas start and the extra ones stop in parallel.
+ */
+static void
+control_scale (Client  *client,
+               char   **save)
+{
+  Scale *scale;
+  char  *id;
+  char  *str;
+  char  *end;
+  char   first[TASK_ID_MAX + 1];
+  long   count;
+  int    config;
+  int    previous;
+
+  id = strtok_r (NULL, " \t\r", save);
+  str = strtok_r (NULL, " \t\r", save);
+  count = str ? strtol (str, &end, 10) : -1;
+  if (!id || check_valid_id (id) || !str || end == str || *end
+      || count < 0 || count > REPLICAS_MAX)
+    {
+      client_printf (client, "error usage: scale id count\n");
+      return;
+    }
+
+  scale = lookup_scale (id, strlen (id));
+  snprintf (first, sizeof (first), "%s.0", id);
+  if (!scale && !lookup_task (first))
+    {
+      client_printf (client, "error no replicas of '%s'\n", id);
+      return;
+    }
+  config = scale ? scale->config : lookup_task (first)->replicas;
+
+  if (!scale)
+    {
+      if (scales_len == scales_max)
+        {
+          Scale *tmp;
+          int    max;
+
+          max = scales_max ? scales_max * 2 : 8;
+          tmp = realloc (scales, max * sizeof (Scale));
+          if (!tmp)
             {
-              MSG ("invalid pipe-id '%s' in line %d, ignored\n", s, line_nr);
-              continue;
+              client_printf (client, "error %s\n", STRERROR);
+              return;
             }
+          scales = tmp;
+          scales_max = max;
+        }
+      scale = &scales[scales_len];
+      strcpy (scale->id, id);
+      copy_entry (&scale->entry, lookup_task (first));
+      config_ref (scale->entry.config);
+      scale->count = -1;
+      scales_len++;
+    }
+  previous = scale->count;
+  scale->count = count;
+  scale->config = config;
 
-          t = lookup_task (s);
-          if (!t)
+  if (reload_config (1))
+    {
+      /* a new Scale is dropped by apply_scales() at the next reload. */
+      scale = lookup_scale (id, strlen (id));
+      if (scale)
+        scale->count = previous;
+      client_printf (client, "error failed to scale '%s'\n", id);
+      return;
+    }
+  client_printf (client, "ok %ld\n", count);
+}
+
+static const Command commands[] =
+{
+  { "start",   control_start,   0, 0 },
+  { "stop",    control_stop,    0, 0 },
+  { "restart", control_restart, 0, 0 },
+  { "signal",  control_signal,  1, 0 },
+  { "status",  control_status,  0, 1 },
+};
+
+/* SIGUSR2 or 'upgrade', run by the main loop, see upgrade(). */
+static int           upgrade_requested;
+static const char   *upgrade_blocked (void);
+
+/*
+ * Run one request, "command [signal] pattern...", where a pattern is a
+ * task id or a glob of ids.  Its output is followed by "ok <count>" with
+ * the number of tasks acted on, or "error <reason>".  A pattern matching
+ * no task is an error, but does not hold up the others.
+ */
+static void
+run_command (Client *client,
+             char   *line)
+{
+  const Command *command;
+  const char    *missing;
+  char          *pattern;
+  char          *save;
+  char          *name;
+  int            signo;
+  int            count;
+  int            i;
+
+  name = strtok_r (line, " \t\r", &save);
+  if (!name)
+    return;
+
+  /* answered before the exec, which closes this client. */
+  if (!strcmp (name, "upgrade"))
+    {
+      const char *reason = upgrade_blocked ();
+
+      if (reason)
+        client_printf (client, "error %s\n", reason);
+      else
+        {
+          client_printf (client, "ok %d\n", registry.task_count);
+          upgrade_requested = 1;
+        }
+      return;
+    }
+
+  /* names an entry of the config, not tasks. */
+  if (!strcmp (name, "scale"))
+    {
+      if (!running)
+        client_printf (client, "error shutting down\n");
+      else
+        control_scale (client, &save);
+      return;
+    }
+
+  command = NULL;
+  for (i = 0; i < sizeof (commands) / sizeof (commands[0]); i++)
+    if (!strcmp (commands[i].name, name))
+      command = &commands[i];
+  if (!command)
+    {
+      client_printf (client, "error unknown command '%s'\n", name);
+      return;
+    }
+  if (!running && command->func != control_status)
+    {
+      client_printf (client, "error shutting down\n");
+      return;
+    }
+
+  signo = 0;
+  if (command->signal)
+    {
+      name = strtok_r (NULL, " \t\r", &save);
+      signo = name ? parse_signal (name) : -1;
+      if (signo < 0)
+        {
+          client_printf (client, "error invalid signal '%s'\n",
+                         name ? name : "");
+          return;
+        }
+    }
+
+  pattern = strtok_r (NULL, " \t\r", &save);
+  if (!pattern && !command->all)
+    {
+      client_printf (client, "error no task given\n");
+      return;
+    }
+  if (!pattern)
+    pattern = "*";
+
+  count = 0;
+  missing = NULL;
+  for (; pattern; pattern = strtok_r (NULL, " \t\r", &save))
+    {
+      int matched = 0;
+
+      /* plain ids go through the hash table. */
+      if (!strpbrk (pattern, "*?["))
+        {
+          Task **slot;
+
+          slot = registry_lookup (&registry, pattern);
+          if (slot)
             {
-              MSG ("unknown pipe-id '%s' in line %d, ignored\n", s, line_nr);
-              continue;
+              count += command->func (client, *slot, signo);
+              matched = 1;
             }
-          if (task.action == ACTION_RESPAWN || t->action == ACTION_RESPAWN)
+        }
+      else
+        for (i = 0; i < registry.task_count; i++)
+          if (!fnmatch (pattern, registry.tasks[i]->id, 0))
             {
-              MSG ("pipe not allowed for 'respawn' tasks in line %d, ignored\n", line_nr);
-              continue;
+              count += command->func (client, registry.tasks[i], signo);
+              matched = 1;
             }
-          if (t->piped)
+
+      if (!matched && !missing)
+        missing = pattern;
+    }
+
+  if (missing)
+    client_printf (client, "error no task '%s'\n", missing);
+  else
+    client_printf (client, "ok %d\n", count);
+}
+
+static void
+close_client (Client *client)
+{
+  watch_close (&client->watch);
+  free (client->in);
+  free (client->out);
+  free (client);
+  clients--;
+}
+
+/*
+ * Requests are run as soon as their line is complete, and answered in
+ * order.  A client sends EOF once done, and is closed after the last
+ * answer went out.
+ */
+static void
+handle_client (Watch        *watch,
+               unsigned int  events)
+{
+  Client *client = watch->data;
+  char   *line;
+  char   *end;
+  ssize_t len;
+
+  while (!client->eof)
+    {
+      if (client->in_max - client->in_len < 4096)
+        {
+          char   *in;
+          size_t  max;
+
+          max = client->in_max ? client->in_max * 2 : 8192;
+          in = realloc (client->in, max);
+          if (!in)
             {
-              MSG ("pipe not allowed for already piped tasks in line %d, ignored\n", line_nr);
-              continue;
+              close_client (client);
+              return;
             }
+          client->in = in;
+          client->in_max = max;
+        }
+
+      len = read (watch->fd, client->in + client->in_len,
+                  client->in_max - client->in_len);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 && errno == EAGAIN)
+        break;
+      if (len < 0)
+        {
+          close_client (client);
+          return;
+        }
+      if (len == 0)
+        {
+          client->eof = 1;
+          break;
+        }
+
+      client->in_len += len;
+      line = client->in;
+      while ((end = memchr (line, '\n', client->in + client->in_len - line)))
+        {
+          *end = '\0';
+          run_command (client, line);
+          line = end + 1;
+        }
+      client->in_len -= line - client->in;
+      memmove (client->in, line, client->in_len);
+    }
+
+  /* the last request may come without its newline. */
+  if (client->eof && client->in_len > 0)
+    {
+      client->in[client->in_len] = '\0';
+      client->in_len = 0;
+      run_command (client, client->in);
+    }
+
+  while (client->out_pos < client->out_len)
+    {
+      len = write (watch->fd, client->out + client->out_pos,
+                   client->out_len - client->out_pos);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 && errno == EAGAIN)
+        return;
+      if (len < 0)
+        {
+          close_client (client);
+          return;
+        }
+      client->out_pos += len;
+    }
+  client->out_pos = client->out_len = 0;
+
+  if (client->eof)
+    close_client (client);
+}
+
+static void
+handle_control (Watch        *watch,
+                unsigned int  events)
+{
+  Client *client;
+  int     fd;
 
-          strcpy (task.pipe_id, s);
-          task.piped = 1;
-          t->piped = 1;
+  for (;;)
+    {
+      fd = accept4 (watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN)
+            MSG ("failed to accept control client: %s\n", STRERROR);
+          return;
         }
 
-      /* command */
-      s = p + 1;
-      strstrip (s);
-      if (s[0] == '\0')
+      client = calloc (1, sizeof (Client));
+      if (!client)
+        {
+          close (fd);
+          continue;
+        }
+      if (watch_add (&client->watch, fd, EPOLLIN | EPOLLOUT | EPOLLET,
+                     handle_client, client))
         {
-          MSG ("empty command in line %d, ignored\n", line_nr);
+          close (fd);
+          free (client);
           continue;
         }
-      strncpy (task.command, s, sizeof (task.command) - 1);
-      task.command[sizeof (task.command) - 1] = '\0';
+      clients++;
+    }
+}
 
-      if (0)
-        MSG ("id:%s pipe-id:%s action:%d command:%s\n",
-             task.id, task.pipe_id, task.action, task.command);
+static void
+setup_control (void)
+{
+  struct sockaddr_un addr;
 
-      append_task (&task);
-      continue;
+  if (!control_file)
+    {
+      snprintf (control_path, sizeof (control_path), "/tmp/procman.%d.sock",
+                (int) getpid ());
+      control_file = control_path;
+    }
 
-    invalid_line:
-      MSG ("invalid format in line %d, ignored\n", line_nr);
+  /* bound by the image before the upgrade, clients never notice. */
+  if (control_fd >= 0)
+    {
+      set_cloexec (control_fd, 1);
+      if (watch_add (&control_watch, control_fd, EPOLLIN, handle_control,
+                     NULL))
+        {
+          close (control_fd);
+          control_fd = -1;
+        }
+      return;
     }
 
-  fclose (fp);
+  memset (&addr, 0x00, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (control_file) >= sizeof (addr.sun_path))
+    {
+      MSG ("no control socket, '%s' is too long\n", control_file);
+      return;
+    }
+  strcpy (addr.sun_path, control_file);
 
-  return 0;
+  control_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (control_fd < 0)
+    {
+      MSG ("no control socket: %s\n", STRERROR);
+      return;
+    }
+
+  unlink (control_file);
+  if (bind (control_fd, (struct sockaddr *) &addr, sizeof (addr))
+      || listen (control_fd, 128))
+    {
+      MSG ("no control socket, failed to bind '%s': %s\n",
+           control_file, STRERROR);
+      close (control_fd);
+      control_fd = -1;
+      return;
+    }
+
+  if (watch_add (&control_watch, control_fd, EPOLLIN, handle_control, NULL))
+    {
+      close (control_fd);
+      control_fd = -1;
+      unlink (control_file);
+    }
 }
 
-static char **
-make_command_argv (const char *str)
+static void
+close_control (void)
 {
-  char      **argv;
-  const char *p;
-  int         n;
+  if (control_fd < 0)
+    return;
+
+  watch_close (&control_watch);
+  control_fd = -1;
+  unlink (control_file);
+}
+
+/*
+ * Live upgrade.
+ *
+ * On SIGUSR2 or 'upgrade' from the control socket, procman writes its
+ * tasks to a memfd and execs its binary again with '-U <memfd>'.  The pid
+ * stays, so the children stay its children and keep running; their
+ * pidfds, notify and output pipes, relays and sockets, and the control
+ * socket and cgroup, go through the exec, and the new image adopts them
+ * by id once it has read the config, see adopt_task().  The layout is the
+ * header, Scale[scale_count], then UpgradeTask[task_count].
+ */
+#define UPGRADE_MAGIC   0x47505550
+#define UPGRADE_VERSION 3
+
+typedef struct _UpgradeHeader UpgradeHeader;
+struct _UpgradeHeader
+{
+  unsigned int       magic;
+  unsigned int       version;
+  unsigned int       task_size;
+  unsigned int       task_count;
+  unsigned int       scale_size;
+  unsigned int       scale_count;
+  unsigned int       stats_size;
+  int                control_fd;
+  int                cgroup_fd;
+  long long          start;     /* of the upgrade */
+  long long          trace_written;
+  char               cgroup_path[PATH_MAX];
+  Stats              stats;
+};
+
+typedef struct _UpgradeTask UpgradeTask;
+struct _UpgradeTask
+{
+  char               id[TASK_ID_MAX + 1];
+  int                pid;
+  int                pidfd;
+  int                notify_fd;
+  int                pipe_a[2];
+  int                pipe_b[2];
+  int                log_fds[2];        /* read and write end */
+  int                relay_fd;
+  int                relay_hup;
+  int                edge_fd;
+  int                edge_closed;
+  int                edge_ahead;
+  int                listen_fds[LISTEN_MAX];
+  int                listen_count;
+  int                state;
+  int                released;
+  int                held;
+  int                restart;
+  int                restarts;
+  int                exit_status;
+  int                cgroup;
+  int                cpu;
+  int                failures;
+  int                window_failures;
+  double             tokens;
+  long long          tokens_time;
+  long long          window_start;
+  long long          spawn_time;
+  long long          spawn_realtime;
+  long long          exit_time;
+  long long          uptime;
+  long long          ready_left;        /* ns until the timer, or -1 */
+  long long          restart_left;
+  long long          schedule_left;
+  long long          run_left;
+  int                run_kill;          /* run_left is the grace period */
+  long long          next_run;
+  long long          queued_time;
+  long long          queue_delay;
+  long long          edge_bytes;
+  long long          edge_first;
+  long long          edge_last;
+};
+
+static char          exe_path[PATH_MAX];
+static int           main_argc;
+static char        **main_argv;
+
+/* -U, read by read_upgrade() before the config and adopted after it. */
+static int           upgrade_fd = -1;
+static UpgradeTask  *upgrade_tasks;
+static int           upgrade_count;
+static long long     upgrade_start;
+
+/* why procman can not upgrade right now, or NULL. */
+static const char *
+upgrade_blocked (void)
+{
+  int i;
+
+  if (!running)
+    return "shutting down";
+  if (!exe_path[0])
+    return "no binary to exec";
+
+  /* an instance on its way out has no id to be adopted by. */
+  for (i = 0; i < registry.pid_size; i++)
+    if (registry.pid_table[i] && registry.pid_table[i]->removed)
+      return "tasks are being replaced";
+  for (i = 0; i < registry.task_count; i++)
+    if (registry.tasks[i]->replaces)
+      return "tasks are being replaced";
+  if (zygote_waiting > 0)
+    return "tasks are waiting for a zygote";
+
+  return NULL;
+}
 
-  for (n = 0, p = str; p != NULL; n++)
+static long long
+timer_left (Timer     *timer,
+            long long  now)
+{
+  if (!timer_pending (timer))
+    return -1;
+
+  return timer->expire > now ? timer->expire - now : 0;
+}
+
+static void
+save_task (Task        *task,
+           UpgradeTask *r,
+           long long    now)
+{
+  memset (r, 0x00, sizeof (*r));
+  strcpy (r->id, task->id);
+  r->pid = task->pid;
+  r->pidfd = task->pidfd;
+  r->notify_fd = task->notify_fd;
+  memcpy (r->pipe_a, task->pipe_a, sizeof (r->pipe_a));
+  memcpy (r->pipe_b, task->pipe_b, sizeof (r->pipe_b));
+  r->log_fds[0] = task->log ? task->log_watch.fd : -1;
+  r->log_fds[1] = task->log ? task->log_fd : -1;
+  r->relay_fd = task->relay ? task->relay->fd : -1;
+  r->relay_hup = task->relay ? task->relay->hup : 0;
+  r->edge_fd = task->input_edge ? task->input_edge->fd : -1;
+  if (task->input_edge)
     {
-      char *s;
+      r->edge_closed = task->input_edge->closed;
+      r->edge_ahead = task->input_edge->ahead;
+      r->edge_bytes = task->input_edge->bytes;
+      r->edge_first = task->input_edge->first;
+      r->edge_last = task->input_edge->last;
+    }
+  memcpy (r->listen_fds, task->listen_fds, sizeof (r->listen_fds));
+  r->listen_count = task->listen_count;
+  r->state = task->state;
+  r->released = task->released;
+  r->held = task->held;
+  r->restart = task->restart;
+  r->restarts = task->restarts;
+  r->exit_status = task->exit_status;
+  r->cgroup = task->cgroup;
+  r->cpu = task->cpu;
+  r->failures = task->failures;
+  r->window_failures = task->window_failures;
+  r->tokens = task->tokens;
+  r->tokens_time = task->tokens_time;
+  r->window_start = task->window_start;
+  r->spawn_time = task->spawn_time;
+  r->spawn_realtime = task->spawn_realtime;
+  r->exit_time = task->exit_time;
+  r->uptime = task->uptime;
+  r->ready_left = timer_left (&task->ready_timer, now);
+  r->restart_left = timer_left (&task->restart_timer, now);
+  r->schedule_left = timer_left (&task->schedule_timer, now);
+  r->run_left = timer_left (&task->run_timer, now);
+  r->run_kill = task->run_timer.func == kill_run;
+  r->next_run = task->next_run;
+  r->queued_time = task->queued_time;
+  r->queue_delay = task->queue_delay;
+}
 
-      s = strchr (p, ' ');
-      if (!s)
-        break;
-      p = s + 1;
+/* the fds of 'records' which go through the exec. */
+static void
+set_upgrade_cloexec (UpgradeTask *records,
+                     int          count,
+                     int          on)
+{
+  int i;
+  int j;
+
+  set_cloexec (control_fd, on);
+  set_cloexec (cgroup_fd, on);
+  for (i = 0; i < count; i++)
+    {
+      UpgradeTask *r = &records[i];
+
+      set_cloexec (r->pidfd, on);
+      set_cloexec (r->notify_fd, on);
+      set_cloexec (r->log_fds[0], on);
+      set_cloexec (r->log_fds[1], on);
+      set_cloexec (r->relay_fd, on);
+      set_cloexec (r->edge_fd, on);
+      for (j = 0; j < r->listen_count; j++)
+        set_cloexec (r->listen_fds[j], on);
     }
-  n++;
+}
+
+/*
+ * Exec the binary procman was started from, which may have been replaced
+ * meanwhile, with the state of every task.  Returns only if that failed,
+ * and then carries on as before.
+ */
+static void
+upgrade (void)
+{
+  UpgradeHeader  header;
+  UpgradeTask   *records;
+  const char    *reason;
+  char         **argv;
+  char           arg[16];
+  long long      now;
+  int            fd;
+  int            n;
+  int            i;
+  int            j;
 
-  argv = calloc (sizeof (char *), n + 1);
-  if (!argv)
+  upgrade_requested = 0;
+  reason = upgrade_blocked ();
+  if (reason)
     {
-      MSG ("failed to allocate a command vector: %s\n", STRERROR);
-      return NULL;
+      MSG ("no upgrade, %s\n", reason);
+      return;
     }
 
-  for (n = 0, p = str; p != NULL; n++)
+  n = registry.task_count;
+  records = calloc (n + 1, sizeof (UpgradeTask));
+  argv = calloc (main_argc + 3, sizeof (char *));
+  fd = memfd_create ("procman-upgrade", 0);
+  if (!records || !argv || fd < 0)
     {
-      char *s;
+      MSG ("failed to upgrade: %s\n", STRERROR);
+      goto out;
+    }
 
-      s = strchr (p, ' ');
-      if (!s)
-        break;
-      argv[n] = strndup (p, s - p);
-      p = s + 1;
+  now = now_ns ();
+  memset (&header, 0x00, sizeof (header));
+  header.magic = UPGRADE_MAGIC;
+  header.version = UPGRADE_VERSION;
+  header.task_size = sizeof (UpgradeTask);
+  header.task_count = n;
+  header.scale_size = sizeof (Scale);
+  header.scale_count = scales_len;
+  header.stats_size = sizeof (Stats);
+  header.control_fd = control_fd;
+  header.cgroup_fd = cgroup_fd;
+  header.start = now;
+  header.trace_written = trace_written;
+  strcpy (header.cgroup_path, cgroup_path);
+  header.stats = stats;
+  for (i = 0; i < n; i++)
+    save_task (registry.tasks[i], &records[i], now);
+
+  if (trace_write_all (fd, (char *) &header, sizeof (header))
+      || (scales_len
+          && trace_write_all (fd, (char *) scales, scales_len * sizeof (Scale)))
+      || trace_write_all (fd, (char *) records, n * sizeof (UpgradeTask)))
+    {
+      MSG ("failed to write upgrade state: %s\n", STRERROR);
+      goto out;
     }
-  argv[n] = strdup (p);
 
-  if (0)
+  /* the threads die in the exec, the pipes keep what they did not read. */
+  if (log_dir)
     {
+      for (i = 0; i < n; i++)
+        {
+          Task *task = registry.tasks[i];
+
+          if (!task->log)
+            continue;
+          drain_log (task);
+          epoll_ctl (epoll_fd, EPOLL_CTL_DEL, task->log_watch.fd, NULL);
+          task->log_watch.fd = -1;
+          retire_task_log (task);
+        }
+      stop_log_writer ();
+    }
+  stop_trace ();
+  stop_zygotes ();
+
+  j = 0;
+  argv[j++] = main_argv[0];
+  argv[j++] = "-U";
+  snprintf (arg, sizeof (arg), "%d", fd);
+  argv[j++] = arg;
+  /* the -U of the image before. */
+  i = main_argc > 2 && !strcmp (main_argv[1], "-U") ? 3 : 1;
+  while (i < main_argc)
+    argv[j++] = main_argv[i++];
+
+  set_upgrade_cloexec (records, n, 0);
+  MSG ("upgrading to '%s' with %d tasks, %d running\n", exe_path, n,
+       live_children);
+  execv (exe_path, argv);
+  MSG ("failed to upgrade, exec of '%s': %s\n", exe_path, STRERROR);
+  set_upgrade_cloexec (records, n, 1);
 
-      MSG ("command:%s\n", str);
-      for (n = 0; argv[n] != NULL; n++)
-        MSG ("  argv[%d]:%s\n", n, argv[n]);
+  /* carry on with new writers. */
+  if (log_dir)
+    {
+      watch_close (&log_event_watch);
+      setup_logs ();
+      for (i = 0; log_dir && i < n; i++)
+        if (records[i].log_fds[0] >= 0)
+          attach_task_log (registry.tasks[i], records[i].log_fds[0],
+                           records[i].log_fds[1]);
+    }
+  if (trace_ring)
+    {
+      munmap (trace_ring, sizeof (TraceRing));
+      trace_ring = NULL;
+      trace_append = 1;
+      setup_trace ();
     }
 
-  return argv;
+ out:
+  if (fd >= 0)
+    close (fd);
+  free (records);
+  free (argv);
 }
 
+/* the state from the image before, taken before the config is read. */
 static void
-spawn_task (Task *task)
+read_upgrade (int fd)
 {
-  if (0) MSG ("spawn program '%s'...\n", task->id);
+  UpgradeHeader *header;
+  struct stat    st;
+  char          *data;
+  size_t         size;
 
-  if (task->piped && task->pipe_id[0] == '\0')
+  data = MAP_FAILED;
+  if (!fstat (fd, &st) && st.st_size >= sizeof (UpgradeHeader))
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
     {
-      if (pipe (task->pipe_a))
-        {
-          task->piped = 0;
-          MSG ("failed to pipe() for prgoram '%s': %s\n", task->id, STRERROR);
-        }
-      if (pipe (task->pipe_b))
-        {
-          task->piped = 0;
-          MSG ("failed to pipe() for prgoram '%s': %s\n", task->id, STRERROR);
-        }
+      MSG ("failed to read upgrade state, no tasks adopted\n");
+      return;
     }
 
-  task->pid = fork ();
-  if (task->pid < 0)
+  header = (UpgradeHeader *) data;
+  size = sizeof (UpgradeHeader)
+    + (size_t) header->scale_count * sizeof (Scale)
+    + (size_t) header->task_count * sizeof (UpgradeTask);
+  if (header->magic != UPGRADE_MAGIC
+      || header->version != UPGRADE_VERSION
+      || header->task_size != sizeof (UpgradeTask)
+      || header->scale_size != sizeof (Scale)
+      || st.st_size != size)
     {
-      MSG ("failed to fork() for program '%s': %s\n", task->id, STRERROR);
+      MSG ("invalid upgrade state, no tasks adopted\n");
+      munmap (data, st.st_size);
       return;
     }
 
-  /* child process */
-  if (task->pid == 0)
+  scales = malloc ((header->scale_count + 1) * sizeof (Scale));
+  upgrade_tasks = malloc ((header->task_count + 1) * sizeof (UpgradeTask));
+  if (!scales || !upgrade_tasks)
     {
-      char **argv;
+      MSG ("failed to read upgrade state: %s\n", STRERROR);
+      free (scales);
+      free (upgrade_tasks);
+      scales = NULL;
+      upgrade_tasks = NULL;
+      munmap (data, st.st_size);
+      return;
+    }
+  memcpy (scales, header + 1, header->scale_count * sizeof (Scale));
+  scales_len = scales_max = header->scale_count;
+  memcpy (upgrade_tasks, data + size
+                         - header->task_count * sizeof (UpgradeTask),
+          header->task_count * sizeof (UpgradeTask));
+  upgrade_count = header->task_count;
+
+  upgrade_start = header->start;
+  if (header->stats_size == sizeof (Stats))
+    stats = header->stats;
+  trace_written = header->trace_written;
+  trace_append = 1;
+  control_fd = header->control_fd;
+  if (header->cgroup_fd >= 0)
+    {
+      cgroup_fd = header->cgroup_fd;
+      strcpy (cgroup_path, header->cgroup_path);
+      set_cloexec (cgroup_fd, 1);
+    }
+
+  munmap (data, st.st_size);
+}
+
+static void
+close_upgrade_fds (UpgradeTask *r)
+{
+  int i;
+
+  if (r->pidfd >= 0)
+    close (r->pidfd);
+  if (r->notify_fd >= 0)
+    close (r->notify_fd);
+  if (r->log_fds[0] >= 0)
+    {
+      close (r->log_fds[0]);
+      close (r->log_fds[1]);
+    }
+  if (r->relay_fd >= 0)
+    close (r->relay_fd);
+  if (r->edge_fd >= 0)
+    close (r->edge_fd);
+  for (i = 0; i < r->listen_count; i++)
+    if (r->listen_fds[i] >= 0)
+      close (r->listen_fds[i]);
+}
+
+/* take over the running instance and the history of task 'r->id'. */
+static int
+adopt_task (UpgradeTask *r)
+{
+  Task *task;
+  int   i;
+
+  task = lookup_task (r->id);
+  if (!task || task->pid > 0)
+    {
+      /* edited out of the config without a reload, reaped as an orphan. */
+      if (r->pid > 0)
+        {
+          MSG ("task '%s' is not in the config anymore, stopped\n", r->id);
+          kill (r->pid, SIGTERM);
+        }
+      close_upgrade_fds (r);
+      return 0;
+    }
+
+  task->restarts = r->restarts;
+  task->exit_status = r->exit_status;
+  task->restart = r->restart;
+  task->failures = r->failures;
+  task->window_failures = r->window_failures;
+  task->tokens = r->tokens;
+  task->tokens_time = r->tokens_time;
+  task->window_start = r->window_start;
+  task->spawn_time = r->spawn_time;
+  task->spawn_realtime = r->spawn_realtime;
+  task->exit_time = r->exit_time;
+  task->uptime = r->uptime;
+  task->cgroup = r->cgroup && cgroup_fd >= 0;
+  if (r->cpu >= 0)
+    {
+      task->cpu = r->cpu;
+      spread_load[task->cpu]++;
+    }
+  if (task->piped)
+    {
+      memcpy (task->pipe_a, r->pipe_a, sizeof (task->pipe_a));
+      memcpy (task->pipe_b, r->pipe_b, sizeof (task->pipe_b));
+    }
+  for (i = 0; i < r->listen_count; i++)
+    set_cloexec (r->listen_fds[i], 1);
+  memcpy (task->listen_fds, r->listen_fds, sizeof (task->listen_fds));
+  task->listen_count = r->listen_count;
 
-      argv = make_command_argv (task->command);
-      if (!argv || !argv[0])
+  if (r->log_fds[0] >= 0)
+    {
+      set_cloexec (r->log_fds[0], 1);
+      set_cloexec (r->log_fds[1], 1);
+      if (!log_dir || attach_task_log (task, r->log_fds[0], r->log_fds[1]))
+        {
+          close (r->log_fds[0]);
+          close (r->log_fds[1]);
+        }
+    }
+  if (task->relay)
+    {
+      task->relay->hup = r->relay_hup;
+      if (r->relay_fd >= 0)
         {
-          MSG ("failed to parse command '%s'\n", task->command);
-          exit (-1);
+          set_cloexec (r->relay_fd, 1);
+          start_relay (task, r->relay_fd);
         }
+    }
+  else if (r->relay_fd >= 0)
+    close (r->relay_fd);
+  if (task->input_edge)
+    {
+      Edge *edge = task->input_edge;
 
-      if (task->piped)
+      edge->closed = r->edge_closed;
+      edge->ahead = r->edge_ahead;
+      edge->bytes = r->edge_bytes;
+      edge->first = r->edge_first;
+      edge->last = r->edge_last;
+      if (r->edge_fd >= 0)
         {
-          if (task->pipe_id[0] == '\0')
+          set_cloexec (r->edge_fd, 1);
+          edge->fd = r->edge_fd;
+          if (watch_add (&edge->watch, edge->fd, EPOLLOUT | EPOLLET,
+                         handle_edge, edge))
             {
-              dup2 (task->pipe_a[1], 1);
-              dup2 (task->pipe_b[0], 0);
-              close (task->pipe_a[0]);
-              close (task->pipe_a[1]);
-              close (task->pipe_b[0]);
-              close (task->pipe_b[1]);
+              close (edge->fd);
+              edge->fd = -1;
+              edge->closed = 1;
             }
-          else
-            {
-              Task *sibling;
+        }
+    }
+  else if (r->edge_fd >= 0)
+    close (r->edge_fd);
 
-              sibling = lookup_task (task->pipe_id);
-              if (sibling && sibling->piped)
-                {
-                  dup2 (sibling->pipe_a[0], 0);
-                  dup2 (sibling->pipe_b[1], 1);
-                  close (sibling->pipe_a[0]);
-                  close (sibling->pipe_a[1]);
-                  close (sibling->pipe_b[0]);
-                  close (sibling->pipe_b[1]);
-                }
-            }
+  set_task_held (task, r->held);
+  if (r->pid > 0)
+    {
+      set_task_pid (task, r->pid);
+      live_children++;
+      if (r->pidfd >= 0)
+        {
+          set_cloexec (r->pidfd, 1);
+          if (!watch_add (&task->pid_watch, r->pidfd, EPOLLIN, handle_pidfd,
+                          task))
+            task->pidfd = r->pidfd;
+          else
+            close (r->pidfd);
+        }
+      if (task->pidfd < 0)
+        sigchld_children++;
+      if (r->notify_fd >= 0)
+        {
+          set_cloexec (r->notify_fd, 1);
+          task->notify_fd = r->notify_fd;
+          watch_add (&task->notify_watch, r->notify_fd, EPOLLIN, read_notify,
+                     task);
         }
+    }
+  else
+    {
+      if (r->pidfd >= 0)
+        close (r->pidfd);
+      if (r->notify_fd >= 0)
+        close (r->notify_fd);
+    }
 
-      execvp (argv[0], argv);
-      MSG ("failed to execute command '%s': %s\n", task->command, STRERROR);
-      exit (-1);
+  set_task_state (task, r->state);
+  if (r->ready_left >= 0 && task->state == TASK_STARTING)
+    timer_start (&task->ready_timer, r->ready_left / 1000000, ready_timeout,
+                 task);
+  if (r->restart_left >= 0 && task->state == TASK_BACKOFF)
+    {
+      restarting++;
+      timer_start (&task->restart_timer, r->restart_left / 1000000,
+                   restart_task, task);
+    }
+  task->next_run = r->next_run;
+  task->queued_time = r->queued_time;
+  task->queue_delay = r->queue_delay;
+  if (task->state == TASK_DEFERRED && r->released && queue_task (task))
+    set_task_state (task, TASK_FAILED);
+  if (r->schedule_left >= 0)
+    {
+      scheduled_tasks++;
+      timer_start (&task->schedule_timer, r->schedule_left / 1000000,
+                   run_scheduled, task);
     }
+  if (r->run_left >= 0 && r->pid > 0)
+    timer_start (&task->run_timer, r->run_left / 1000000,
+                 r->run_kill ? kill_run : run_timeout, task);
+
+  /* what it started already, the startup engine must not start again. */
+  if (r->released || r->pid > 0)
+    release_task (task);
+  board_update (task);
+
+  return r->pid > 0;
 }
 
+/* once the config is read and the event loop is up. */
 static void
-spawn_tasks (void)
+adopt_tasks (void)
 {
-  Task *task;
+  int children;
+  int i;
 
-  for (task = tasks; task != NULL && running; task = task->next){
-    usleep(2000000);  // 다중 코어 cpu에 의해 프로세스의 순서가 엉키는 것을 막기 위해 잠시 멈춰준다.
-    spawn_task (task);
-  }
+  if (!upgrade_tasks)
+    return;
+
+  children = 0;
+  for (i = 0; i < upgrade_count; i++)
+    children += adopt_task (&upgrade_tasks[i]);
+
+  /* pick up what came in meanwhile, the relays are edge triggered. */
+  for (i = 0; i < registry.task_count; i++)
+    if (registry.tasks[i]->relay)
+      relay_data (registry.tasks[i]->relay);
+
+  stats.upgrades++;
+  trace_event (TRACE_UPGRADE, NULL, now_ns () - upgrade_start, upgrade_start);
+  MSG ("upgrade: %d tasks adopted, %d running, in %.1f ms\n", upgrade_count,
+       children, (now_ns () - upgrade_start) / 1e6);
+
+  free (upgrade_tasks);
+  upgrade_tasks = NULL;
 }
 
+static const char *
+spawn_method (void)
+{
+  return use_fork ? "fork"
+    : cgroup_fd >= 0 && !SPAWN_CGROUP ? "clone3" : "posix_spawn";
+}
+
+/* the numbers of print_stats(), appended to 'stats_file' as one line. */
 static void
-wait_for_children (int signo)
+write_stats (void)
 {
-  Task *task;
-  pid_t pid;
+  struct rusage usage;
+  const char   *p;
+  FILE         *fp;
 
- rewait:
-  pid = waitpid (-1, NULL, WNOHANG);
-  if (pid <= 0)
+  if (!stats_file)
     return;
 
-  task = lookup_task_by_pid (pid);
-  if (!task)
+  fp = fopen (stats_file, "a");
+  if (!fp)
     {
-      MSG ("unknown pid %d", pid);
+      MSG ("failed to open stats file '%s': %s\n", stats_file, STRERROR);
       return;
     }
+  getrusage (RUSAGE_SELF, &usage);
 
-  if (0) MSG ("program[%s] terminated\n", task->id);
-
-  if (running && task->action == ACTION_RESPAWN)
-    spawn_task (task);
-  else
-    task->pid = 0;
+  fprintf (fp, "{\"config\": \"");
+  for (p = config_file; *p; p++)
+    if (*p == '"' || *p == '\\')
+      fprintf (fp, "\\%c", *p);
+    else if ((unsigned char) *p >= 0x20)
+      fputc (*p, fp);
+  fprintf (fp, "\", \"tasks\": %d, \"spawn\": \"%s\", \"pidfd\": %s, "
+           "\"wall_ms\": %.3f, \"cpu_user_ms\": %.3f, \"cpu_sys_ms\": %.3f, "
+           "\"max_rss_kb\": %ld, \"task_records\": %d, \"task_slabs\": %d, ",
+           registry.task_count, spawn_method (),
+           use_pidfd ? "true" : "false",
+           (now_ns () - stats.start) / 1e6,
+           usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+           usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3,
+           usage.ru_maxrss, task_records, task_slab_count);
+  fprintf (fp, "\"spawns\": %lld, \"reaps\": %lld, \"respawns\": %lld, "
+           "\"spawn_us_avg\": %.3f, \"spawns_per_s\": %.1f, ",
+           stats.spawns, stats.reaps, stats.respawns,
+           stats.spawns ? stats.spawn_time / 1e3 / stats.spawns : 0.0,
+           stats.spawn_time ? stats.spawns * 1e9 / stats.spawn_time : 0.0);
+  fprintf (fp, "\"reap_samples\": %lld, \"reap_us_avg\": %.3f, "
+           "\"reap_us_max\": %.3f, \"respawn_us_avg\": %.3f, "
+           "\"respawn_us_max\": %.3f, ",
+           stats.reap_samples,
+           stats.reap_samples ? stats.reap_time / 1e3 / stats.reap_samples
+                              : 0.0,
+           stats.reap_time_max / 1e3,
+           stats.respawns ? stats.respawn_time / 1e3 / stats.respawns : 0.0,
+           stats.respawn_time_max / 1e3);
+  fprintf (fp, "\"sigchld_signals\": %lld, \"sigchld_reaps\": %lld, "
+           "\"sigchld_batch_max\": %lld, \"upgrades\": %lld, "
+           "\"orphans\": %lld, \"scheduled_runs\": %lld, "
+           "\"skipped_runs\": %lld, \"timeouts\": %lld, "
+           "\"deferrals\": %lld, \"queue_ms_avg\": %.3f, "
+           "\"queue_ms_max\": %.3f, \"ready_samples\": %lld, "
+           "\"ready_ms_avg\": %.3f, \"ready_ms_max\": %.3f, "
+           "\"zygote_forks\": %lld, \"zygote_colds\": %lld}\n",
+           stats.sigchld_signals, stats.sigchld_reaps,
+           stats.sigchld_batch_max, stats.upgrades, stats.orphans,
+           stats.scheduled_runs, stats.skipped_runs, stats.timeouts,
+           stats.deferrals,
+           stats.admissions ? stats.queue_time / 1e6 / stats.admissions : 0.0,
+           stats.queue_time_max / 1e6, stats.ready_samples,
+           stats.ready_samples ? stats.ready_time / 1e6 / stats.ready_samples
+                               : 0.0,
+           stats.ready_time_max / 1e6, stats.zygote_forks,
+           stats.zygote_colds);
 
-  /* some SIGCHLD signals is lost... */
-  goto rewait;
+  if (fclose (fp))
+    MSG ("failed to write stats file '%s': %s\n", stats_file, STRERROR);
 }
 
 static void
-terminate_children (int signo)
+print_stats (void)
 {
-  Task *task;
+  struct rusage usage;
 
-  if (1) MSG ("terminated by SIGNAL(%d)\n", signo);
+  write_stats ();
+  if (!show_stats)
+    return;
 
-  running = 0;
+  MSG ("spawns %lld, reaps %lld, respawns %lld\n",
+       stats.spawns, stats.reaps, stats.respawns);
+  if (stats.spawns > 0)
+    MSG ("spawn (%s): avg %.1f us, %.0f spawns/s\n", spawn_method (),
+         stats.spawn_time / 1000.0 / stats.spawns,
+         stats.spawns * 1e9 / stats.spawn_time);
+  if (stats.backoffs > 0 || stats.quarantines > 0)
+    MSG ("delayed restarts %lld, quarantined %lld\n",
+         stats.backoffs, stats.quarantines);
+  if (log_event_fd >= 0)
+    MSG ("logs: %lld bytes, %lld lines in %lld writes, %lld stalls, "
+         "%lld errors\n", stats.log_bytes, stats.log_lines,
+         stats.log_writes, stats.log_stalls, stats.log_errors);
+  if (board)
+    MSG ("status board '%s': %lld updates\n", board_file, stats.board_updates);
+  if (trace_ring)
+    MSG ("trace '%s': %lld events, %llu dropped\n", trace_file, trace_written,
+         trace_ring->lost + trace_ring->dropped);
+  if (teardown.start)
+    MSG ("shutdown: %d tasks in %.1f ms, %d killed, slowest '%s' %.1f ms\n",
+         teardown.stopped, (now_ns () - teardown.start) / 1e6,
+         teardown.killed, teardown.slowest, teardown.slowest_time / 1e6);
+  if (stats.respawns > 0)
+    MSG ("reap to respawn latency: avg %.1f us, max %.1f us\n",
+         stats.respawn_time / 1000.0 / stats.respawns,
+         stats.respawn_time_max / 1000.0);
+  if (stats.reap_samples > 0)
+    MSG ("exit to reap latency: avg %.1f us, max %.1f us, %lld exits\n",
+         stats.reap_time / 1000.0 / stats.reap_samples,
+         stats.reap_time_max / 1000.0, stats.reap_samples);
+  if (stats.sigchld_signals > 0)
+    MSG ("sigchld: %lld signals, %lld reaps, max %lld reaps per signal\n",
+         stats.sigchld_signals, stats.sigchld_reaps, stats.sigchld_batch_max);
+  if (stats.upgrades > 0 || stats.orphans > 0)
+    MSG ("upgrades %lld, orphans reaped %lld\n", stats.upgrades,
+         stats.orphans);
+  if (stats.scheduled_runs > 0 || stats.timeouts > 0)
+    MSG ("scheduled runs %lld, %lld skipped, %lld timeouts\n",
+         stats.scheduled_runs, stats.skipped_runs, stats.timeouts);
+  if (stats.deferrals > 0)
+    MSG ("admission: %lld spawns deferred, waited avg %.1f ms, max %.1f ms\n",
+         stats.deferrals,
+         stats.admissions ? stats.queue_time / 1e6 / stats.admissions : 0.0,
+         stats.queue_time_max / 1e6);
+  if (stats.ready_samples > 0)
+    MSG ("restart to ready: avg %.1f ms, max %.1f ms over %lld restarts\n",
+         stats.ready_time / 1e6 / stats.ready_samples,
+         stats.ready_time_max / 1e6, stats.ready_samples);
+  if (stats.zygote_starts > 0)
+    MSG ("zygotes: %lld started, %lld forks, %lld cold spawns\n",
+         stats.zygote_starts, stats.zygote_forks, stats.zygote_colds);
 
-  for (task = tasks; task != NULL; task = task->next)
-    if (task->pid > 0)
-      {
-        if (0) MSG ("kill program[%s] by SIGNAL(%d)\n", task->id, signo);
-        kill (task->pid, signo);
-      }
+  MSG ("tasks: %d records in %d slabs of %d, %d free\n", task_records,
+       task_slab_count, TASK_SLAB, task_slab_count * TASK_SLAB - task_records);
+
+  getrusage (RUSAGE_SELF, &usage);
+  MSG ("procman: %.1f ms user, %.1f ms sys, max rss %ld kB in %.1f ms\n",
+       usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+       usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3,
+       usage.ru_maxrss, (now_ns () - stats.start) / 1e6);
+}
+
+static void
+handle_signals (Watch        *watch,
+                unsigned int  events)
+{
+  struct signalfd_siginfo fdsi;
 
-  exit (1);
+  while (read (watch->fd, &fdsi, sizeof (fdsi)) == sizeof (fdsi))
+    {
+      trace_event (TRACE_RECEIVED, NULL, fdsi.ssi_signo, 0);
+      switch (fdsi.ssi_signo)
+        {
+        case SIGCHLD:
+          wait_for_children ();
+          reap_orphans ();
+          break;
+        case SIGINT:
+        case SIGTERM:
+          begin_shutdown (fdsi.ssi_signo);
+          break;
+        case SIGHUP:
+          if (running)
+            reload_config (0);
+          break;
+        case SIGUSR2:
+          if (running)
+            upgrade_requested = 1;
+          break;
+        default:
+          MSG ("Read unexpected signal\n");
+          break;
+        }
+    }
 }
 
 int
 main (int    argc,
       char **argv)
 {
-  struct sigaction sa;
-  int terminated;
-  struct signalfd_siginfo fdsi;
-  ssize_t s;
+  sigset_t mask;
+  int      terminated;
+  int      opt;
+
+  main_argc = argc;
+  main_argv = argv;
+  while ((opt = getopt (argc, argv, "A:b:c:CFg:j:J:l:L:PsT:U:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'A':
+          if (parse_admission (optarg))
+            MSG ("invalid admission '%s', ignored\n", optarg);
+          break;
+        case 'b':
+          board_file = optarg;
+          break;
+        case 'c':
+          control_file = optarg;
+          break;
+        case 'C':
+          use_cgroup = 0;
+          break;
+        case 'F':
+          use_fork = 1;
+          break;
+        case 'g':
+          if (parse_duration (optarg, &teardown.grace))
+            MSG ("invalid grace period '%s', ignored\n", optarg);
+          break;
+        case 'j':
+          startup.max_jobs = atoi (optarg);
+          break;
+        case 'J':
+          stats_file = optarg;
+          break;
+        case 'l':
+          log_dir = optarg;
+          break;
+        case 'L':
+          if (parse_size (optarg, &log_max))
+            MSG ("invalid log size '%s', ignored\n", optarg);
+          break;
+        case 'P':
+          no_pidfd = 1;
+          break;
+        case 's':
+          show_stats = 1;
+          break;
+        case 'T':
+          trace_file = optarg;
+          break;
+        case 'U':
+          upgrade_fd = atoi (optarg);
+          break;
+        default:
+          optind = argc;
+          break;
+        }
+    }
+
+  if (optind >= argc)
+    {
+      MSG ("usage: %s [-A cpu=%%,memory=%%,io=%%,batch=n,path=dir] "
+           "[-b board-file] [-c control-socket] [-C] [-F] "
+           "[-g grace] [-j jobs] [-J stats-file] [-l log-dir] [-L size] "
+           "[-P] [-s] [-T trace-file] "
+           "config-file\n", argv[0]);
+      return -1;
+    }
+
+  stats.start = now_ns ();
+  config_file = argv[optind];
+
+  /* the binary may be replaced on disk, which is what an upgrade is for. */
+  if (readlink ("/proc/self/exe", exe_path, sizeof (exe_path) - 1) < 0)
+    exe_path[0] = '\0';
+  if (upgrade_fd >= 0)
+    read_upgrade (upgrade_fd);
+
+  /* whatever the tasks daemonize is reparented here, see reap_orphans(). */
+  if (prctl (PR_SET_CHILD_SUBREAPER, 1))
+    MSG ("failed to become a subreaper: %s\n", STRERROR);
 
-  if (argc <= 1)
+  setup_board ();
+  if (read_config (config_file))
     {
-      MSG ("usage: %s config-file\n", argv[0]);
+      MSG ("failed to load config file '%s': %s\n", argv[optind], STRERROR);
+      close_board ();
       return -1;
     }
 
-  if (read_config (argv[1]))
+  if (prepare_startup ())
     {
-      MSG ("failed to load config file '%s': %s\n", argv[1], STRERROR);
+      MSG ("failed to prepare startup: %s\n", STRERROR);
       return -1;
     }
 
   running = 1;
-  int s_fd;
 
-/*==============Edit part======================================*/
-  /* SIGCHLD */
-  sigemptyset (&sa.sa_mask);
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    {
+      MSG ("failed to create epoll: %s\n", STRERROR);
+      return -1;
+    }
+
+  timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0 || watch_add (&timer_watch, timer_fd, EPOLLIN,
+                                 handle_timers, NULL))
+    {
+      MSG ("failed to create timer: %s\n", STRERROR);
+      return -1;
+    }
+
+  /* probe pidfd support with ourselves, -P to test SIGCHLD alone. */
+  {
+    int fd;
 
-  sigaddset(&sa.sa_mask, SIGCHLD);
+    fd = no_pidfd ? -1 : syscall (SYS_pidfd_open, getpid (), 0);
+    if (fd >= 0)
+      {
+        use_pidfd = 1;
+        close (fd);
+      }
+  }
 
-  fdsi.ssi_status = 0;
+  if (use_cgroup && cgroup_fd < 0)
+    setup_cgroups ();
+  setup_control ();
 
-  s_fd = signalfd(-1,&sa.sa_mask,0);
+  if (sched_getaffinity (0, sizeof (spread_cpus), &spread_cpus))
+    CPU_SET (0, &spread_cpus);
 
-  if(s_fd == -1)
-    MSG("failed to register signal handler for SIGCHLD\n");
+  /* every signal goes through the signalfd, no async handlers. */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGCHLD);
+  sigaddset (&mask, SIGHUP);
+  sigaddset (&mask, SIGUSR2);
 
-  if(sigprocmask(SIG_BLOCK, &sa.sa_mask, NULL) == -1)
-    MSG("error");
+  /* closed pipelines show up as EPIPE instead. */
+  signal (SIGPIPE, SIG_IGN);
 
-/*============================================================*/
-/*
-  sigemptyset (&sa.sa_mask);
-  sa.sa_flags = 0;
-  sa.sa_handler = wait_for_children;
-  if (sigaction (SIGCHLD, &sa, NULL))
-    MSG ("failed to register signal handler for SIGINT\n");
-*/
+  null_fd = open ("/dev/null", O_WRONLY | O_CLOEXEC);
 
+  if (sigprocmask (SIG_BLOCK, &mask, &orig_mask) == -1)
+    MSG ("failed to block signals: %s\n", STRERROR);
 
-  /* SIGINT */
-  sigemptyset (&sa.sa_mask);
-  sa.sa_flags = 0;
-  sa.sa_handler = terminate_children;
-  if (sigaction (SIGINT, &sa, NULL))
-    MSG ("failed to register signal handler for SIGINT\n");
+  /* the mask went through the exec, the tasks start without it. */
+  if (upgrade_fd >= 0)
+    {
+      sigdelset (&orig_mask, SIGINT);
+      sigdelset (&orig_mask, SIGTERM);
+      sigdelset (&orig_mask, SIGCHLD);
+      sigdelset (&orig_mask, SIGHUP);
+      sigdelset (&orig_mask, SIGUSR2);
+    }
+
+  signal_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0 || watch_add (&signal_watch, signal_fd, EPOLLIN,
+                                  handle_signals, NULL))
+    {
+      MSG ("failed to create signalfd: %s\n", STRERROR);
+      return -1;
+    }
 
-  /* SIGTERM */
-  sigemptyset (&sa.sa_mask);
-  sa.sa_flags = 0;
-  sa.sa_handler = terminate_children;
-  if (sigaction (SIGTERM, &sa, NULL))
-    MSG ("failed to register signal handler for SIGINT\n");
+  /* after blocking the signals, the writer threads must not take them. */
+  setup_logs ();
+  setup_trace ();
+  setup_admission ();
 
-  spawn_tasks ();
+  adopt_tasks ();
+  start_tasks ();
 
-  terminated = 0;
+  terminated = live_children == 0 && zygote_waiting == 0 && restarting == 0
+    && scheduled_tasks == 0 && admission.len == 0 && held_tasks == 0
+    && clients == 0 && startup.queue_head == startup.queue_len;
   while (!terminated)
     {
-      Task *task;
+      struct epoll_event events[64];
+      int                n;
+      int                i;
 
-      s = read(s_fd, &fdsi, sizeof(struct signalfd_siginfo));
-      if(s != sizeof(struct signalfd_siginfo))
-          MSG("read");
+      n = epoll_wait (epoll_fd, events, 64, -1);
+      if (n < 0)
+        {
+          if (errno != EINTR)
+            MSG ("failed to epoll_wait(): %s\n", STRERROR);
+          continue;
+        }
 
-      if(fdsi.ssi_signo == SIGCHLD){ // SIGCHLD 신호를 받았을 경우
-          wait_for_children (fdsi.ssi_signo); //wait_for_children 함수를 호출하여 처리해 준다.
-          MSG("Got SIGCHLD\n");
-      }
-      else
-          MSG("Read unexpected signal\n");
+      for (i = 0; i < n; i++)
+        {
+          Watch *watch = events[i].data.ptr;
 
-      terminated = 1;
-      for (task = tasks; task != NULL; task = task->next)
-        if (task->pid > 0)
-          {
-            terminated = 0;
-            break;
-          }
+          watch->func (watch, events[i].events);
+        }
+      free_dead_tasks ();
+
+      if (upgrade_requested)
+        upgrade ();
+      start_tasks ();
 
-      usleep (100000);
+      /* no rescans, live children are counted at spawn and reap. */
+      terminated = live_children == 0 && zygote_waiting == 0
+        && (!running
+            || (restarting == 0 && scheduled_tasks == 0 && admission.len == 0
+                && held_tasks == 0 && clients == 0
+                && startup.queue_head == startup.queue_len));
     }
 
-  return 0;
+  stop_zygotes ();
+  stop_logs ();
+  stop_trace ();
+  print_stats ();
+  cleanup_cgroups ();
+  close_board ();
+  close_control ();
+  close_listeners ();
+
+  return teardown.signo ? 1 : 0;
 }
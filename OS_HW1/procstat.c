@@ -0,0 +1,335 @@
+/*
+ * OS Assignment #1 Status Board Reader.
+ *
+ * Prints the tasks on the status board of a running procman, see board.h,
+ * without disturbing it.  'procstat -B readers' measures what the seqlock
+ * costs the writer while that many readers scan the same records.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "board.h"
+
+#define MSG(x...) fprintf (stderr, x)
+#define STRERROR  strerror (errno)
+
+/* in TaskState order of procman. */
+static const char *states[] =
+{
+  "waiting", "starting", "running", "exited", "failed", "backoff",
+  "quarantined", "stopped", "scheduled", "deferred",
+};
+
+static long long
+clock_ns (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static BoardHeader *
+map_board (int     fd,
+           size_t *size)
+{
+  struct stat st;
+  void       *data;
+
+  if (fstat (fd, &st))
+    return NULL;
+  if (st.st_size < sizeof (BoardHeader))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+
+  return data;
+}
+
+static int
+print_board (const char *file)
+{
+  BoardHeader *header;
+  BoardRecord  record;
+  unsigned int count;
+  unsigned int i;
+  long long    now;
+  size_t       size;
+  int          fd;
+
+  fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      MSG ("failed to open status board '%s': %s\n", file, STRERROR);
+      return -1;
+    }
+
+  header = map_board (fd, &size);
+  if (!header)
+    {
+      MSG ("failed to map status board '%s': %s\n", file, STRERROR);
+      close (fd);
+      return -1;
+    }
+
+  if (__atomic_load_n (&header->magic, __ATOMIC_ACQUIRE) != BOARD_MAGIC
+      || header->version != BOARD_VERSION
+      || header->record_size != sizeof (BoardRecord))
+    {
+      MSG ("'%s' is not a status board of this procman\n", file);
+      munmap (header, size);
+      close (fd);
+      return -1;
+    }
+
+  /* the board grows before 'count' does, so a new mapping covers it. */
+  count = __atomic_load_n (&header->count, __ATOMIC_ACQUIRE);
+  if (sizeof (BoardHeader) + count * sizeof (BoardRecord) > size)
+    {
+      munmap (header, size);
+      header = map_board (fd, &size);
+      if (!header)
+        {
+          MSG ("failed to map status board '%s': %s\n", file, STRERROR);
+          close (fd);
+          return -1;
+        }
+    }
+  close (fd);
+
+  now = clock_ns (CLOCK_REALTIME);
+  printf ("procman %d, up %.1f s\n", header->pid,
+          (now - header->start_time) / 1e9);
+  printf ("%-8s %8s %-11s %8s %-10s %10s %10s %10s\n",
+          "ID", "PID", "STATE", "RESTARTS", "LAST-EXIT", "STARTED", "UPTIME",
+          "QUEUED");
+
+  for (i = 0; i < count; i++)
+    {
+      char      status[32];
+      char      started[32];
+      long long uptime;
+
+      board_read (&BOARD_RECORDS (header)[i], &record);
+      if (record.state < 0)
+        continue;
+
+      if (record.exit_status < 0)
+        strcpy (status, "-");
+      else if (WIFSIGNALED (record.exit_status))
+        snprintf (status, sizeof (status), "signal %d",
+                  WTERMSIG (record.exit_status));
+      else
+        snprintf (status, sizeof (status), "exit %d",
+                  WEXITSTATUS (record.exit_status));
+
+      if (record.spawn_time)
+        snprintf (started, sizeof (started), "%.1fs ago",
+                  (now - record.spawn_time) / 1e9);
+      else
+        strcpy (started, "-");
+
+      uptime = record.uptime;
+      if (record.pid > 0)
+        uptime += now - record.spawn_time;
+
+      record.id.str[BOARD_ID_LEN - 1] = '\0';
+      printf ("%-8s %8d %-11s %8d %-10s %10s %9.1fs %8.1fms\n",
+              record.id.str, record.pid,
+              record.state < sizeof (states) / sizeof (states[0])
+              ? states[record.state] : "?",
+              record.restarts, status, started, uptime / 1e9,
+              record.queue_delay / 1e6);
+    }
+
+  munmap (header, size);
+
+  return 0;
+}
+
+/* per reader results, on their own cache lines. */
+typedef struct _BenchReader BenchReader;
+struct _BenchReader
+{
+  long long reads;
+  long long retries;
+} __attribute__ ((aligned (BOARD_LINE)));
+
+/*
+ * Update 'records' records round robin for a second while 'readers'
+ * processes copy them in a loop.  The writer's CPU time per update is
+ * the cost procman pays; its wall time also counts sharing the CPUs.
+ */
+static int
+bench_board (int readers,
+             int records)
+{
+  BoardHeader *header;
+  BoardRecord *board_records;
+  BoardRecord  value;
+  BenchReader *results;
+  long long    start;
+  long long    cpu;
+  long long    wall;
+  long long    reads;
+  long long    retries;
+  long long    n;
+  int         *stop;
+  size_t       size;
+  int          i;
+  int          j;
+
+  size = sizeof (BoardHeader) + records * sizeof (BoardRecord)
+    + (readers + 1) * sizeof (BenchReader);
+  header = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (header == MAP_FAILED)
+    {
+      MSG ("failed to map %d records: %s\n", records, STRERROR);
+      return -1;
+    }
+  board_records = BOARD_RECORDS (header);
+  results = (BenchReader *) (board_records + records);
+  stop = (int *) (results + readers);
+
+  for (i = 0; i < readers; i++)
+    {
+      pid_t pid;
+
+      pid = fork ();
+      if (pid < 0)
+        {
+          MSG ("failed to fork a reader: %s\n", STRERROR);
+          readers = i;
+          break;
+        }
+      if (pid == 0)
+        {
+          BoardRecord copy;
+
+          reads = retries = 0;
+          while (!__atomic_load_n (stop, __ATOMIC_RELAXED))
+            for (j = 0; j < records; j++)
+              {
+                retries += board_read (&board_records[j], &copy);
+                reads++;
+              }
+          results[i].reads = reads;
+          results[i].retries = retries;
+          _exit (0);
+        }
+    }
+  usleep (10000);
+
+  memset (&value, 0x00, sizeof (value));
+  strcpy (value.id.str, "bench");
+  start = clock_ns (CLOCK_MONOTONIC);
+  cpu = clock_ns (CLOCK_PROCESS_CPUTIME_ID);
+  j = 0;
+  for (n = 1; ; n++)
+    {
+      value.pid = n;
+      value.uptime = n;
+      board_write (&board_records[j], &value);
+      if (++j == records)
+        j = 0;
+      if (!(n & 1023) && clock_ns (CLOCK_MONOTONIC) - start >= 1000000000LL)
+        break;
+    }
+  cpu = clock_ns (CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  wall = clock_ns (CLOCK_MONOTONIC) - start;
+
+  __atomic_store_n (stop, 1, __ATOMIC_RELAXED);
+  while (wait (NULL) > 0)
+    ;
+
+  reads = retries = 0;
+  for (i = 0; i < readers; i++)
+    {
+      reads += results[i].reads;
+      retries += results[i].retries;
+    }
+
+  printf ("%3d readers: writer %.1f ns/update cpu, %.1f ns/update wall, "
+          "%.0f updates/s",
+          readers, (double) cpu / n, (double) wall / n, n * 1e9 / wall);
+  if (readers > 0)
+    printf (", readers %.0f records/s, %.3f%% retries",
+            reads * 1e9 / wall, reads ? retries * 100.0 / reads : 0.0);
+  printf ("\n");
+
+  munmap (header, size);
+
+  return 0;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  char  path[PATH_MAX];
+  char *end;
+  int   readers = -1;
+  int   records = 1024;
+  int   opt;
+
+  while ((opt = getopt (argc, argv, "B:n:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'B':
+          readers = atoi (optarg);
+          break;
+        case 'n':
+          records = atoi (optarg);
+          break;
+        default:
+          optind = argc + 1;
+          break;
+        }
+    }
+
+  if (readers >= 0 && records > 0)
+    {
+      /* the baseline first. */
+      if (readers > 0 && bench_board (0, records))
+        return -1;
+      return bench_board (readers, records) ? -1 : 0;
+    }
+
+  if (optind != argc - 1)
+    {
+      MSG ("usage: %s pid | board-file\n"
+           "       %s -B readers [-n records]\n", argv[0], argv[0]);
+      return -1;
+    }
+
+  /* a pid stands for the default board of that procman. */
+  strtol (argv[optind], &end, 10);
+  if (*end == '\0')
+    snprintf (path, sizeof (path), "/dev/shm/procman.%s", argv[optind]);
+  else
+    snprintf (path, sizeof (path), "%s", argv[optind]);
+
+  return print_board (path) ? -1 : 0;
+}
@@ -0,0 +1,551 @@
+/*
+ * OS Assignment #1 Trace Converter.
+ *
+ * Turns an event trace of 'procman -T', see trace.h, into the JSON of
+ * the Chrome trace viewer (chrome://tracing, ui.perfetto.dev), one track
+ * per task, or prints it as text with -d.  'proctrace -B' measures what
+ * an event costs procman while a thread flushes the ring.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "trace.h"
+
+#define MSG(x...) fprintf (stderr, x)
+#define STRERROR  strerror (errno)
+
+/* in TraceType order. */
+static const char *types[] =
+{
+  "spawn", "spawn-failed", "ready", "exit", "reap", "respawn", "quarantine",
+  "signal", "received", "pipe-open", "pipe-close", "reload", "dropped",
+  "upgrade", "timeout", "skip", "defer", "admit",
+};
+
+static const char *
+signal_name (int signo)
+{
+  static char buf[16];
+
+  switch (signo)
+    {
+    case SIGHUP:  return "SIGHUP";
+    case SIGINT:  return "SIGINT";
+    case SIGKILL: return "SIGKILL";
+    case SIGUSR1: return "SIGUSR1";
+    case SIGUSR2: return "SIGUSR2";
+    case SIGTERM: return "SIGTERM";
+    case SIGCHLD: return "SIGCHLD";
+    case SIGSTOP: return "SIGSTOP";
+    case SIGCONT: return "SIGCONT";
+    }
+  snprintf (buf, sizeof (buf), "signal %d", signo);
+
+  return buf;
+}
+
+static const char *
+status_name (int status)
+{
+  static char buf[32];
+
+  if (WIFSIGNALED (status))
+    snprintf (buf, sizeof (buf), "%s", signal_name (WTERMSIG (status)));
+  else
+    snprintf (buf, sizeof (buf), "exit %d", WEXITSTATUS (status));
+
+  return buf;
+}
+
+/* task ids to Chrome thread ids, 0 is procman itself. */
+typedef struct _Track Track;
+struct _Track
+{
+  char id[TRACE_ID_LEN + 1];
+  int  tid;
+  int  running;                     /* a "run" slice is open */
+};
+
+static Track *tracks;
+static int    tracks_size;
+static int    tracks_len;
+
+static unsigned int
+hash_id (const char *id)
+{
+  unsigned int h = 5381;
+
+  while (*id)
+    h = h * 33 + (unsigned char) *id++;
+
+  return h;
+}
+
+static Track *
+lookup_track (const char *id,
+              int        *created)
+{
+  unsigned int h;
+
+  *created = 0;
+  if (tracks_len * 2 >= tracks_size)
+    {
+      Track *old = tracks;
+      int    old_size = tracks_size;
+      int    i;
+
+      tracks_size = tracks_size ? tracks_size * 2 : 256;
+      tracks = calloc (tracks_size, sizeof (Track));
+      if (!tracks)
+        {
+          MSG ("out of memory\n");
+          exit (1);
+        }
+      for (i = 0; i < old_size; i++)
+        if (old[i].tid)
+          {
+            h = hash_id (old[i].id) & (tracks_size - 1);
+            while (tracks[h].tid)
+              h = (h + 1) & (tracks_size - 1);
+            tracks[h] = old[i];
+          }
+      free (old);
+    }
+
+  h = hash_id (id) & (tracks_size - 1);
+  while (tracks[h].tid)
+    {
+      if (!strcmp (tracks[h].id, id))
+        return &tracks[h];
+      h = (h + 1) & (tracks_size - 1);
+    }
+
+  memcpy (tracks[h].id, id, TRACE_ID_LEN);
+  tracks[h].tid = ++tracks_len;
+  *created = 1;
+
+  return &tracks[h];
+}
+
+static const TraceEvent *
+map_trace (const char         *file,
+           const TraceHeader **header,
+           size_t             *count)
+{
+  struct stat st;
+  void       *data;
+  int         fd;
+
+  fd = open (file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      MSG ("failed to open trace '%s': %s\n", file, STRERROR);
+      return NULL;
+    }
+  if (fstat (fd, &st) || st.st_size < sizeof (TraceHeader))
+    {
+      MSG ("'%s' is not a trace of procman\n", file);
+      close (fd);
+      return NULL;
+    }
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      MSG ("failed to map trace '%s': %s\n", file, STRERROR);
+      return NULL;
+    }
+
+  *header = data;
+  if ((*header)->magic != TRACE_MAGIC || (*header)->version != TRACE_VERSION
+      || (*header)->event_size != sizeof (TraceEvent))
+    {
+      MSG ("'%s' is not a trace of this procman\n", file);
+      munmap (data, st.st_size);
+      return NULL;
+    }
+  /* a trace cut short keeps its whole events. */
+  *count = (st.st_size - sizeof (TraceHeader)) / sizeof (TraceEvent);
+
+  return (const TraceEvent *) ((const char *) data + sizeof (TraceHeader));
+}
+
+static void
+dump_trace (const TraceHeader *header,
+            const TraceEvent  *events,
+            size_t             count)
+{
+  size_t i;
+
+  printf ("procman %d\n", header->pid);
+  for (i = 0; i < count; i++)
+    {
+      const TraceEvent *e = &events[i];
+      char              id[TRACE_ID_LEN + 1];
+
+      memcpy (id, e->id, TRACE_ID_LEN);
+      id[TRACE_ID_LEN] = '\0';
+      printf ("%12.3f ms %-13s %7d %-12s", (e->time - header->start_time) / 1e6,
+              id[0] ? id : "-", e->pid,
+              e->type < TRACE_TYPES ? types[e->type] : "?");
+      switch (e->type)
+        {
+        case TRACE_SPAWN:
+        case TRACE_RELOAD:
+        case TRACE_UPGRADE:
+          printf (" %.1f us", e->arg / 1e3);
+          break;
+        case TRACE_SPAWN_FAILED:
+          printf (" %s", strerror (e->arg));
+          break;
+        case TRACE_REAP:
+          printf (" %s", status_name (e->arg));
+          break;
+        case TRACE_RESPAWN:
+          printf (" in %lld ms", e->arg);
+          break;
+        case TRACE_TIMEOUT:
+          printf (" after %lld ms", e->arg);
+          break;
+        case TRACE_DEFER:
+          printf (" priority %lld", e->arg);
+          break;
+        case TRACE_ADMIT:
+          printf (" after %.1f ms", e->arg / 1e6);
+          break;
+        case TRACE_SIGNAL:
+        case TRACE_RECEIVED:
+          printf (" %s", signal_name (e->arg));
+          break;
+        case TRACE_PIPE_CLOSE:
+          printf (" %lld bytes", e->arg);
+          break;
+        case TRACE_DROPPED:
+          printf (" %lld events", e->arg);
+          break;
+        }
+      printf ("\n");
+    }
+}
+
+/* one JSON event, 'extra' is more of its members. */
+static void
+print_event (const char *name,
+             const char *ph,
+             int         pid,
+             int         tid,
+             double      ts,
+             const char *extra)
+{
+  static int first = 1;
+
+  printf ("%s\n{\"name\": \"%s\", \"ph\": \"%s\", \"pid\": %d, \"tid\": %d, "
+          "\"ts\": %.3f%s%s}", first ? "" : ",", name, ph, pid, tid, ts,
+          extra[0] ? ", " : "", extra);
+  first = 0;
+}
+
+static void
+convert_trace (const TraceHeader *header,
+               const TraceEvent  *events,
+               size_t             count)
+{
+  char   extra[128];
+  char   name[64];
+  size_t i;
+  int    pid = header->pid;
+
+  printf ("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  snprintf (extra, sizeof (extra), "\"args\": {\"name\": \"procman %d\"}", pid);
+  print_event ("process_name", "M", pid, 0, 0, extra);
+  print_event ("thread_name", "M", pid, 0, 0,
+               "\"args\": {\"name\": \"procman\"}");
+
+  for (i = 0; i < count; i++)
+    {
+      const TraceEvent *e = &events[i];
+      Track            *track;
+      double            ts;
+      char              id[TRACE_ID_LEN + 1];
+      int               created;
+      int               tid = 0;
+
+      memcpy (id, e->id, TRACE_ID_LEN);
+      id[TRACE_ID_LEN] = '\0';
+      track = NULL;
+      if (id[0])
+        {
+          track = lookup_track (id, &created);
+          tid = track->tid;
+          if (created)
+            {
+              snprintf (extra, sizeof (extra), "\"args\": {\"name\": \"%s\"}",
+                        id);
+              print_event ("thread_name", "M", pid, tid, 0, extra);
+            }
+        }
+
+      ts = (e->time - header->start_time) / 1e3;
+      switch (e->type)
+        {
+        case TRACE_SPAWN:
+          snprintf (extra, sizeof (extra),
+                    "\"dur\": %.3f, \"args\": {\"pid\": %d}", e->arg / 1e3,
+                    e->pid);
+          print_event ("spawn", "X", pid, tid, ts, extra);
+          if (track && track->running)
+            print_event ("run", "E", pid, tid, ts, "");
+          snprintf (name, sizeof (name), "run %d", e->pid);
+          print_event (name, "B", pid, tid, ts + e->arg / 1e3, "");
+          if (track)
+            track->running = 1;
+          break;
+        case TRACE_REAP:
+          if (!track || !track->running)
+            break;
+          snprintf (extra, sizeof (extra), "\"args\": {\"status\": \"%s\"}",
+                    status_name (e->arg));
+          print_event ("run", "E", pid, tid, ts, extra);
+          track->running = 0;
+          break;
+        case TRACE_RESPAWN:
+          if (e->arg > 0)
+            {
+              snprintf (extra, sizeof (extra), "\"dur\": %lld000", e->arg);
+              print_event ("backoff", "X", pid, tid, ts, extra);
+            }
+          else
+            print_event ("respawn", "i", pid, tid, ts, "\"s\": \"t\"");
+          break;
+        case TRACE_RELOAD:
+          snprintf (extra, sizeof (extra), "\"dur\": %.3f", e->arg / 1e3);
+          print_event ("reload", "X", pid, tid, ts, extra);
+          break;
+        case TRACE_UPGRADE:
+          snprintf (extra, sizeof (extra), "\"dur\": %.3f", e->arg / 1e3);
+          print_event ("upgrade", "X", pid, tid, ts, extra);
+          break;
+        case TRACE_DEFER:
+          break;
+        case TRACE_ADMIT:
+          /* the wait, ending here. */
+          snprintf (extra, sizeof (extra), "\"dur\": %.3f", e->arg / 1e3);
+          print_event ("queued", "X", pid, tid, ts - e->arg / 1e3, extra);
+          break;
+        case TRACE_SIGNAL:
+        case TRACE_RECEIVED:
+          snprintf (name, sizeof (name), "%s %s", types[e->type],
+                    signal_name (e->arg));
+          print_event (name, "i", pid, tid, ts, "\"s\": \"t\"");
+          break;
+        case TRACE_PIPE_OPEN:
+          snprintf (extra, sizeof (extra), "\"cat\": \"pipe\", \"id\": %d",
+                    tid);
+          print_event ("pipe", "b", pid, tid, ts, extra);
+          break;
+        case TRACE_PIPE_CLOSE:
+          snprintf (extra, sizeof (extra), "\"cat\": \"pipe\", \"id\": %d, "
+                    "\"args\": {\"bytes\": %lld}", tid, e->arg);
+          print_event ("pipe", "e", pid, tid, ts, extra);
+          break;
+        case TRACE_SPAWN_FAILED:
+          snprintf (extra, sizeof (extra),
+                    "\"s\": \"t\", \"args\": {\"error\": \"%s\"}",
+                    strerror (e->arg));
+          print_event ("spawn-failed", "i", pid, tid, ts, extra);
+          break;
+        case TRACE_DROPPED:
+          snprintf (name, sizeof (name), "dropped %lld events", e->arg);
+          print_event (name, "i", pid, tid, ts, "\"s\": \"g\"");
+          break;
+        default:
+          if (e->type < TRACE_TYPES)
+            print_event (types[e->type], "i", pid, tid, ts, "\"s\": \"t\"");
+          break;
+        }
+    }
+
+  printf ("\n]}\n");
+}
+
+static TraceRing *bench_ring;
+static int        bench_fd;
+static int        bench_stop;
+static long long  bench_flushed;
+
+/* the flush thread of procman. */
+static void *
+bench_writer (void *data)
+{
+  long long n;
+
+  while (!__atomic_load_n (&bench_stop, __ATOMIC_ACQUIRE))
+    {
+      usleep (50000);
+      n = trace_flush (bench_ring, bench_fd);
+      if (n > 0)
+        bench_flushed += n;
+    }
+  n = trace_flush (bench_ring, bench_fd);
+  if (n > 0)
+    bench_flushed += n;
+
+  return NULL;
+}
+
+static long long
+cpu_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 'count' events at 'rate' per second, as fast as possible if 0. */
+static void
+bench_put (long long count,
+           long long rate)
+{
+  unsigned long long lost;
+  long long          start;
+  long long          elapsed;
+  long long          cpu;
+  long long          i;
+
+  lost = bench_ring->lost + bench_ring->dropped;
+  cpu = cpu_ns ();
+  start = trace_now ();
+  for (i = 0; i < count; i++)
+    {
+      trace_put (bench_ring, TRACE_REAP, "bench", i, 0, 0);
+
+      /* in steps of a millisecond, like a busy event loop. */
+      if (rate && !(i % (rate / 1000 + 1)))
+        {
+          elapsed = trace_now () - start;
+          if (elapsed < i * 1000000000LL / rate)
+            usleep ((i * 1000000000LL / rate - elapsed) / 1000);
+        }
+    }
+  elapsed = trace_now () - start;
+  cpu = cpu_ns () - cpu;
+
+  printf ("%lld events %s: %.1f ns/event, %.0f events/s, %llu dropped",
+          count, rate ? "paced" : "at full speed",
+          rate ? (double) cpu / count : (double) elapsed / count,
+          count * 1e9 / elapsed,
+          bench_ring->lost + bench_ring->dropped - lost);
+  printf (rate ? " (cpu of both threads)\n" : "\n");
+}
+
+/*
+ * Put 'count' events as fast as possible, then at 'rate' per second,
+ * while a thread flushes them to a file like in procman.
+ */
+static int
+bench_trace (long long count,
+             long long rate)
+{
+  pthread_t thread;
+  char      file[] = "/tmp/proctrace.XXXXXX";
+
+  bench_ring = mmap (NULL, sizeof (TraceRing), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bench_fd = mkstemp (file);
+  if (bench_ring == MAP_FAILED || bench_fd < 0)
+    {
+      MSG ("failed to set up the bench: %s\n", STRERROR);
+      return -1;
+    }
+  unlink (file);
+  if (pthread_create (&thread, NULL, bench_writer, NULL))
+    {
+      MSG ("failed to start the flush thread\n");
+      return -1;
+    }
+
+  bench_put (count, 0);
+  if (rate > 0)
+    {
+      /* from an empty ring again. */
+      while (__atomic_load_n (&bench_ring->tail, __ATOMIC_ACQUIRE)
+             != bench_ring->head)
+        usleep (1000);
+      bench_put (count, rate);
+    }
+
+  __atomic_store_n (&bench_stop, 1, __ATOMIC_RELEASE);
+  pthread_join (thread, NULL);
+  printf ("flushed %lld events, %lld bytes\n", bench_flushed,
+          bench_flushed * (long long) sizeof (TraceEvent));
+  close (bench_fd);
+
+  return 0;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  const TraceHeader *header;
+  const TraceEvent  *events;
+  size_t             count;
+  long long          bench = 0;
+  long long          rate = 100000;
+  int                dump = 0;
+  int                opt;
+
+  while ((opt = getopt (argc, argv, "B:dr:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'B':
+          bench = atoll (optarg);
+          break;
+        case 'd':
+          dump = 1;
+          break;
+        case 'r':
+          rate = atoll (optarg);
+          break;
+        default:
+          optind = argc + 1;
+          break;
+        }
+    }
+
+  if (bench > 0)
+    return bench_trace (bench, rate) ? 1 : 0;
+
+  if (optind != argc - 1)
+    {
+      MSG ("usage: %s [-d] trace-file\n"
+           "       %s -B events [-r events/s]\n", argv[0], argv[0]);
+      return 1;
+    }
+
+  events = map_trace (argv[optind], &header, &count);
+  if (!events)
+    return 1;
+
+  if (dump)
+    dump_trace (header, events, count);
+  else
+    convert_trace (header, events, count);
+
+  return 0;
+}
@@ -2,17 +2,640 @@
  * OS Assignment #1 Test Task.
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "zygote.h"
 
 #define MSG(x...) fprintf (stderr, x)
 
 static char        *name = "Task";
 static volatile int looping;
 
+/*
+ * "'name' cpus 0-3 nice 5 sched batch ioprio be/7", as procman placed us,
+ * and " replica 2/8" if started by replicas=.
+ */
+static void
+print_placement (void)
+{
+  static const char *classes[] = { "none", "rt", "be", "idle" };
+  cpu_set_t set;
+  char      cpus[256];
+  char      replica[64];
+  int       policy;
+  int       ioprio;
+  int       len;
+  int       i;
+
+  cpus[0] = '\0';
+  len = 0;
+  if (!sched_getaffinity (0, sizeof (set), &set))
+    for (i = 0; i < CPU_SETSIZE && len < sizeof (cpus) - 16; i++)
+      {
+	int j;
+
+	if (!CPU_ISSET (i, &set))
+	  continue;
+	for (j = i; j + 1 < CPU_SETSIZE && CPU_ISSET (j + 1, &set); j++)
+	  ;
+	if (j > i)
+	  len += snprintf (cpus + len, sizeof (cpus) - len, "%s%d-%d",
+			   len ? "," : "", i, j);
+	else
+	  len += snprintf (cpus + len, sizeof (cpus) - len, "%s%d",
+			   len ? "," : "", i);
+	i = j;
+      }
+
+  policy = sched_getscheduler (0);
+  ioprio = syscall (SYS_ioprio_get, 1, 0);
+  if (ioprio < 0)
+    ioprio = 0;
+
+  replica[0] = '\0';
+  if (getenv ("REPLICA") && getenv ("REPLICAS"))
+    snprintf (replica, sizeof (replica), " replica %.16s/%.16s",
+	      getenv ("REPLICA"), getenv ("REPLICAS"));
+
+  MSG ("'%s' cpus %s nice %d sched %s ioprio %s/%d%s\n", name, cpus,
+       getpriority (PRIO_PROCESS, 0),
+       policy == SCHED_BATCH ? "batch" : policy == SCHED_IDLE ? "idle" : "other",
+       classes[(ioprio >> 13) & 3], ioprio & 0x1fff, replica);
+}
+
+/* one second of 'rate' lines on stdout, in bursts every 10 ms. */
+static void
+write_lines (int rate)
+{
+  static long long line;
+  struct timespec  next;
+  int              i;
+  int              j;
+
+  clock_gettime (CLOCK_MONOTONIC, &next);
+  for (i = 0; i < 100 && looping; i++)
+    {
+      for (j = rate * i / 100; j < rate * (i + 1) / 100; j++)
+	printf ("'%s' line %lld\n", name, line++);
+      fflush (stdout);
+
+      next.tv_nsec += 10000000;
+      if (next.tv_nsec >= 1000000000)
+	{
+	  next.tv_sec++;
+	  next.tv_nsec -= 1000000000;
+	}
+      clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+}
+
+static long long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long
+cpu_ns (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+/* "64m", "1g", "4096", or -1. */
+static long long
+parse_size (const char *str,
+	    char      **end)
+{
+  long long size;
+
+  size = strtoll (str, end, 10);
+  if (*end == str || size < 0)
+    return -1;
+  switch (**end)
+    {
+    case 'k': case 'K': size <<= 10; (*end)++; break;
+    case 'm': case 'M': size <<= 20; (*end)++; break;
+    case 'g': case 'G': size <<= 30; (*end)++; break;
+    }
+
+  return size;
+}
+
+/* xorshift, for the data of -W and the pages of -m rand. */
+static unsigned long long
+next_random (void)
+{
+  static unsigned long long x = 0x9e3779b97f4a7c15ULL;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+
+  return x;
+}
+
+/* one second of busy loops for 'duty' percent of every 10 ms. */
+static void
+burn_cpu (int duty)
+{
+  struct timespec next;
+  long long       busy;
+  int             i;
+
+  clock_gettime (CLOCK_MONOTONIC, &next);
+  for (i = 0; i < 100 && looping; i++)
+    {
+      busy = now_ns () + duty * 100000LL;
+      while (now_ns () < busy)
+	;
+
+      next.tv_nsec += 10000000;
+      if (next.tv_nsec >= 1000000000)
+	{
+	  next.tv_sec++;
+	  next.tv_nsec -= 1000000000;
+	}
+      clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+}
+
+/*
+ * -I: the startup work before being ready, 'msec' of cpu on a table the
+ * children of a zygote inherit already built.
+ */
+static unsigned long long init_table[64 * 1024];
+
+static void
+initialise (int msec)
+{
+  long long end;
+  int       i;
+
+  end = cpu_ns () + msec * 1000000LL;
+  while (cpu_ns () < end)
+    for (i = 0; i < 64 * 1024; i++)
+      init_table[i] += next_random ();
+}
+
+/*
+ * -m: 'once' touches every page at start, 'seq' again every second,
+ * 'rand' as many random pages every second, 'grow' a tenth more of them
+ * every second.
+ */
+typedef enum
+{
+  TOUCH_ONCE,
+  TOUCH_SEQ,
+  TOUCH_RAND,
+  TOUCH_GROW,
+} Touch;
+
+static char      *memory;
+static long long  memory_pages;
+static long long  memory_grown;
+static long long  touched;
+static Touch      touch;
+
+static int
+alloc_memory (long long size)
+{
+  memory_pages = (size + 4095) / 4096;
+  memory = mmap (NULL, memory_pages * 4096, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED)
+    {
+      MSG ("'%s' failed to allocate %lld bytes: %s\n", name, size,
+	   strerror (errno));
+      memory = NULL;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* a second worth of the -m pattern, or the start of it if 'start'. */
+static void
+touch_memory (int start)
+{
+  long long first = 0;
+  long long count = memory_pages;
+  long long i;
+
+  switch (touch)
+    {
+    case TOUCH_ONCE:
+      if (!start)
+	return;
+      break;
+    case TOUCH_SEQ:
+      break;
+    case TOUCH_RAND:
+      for (i = 0; i < memory_pages; i++)
+	memory[(next_random () % memory_pages) * 4096]++;
+      touched += memory_pages;
+      return;
+    case TOUCH_GROW:
+      first = memory_grown;
+      count = (memory_pages + 9) / 10;
+      if (count > memory_pages - first)
+	count = memory_pages - first;
+      memory_grown += count;
+      break;
+    }
+
+  for (i = first; i < first + count; i++)
+    memory[i * 4096]++;
+  touched += count;
+}
+
+/* Fletcher-like over 64-bit words, the same however the data is split. */
+typedef struct _Checksum Checksum;
+struct _Checksum
+{
+  unsigned long long a;
+  unsigned long long b;
+  unsigned long long word;
+  int                fill;
+};
+
+static void
+checksum_add (Checksum            *sum,
+	      const unsigned char *buf,
+	      size_t               len)
+{
+  unsigned long long word;
+  size_t             i = 0;
+
+  /* a word split by the last read. */
+  while (sum->fill && i < len)
+    {
+      sum->word |= (unsigned long long) buf[i++] << (8 * sum->fill);
+      if (++sum->fill == 8)
+	{
+	  sum->a += sum->word;
+	  sum->b += sum->a;
+	  sum->word = 0;
+	  sum->fill = 0;
+	}
+    }
+  for (; i + 8 <= len; i += 8)
+    {
+      memcpy (&word, buf + i, 8);
+      sum->a += word;
+      sum->b += sum->a;
+    }
+  for (; i < len; i++)
+    sum->word |= (unsigned long long) buf[i] << (8 * sum->fill++);
+}
+
+static unsigned long long
+checksum_end (Checksum *sum)
+{
+  if (sum->fill)
+    {
+      sum->a += sum->word;
+      sum->b += sum->a;
+    }
+
+  return sum->b ^ (sum->a * 0x9e3779b97f4a7c15ULL);
+}
+
+/* -W: 'size' bytes of random data on stdout. */
+static void
+write_data (long long size)
+{
+  static unsigned long long buf[8192];
+  Checksum                  sum;
+  long long                 total = 0;
+  long long                 start;
+  ssize_t                   len;
+  size_t                    i;
+
+  memset (&sum, 0x00, sizeof (sum));
+  start = now_ns ();
+  while (looping && total < size)
+    {
+      for (i = 0; i < sizeof (buf) / 8; i++)
+	buf[i] = next_random ();
+      len = sizeof (buf);
+      if (len > size - total)
+	len = size - total;
+      len = write (1, buf, len);
+      if (len <= 0)
+	{
+	  if (len < 0 && errno == EINTR)
+	    continue;
+	  MSG ("'%s' failed to write: %s\n", name,
+	       len ? strerror (errno) : "EOF");
+	  break;
+	}
+      checksum_add (&sum, (unsigned char *) buf, len);
+      total += len;
+    }
+  start = now_ns () - start;
+
+  MSG ("'%s' wrote %lld bytes in %.3f s, %.1f MB/s, checksum %016llx\n",
+       name, total, start / 1e9, start ? total * 1e3 / start : 0.0,
+       checksum_end (&sum));
+}
+
+/* -R and -c: stdin until EOF, copied to stdout if 'copy'. */
+static void
+read_data (int copy)
+{
+  static char buf[65536];
+  Checksum    sum;
+  long long   total = 0;
+  long long   start;
+  ssize_t     len;
+
+  memset (&sum, 0x00, sizeof (sum));
+  start = now_ns ();
+  while ((len = read (0, buf, sizeof (buf))) != 0)
+    {
+      if (len < 0)
+	{
+	  if (errno == EINTR && looping)
+	    continue;
+	  break;
+	}
+      if (copy && write (1, buf, len) != len)
+	break;
+      checksum_add (&sum, (unsigned char *) buf, len);
+      total += len;
+    }
+  start = now_ns () - start;
+
+  MSG ("'%s' %s %lld bytes in %.3f s, %.1f MB/s, checksum %016llx\n",
+       name, copy ? "copied" : "read", total, start / 1e9,
+       start ? total * 1e3 / start : 0.0, checksum_end (&sum));
+}
+
+/* answer "name pid" on the sockets procman passed from fd 3 on. */
+static void
+serve_listeners (void)
+{
+  struct pollfd fds[8];
+  char          msg[256];
+  long long     served = 0;
+  int           n = 0;
+  int           len;
+  int           i;
+
+  if (getenv ("LISTEN_FDS"))
+    n = atoi (getenv ("LISTEN_FDS"));
+  if (n <= 0 || n > 8)
+    {
+      MSG ("'%s' got no sockets to serve\n", name);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      fds[i].fd = 3 + i;
+      fds[i].events = POLLIN;
+    }
+  len = snprintf (msg, sizeof (msg), "%s %d\n", name, getpid ());
+
+  while (looping)
+    {
+      if (poll (fds, n, -1) < 0)
+	continue;
+      for (i = 0; i < n; i++)
+	if (fds[i].revents & POLLIN)
+	  {
+	    int fd;
+
+	    fd = accept4 (fds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+	    if (fd < 0)
+	      continue;
+	    write (fd, msg, len);
+	    close (fd);
+	    served++;
+	  }
+    }
+
+  MSG ("'%s' served %lld connections\n", name, served);
+}
+
+/*
+ * Connect to 'addr' ('host:port', or a unix socket path) for 'seconds',
+ * one connection after the other, and count the replies, the instances
+ * which sent them and the failures.
+ */
+static void
+knock (const char *addr,
+       int         seconds)
+{
+  struct sockaddr_un sun;
+  struct sockaddr_in sin;
+  struct sockaddr   *sa;
+  socklen_t          sa_len;
+  char               last[256];
+  long long          end;
+  long long          start;
+  long long          worst = 0;
+  long long          replies = 0;
+  long long          errors = 0;
+  int                instances = 0;
+
+  memset (&sun, 0x00, sizeof (sun));
+  memset (&sin, 0x00, sizeof (sin));
+  if (strchr (addr, '/'))
+    {
+      sun.sun_family = AF_UNIX;
+      snprintf (sun.sun_path, sizeof (sun.sun_path), "%s", addr);
+      sa = (struct sockaddr *) &sun;
+      sa_len = sizeof (sun);
+    }
+  else
+    {
+      char        host[64];
+      const char *port;
+
+      port = strrchr (addr, ':');
+      snprintf (host, sizeof (host), "%.*s",
+		port ? (int) (port - addr) : 0, addr);
+      sin.sin_family = AF_INET;
+      sin.sin_port = htons (atoi (port ? port + 1 : addr));
+      if (inet_pton (AF_INET, port ? host : "127.0.0.1", &sin.sin_addr) != 1)
+	{
+	  MSG ("'%s' invalid address '%s'\n", name, addr);
+	  return;
+	}
+      sa = (struct sockaddr *) &sin;
+      sa_len = sizeof (sin);
+    }
+
+  last[0] = '\0';
+  end = now_ms () + seconds * 1000LL;
+  while (looping && now_ms () < end)
+    {
+      char    buf[256];
+      ssize_t len;
+      int     fd;
+
+      start = now_ms ();
+      fd = socket (sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0 || connect (fd, sa, sa_len))
+	{
+	  if (errors++ == 0)
+	    MSG ("'%s' failed to connect: %s\n", name, strerror (errno));
+	  if (fd >= 0)
+	    close (fd);
+	  usleep (1000);
+	  continue;
+	}
+      len = read (fd, buf, sizeof (buf) - 1);
+      close (fd);
+      if (len <= 0)
+	{
+	  errors++;
+	  continue;
+	}
+      buf[len] = '\0';
+      replies++;
+      if (strcmp (buf, last))
+	{
+	  instances++;
+	  strcpy (last, buf);
+	}
+      if (worst < now_ms () - start)
+	worst = now_ms () - start;
+    }
+
+  MSG ("'%s' %lld replies from %d instances, %lld errors, max %lld ms\n",
+       name, replies, instances, errors, worst);
+}
+
+/* -f: every process of the tree runs the main loop. */
+static int        tree_level;           /* 0 in the root */
+static pid_t      tree_children[64];
+static int        tree_count;
+static long long *tree_size;            /* shared, processes forked */
+
+/* 'width' children, each of which forks its own down to 'depth' levels. */
+static void
+fork_tree (int depth,
+	   int width)
+{
+  pid_t pid = 0;
+  int   level;
+  int   i;
+
+  tree_size = mmap (NULL, sizeof (long long), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (tree_size == MAP_FAILED)
+    {
+      MSG ("'%s' failed to map the tree size: %s\n", name, strerror (errno));
+      tree_size = NULL;
+      return;
+    }
+
+  for (level = 0; level < depth; level++)
+    {
+      for (i = 0; i < width; i++)
+	{
+	  pid = fork ();
+	  if (pid == 0)
+	    break;
+	  if (pid < 0)
+	    {
+	      MSG ("'%s' failed to fork: %s\n", name, strerror (errno));
+	      return;
+	    }
+	  tree_children[tree_count++] = pid;
+	}
+      if (pid != 0)
+	return;
+
+      /* a new child, which forks the next level. */
+      __atomic_add_fetch (tree_size, 1, __ATOMIC_RELAXED);
+      tree_level = level + 1;
+      tree_count = 0;
+    }
+}
+
+/* down the tree, so every level waits for its own children. */
+static void
+stop_tree (void)
+{
+  int i;
+
+  for (i = 0; i < tree_count; i++)
+    kill (tree_children[i], SIGTERM);
+  for (i = 0; i < tree_count; i++)
+    waitpid (tree_children[i], NULL, 0);
+}
+
+/* -e: an exit code, or 'segv', 'abort' or 'kill' to crash. */
+static int
+check_exit (const char *how)
+{
+  const char *p;
+
+  if (!strcmp (how, "segv") || !strcmp (how, "abort")
+      || !strcmp (how, "kill"))
+    return 0;
+  for (p = how; *p >= '0' && *p <= '9'; p++)
+    ;
+
+  return p == how || *p != '\0' || atoi (how) > 255 ? -1 : 0;
+}
+
+static void
+exit_with (const char *how)
+{
+  static int *volatile nowhere;
+
+  MSG ("'%s' exits with %s\n", name, how);
+  if (!strcmp (how, "segv"))
+    *nowhere = 1;
+  else if (!strcmp (how, "abort"))
+    abort ();
+  else if (!strcmp (how, "kill"))
+    raise (SIGKILL);
+
+  exit (atoi (how));
+}
+
 static void
 signal_handler (int signo)
 {
@@ -20,22 +643,46 @@ signal_handler (int signo)
     return;
 
   looping = 0;
-  MSG ("'%s' terminated by SIGNAL(%d)\n", name, signo);
+  if (tree_level == 0)
+    MSG ("'%s' terminated by SIGNAL(%d)\n", name, signo);
 }
 
 int
 main (int    argc,
       char **argv)
 {
-  int   timeout    = 0;
-  int   read_stdin = 0;
-  char *msg_stdout = NULL;
+  long long  main_time;
+  long long  memory_size = 0;
+  long long  write_size  = -1;
+  long long  loop_time;
+  long long  loop_cpu;
+  int        timeout     = 0;
+  int        read_stdin  = 0;
+  int        copy_stdin  = 0;
+  int        placement   = 0;
+  int        log_rate    = 0;
+  int        ignore      = 0;
+  int        serve       = 0;
+  int        tell_exit   = 0;
+  int        notify_fd   = -1;
+  int        duty        = 0;
+  int        read_all    = 0;
+  int        tree_depth  = 0;
+  int        tree_width  = 2;
+  int        startup     = 0;
+  int        init_time   = 0;
+  char      *knock_addr  = NULL;
+  char      *msg_stdout  = NULL;
+  char      *exit_how    = NULL;
+
+  main_time = now_ns ();
 
   /* Parse command line arguments. */
   {
-    int opt;
+    char *end;
+    int   opt;
 
-    while ((opt = getopt (argc, argv, "n:t:w:r")) != -1)
+    while ((opt = getopt (argc, argv, "n:t:w:rcpo:iak:xu:m:W:Rf:e:lI:")) != -1)
       {
 	switch (opt)
 	  {
@@ -51,20 +698,143 @@ main (int    argc,
 	  case 'w':
 	    msg_stdout = optarg;
 	    break;
+	  case 'c':
+	    copy_stdin = 1;
+	    break;
+	  case 'p':
+	    placement = 1;
+	    break;
+	  case 'o':
+	    log_rate = atoi (optarg);
+	    break;
+	  case 'i':
+	    ignore = 1;
+	    break;
+	  case 'a':
+	    serve = 1;
+	    break;
+	  case 'k':
+	    knock_addr = optarg;
+	    break;
+	  case 'x':
+	    tell_exit = 1;
+	    break;
+	  case 'u':
+	    duty = atoi (optarg);
+	    if (duty < 1 || duty > 100)
+	      optind = -1;
+	    break;
+	  case 'm':
+	    memory_size = parse_size (optarg, &end);
+	    if (*end == ',')
+	      end++;
+	    if (!strcmp (end, "seq"))
+	      touch = TOUCH_SEQ;
+	    else if (!strcmp (end, "rand"))
+	      touch = TOUCH_RAND;
+	    else if (!strcmp (end, "grow"))
+	      touch = TOUCH_GROW;
+	    else if (*end != '\0' && strcmp (end, "once"))
+	      optind = -1;
+	    if (memory_size <= 0)
+	      optind = -1;
+	    break;
+	  case 'W':
+	    write_size = parse_size (optarg, &end);
+	    if (write_size < 0 || *end != '\0')
+	      optind = -1;
+	    break;
+	  case 'R':
+	    read_all = 1;
+	    break;
+	  case 'f':
+	    tree_depth = strtol (optarg, &end, 10);
+	    if (*end == ',')
+	      tree_width = strtol (end + 1, &end, 10);
+	    if (tree_depth < 1 || tree_width < 1 || tree_width > 64 || *end)
+	      optind = -1;
+	    break;
+	  case 'e':
+	    exit_how = optarg;
+	    if (check_exit (exit_how))
+	      optind = -1;
+	    break;
+	  case 'l':
+	    startup = 1;
+	    break;
+	  case 'I':
+	    init_time = atoi (optarg);
+	    if (init_time < 1)
+	      optind = -1;
+	    break;
 	  default:
-	    MSG ("usage: %s [-n name] [-t timeout] [-r] [-w msg]\n", argv[0]);
-	    return -1;
+	    optind = -1;
+	    break;
 	  }
+	if (optind < 0)
+	  break;
+      }
+    if (optind < 0)
+      {
+	MSG ("usage: %s [-n name] [-t timeout] [-r] [-w msg] [-c] [-p] [-o lines/s] [-i] [-a] [-k addr] [-x]\n"
+	     "       [-u duty%%] [-m size[,once|seq|rand|grow]] [-W size] [-R] [-f depth[,width]]\n"
+	     "       [-e code|segv|abort|kill] [-l] [-I msec]\n", argv[0]);
+	return -1;
       }
   }
 
+  /* -l, once more through exec, timed from just before it. */
+  if (startup)
+    {
+      char *exec_time;
+
+      exec_time = getenv ("TASK_EXEC_NS");
+      if (!exec_time)
+	{
+	  char value[32];
+
+	  snprintf (value, sizeof (value), "%lld", now_ns ());
+	  setenv ("TASK_EXEC_NS", value, 1);
+	  execv ("/proc/self/exe", argv);
+	  MSG ("'%s' failed to exec itself: %s\n", name, strerror (errno));
+	}
+      else
+	{
+	  MSG ("'%s' exec to main %.1f us\n", name,
+	       (main_time - atoll (exec_time)) / 1e3);
+	  unsetenv ("TASK_EXEC_NS");
+	}
+    }
+
+  if (init_time > 0)
+    initialise (init_time);
+
+  /* A zygote forks its children from here, initialised already. */
+  if (getenv ("ZYGOTE_FD"))
+    {
+      int   sock;
+      pid_t zygote;
+
+      sock = atoi (getenv ("ZYGOTE_FD"));
+      unsetenv ("ZYGOTE_FD");
+      zygote = getpid ();
+      MSG ("'%s' zygote ready in %.1f ms\n", name, (now_ns () - main_time) / 1e6);
+      if (zygote_serve (sock))
+	{
+	  MSG ("'%s' failed to serve as zygote: %s\n", name, strerror (errno));
+	  return -1;
+	}
+      MSG ("'%s' forked by zygote %d\n", name, zygote);
+    }
+
   /* Register SIGINT / SIGTERM signal handler. */
   {
     struct sigaction sa;
     
     sigemptyset (&sa.sa_mask);
     sa.sa_flags = 0;
-    sa.sa_handler = signal_handler;
+    /* -i to be killed at shutdown. */
+    sa.sa_handler = ignore ? SIG_IGN : signal_handler;
     if (sigaction (SIGINT, &sa, NULL))
       {
 	MSG ("'%s' failed to register signal handler for SIGINT\n", name);
@@ -73,7 +843,7 @@ main (int    argc,
 
     sigemptyset (&sa.sa_mask);
     sa.sa_flags = 0;
-    sa.sa_handler = signal_handler;
+    sa.sa_handler = ignore ? SIG_IGN : signal_handler;
     if (sigaction (SIGTERM, &sa, NULL))
       {
 	MSG ("'%s' failed to register signal handler for SIGTERM\n", name);
@@ -83,8 +853,20 @@ main (int    argc,
 
   MSG ("'%s' start (timeout %d)\n", name, timeout);
 
+  if (placement)
+    print_placement ();
+
   looping = 1;
 
+  /* Tell procman that we are ready, if it asked for it. */
+  if (getenv ("NOTIFY_FD"))
+    {
+      notify_fd = atoi (getenv ("NOTIFY_FD"));
+      write (notify_fd, "READY=1\n", 8);
+      if (!tell_exit)
+	close (notify_fd);
+    }
+
   /* Write the message to standard outout. */
   if (msg_stdout)
     {
@@ -108,16 +890,88 @@ main (int    argc,
 	}
     }
 
+  /* Copy standard input to standard output until EOF, or write and read. */
+  if (write_size >= 0)
+    write_data (write_size);
+  if (copy_stdin || read_all)
+    read_data (copy_stdin);
+
+  /* Serve the sockets from procman, or load them. */
+  if (serve)
+    serve_listeners ();
+  if (knock_addr)
+    {
+      knock (knock_addr, timeout);
+      timeout = 0;
+    }
+
+  /* the whole tree loops, with its own memory. */
+  if (tree_depth > 0)
+    {
+      fork_tree (tree_depth, tree_width);
+      if (tree_level > 0 && notify_fd >= 0)
+	close (notify_fd);
+    }
+  if (memory_size > 0 && !alloc_memory (memory_size))
+    touch_memory (1);
+
   /* Loop */
+  loop_time = now_ns ();
+  loop_cpu = cpu_ns ();
   while (looping && timeout != 0)
     {
       if (0) MSG ("'%s' timeout %d\n", name, timeout);
-      usleep (1000000);
+      if (memory)
+	touch_memory (0);
+      if (log_rate > 0)
+	write_lines (log_rate);
+      else if (duty > 0)
+	burn_cpu (duty);
+      else
+	usleep (1000000);
       if (timeout > 0)
 	timeout--;
     }
+  loop_time = now_ns () - loop_time;
+  loop_cpu = cpu_ns () - loop_cpu;
+
+  stop_tree ();
+  if (tree_level > 0)
+    _exit (0);
 
   MSG ("'%s' end\n", name);
 
+  if (duty > 0)
+    MSG ("'%s' burned %.3f s cpu in %.3f s, %.1f%% duty (target %d%%)\n",
+	 name, loop_cpu / 1e9, loop_time / 1e9,
+	 loop_time ? loop_cpu * 100.0 / loop_time : 0.0, duty);
+  if (memory)
+    {
+      struct rusage usage;
+
+      getrusage (RUSAGE_SELF, &usage);
+      MSG ("'%s' %lld page touches over %lld pages, max rss %ld kB\n", name,
+	   touched, memory_pages, usage.ru_maxrss);
+    }
+  if (tree_size)
+    MSG ("'%s' forked %lld processes, depth %d, width %d\n", name,
+	 *tree_size, tree_depth, tree_width);
+
+  /* -x, the time procman measures its exit to reap latency from. */
+  if (tell_exit && notify_fd >= 0)
+    {
+      struct timespec ts;
+      char            msg[64];
+      int             len;
+
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      len = snprintf (msg, sizeof (msg), "STOPPING=1\nMONOTONIC_USEC=%lld\n",
+		      ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+      write (notify_fd, msg, len);
+    }
+
+  if (exit_how)
+    exit_with (exit_how);
+
   return 0;
 }
@@ -0,0 +1,196 @@
+/*
+ * OS Assignment #1
+ *
+ * Event trace of procman, shared with proctrace.
+ *
+ * procman -T <file> puts supervisor events into a TraceRing which only the
+ * event loop writes and only a flush thread reads, without locks: the
+ * producer owns 'head' and the consumer 'tail', both counting events.  A
+ * full ring drops events, counted in a TRACE_DROPPED event once there is
+ * room again, so the event loop never waits for the disk.  The file is a
+ * TraceHeader followed by TraceEvents.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC   0x45435254
+#define TRACE_VERSION 1
+#define TRACE_ID_LEN  16
+#define TRACE_RING    (64 * 1024)   /* events, a power of 2 */
+
+typedef enum
+{
+  TRACE_SPAWN,                      /* arg: ns spent in spawning */
+  TRACE_SPAWN_FAILED,               /* arg: errno */
+  TRACE_READY,
+  TRACE_EXIT,                       /* as reported by the task */
+  TRACE_REAP,                       /* arg: wait status */
+  TRACE_RESPAWN,                    /* arg: ms until the respawn */
+  TRACE_QUARANTINE,
+  TRACE_SIGNAL,                     /* sent, arg: signal */
+  TRACE_RECEIVED,                   /* by procman, arg: signal */
+  TRACE_PIPE_OPEN,                  /* of the consumer */
+  TRACE_PIPE_CLOSE,                 /* arg: bytes */
+  TRACE_RELOAD,                     /* arg: ns spent */
+  TRACE_DROPPED,                    /* arg: events lost before this one */
+  TRACE_UPGRADE,                    /* from the exec, arg: ns until adopted */
+  TRACE_TIMEOUT,                    /* of a run, arg: ms */
+  TRACE_SKIP,                       /* scheduled run, the last one still runs */
+  TRACE_DEFER,                      /* spawn waits for admission, arg: priority */
+  TRACE_ADMIT,                      /* arg: ns waited */
+  TRACE_TYPES,
+} TraceType;
+
+typedef struct _TraceHeader TraceHeader;
+struct _TraceHeader
+{
+  unsigned int       magic;
+  unsigned int       version;
+  unsigned int       event_size;
+  int                pid;
+  long long          start_time;    /* CLOCK_MONOTONIC ns */
+  long long          start_realtime;
+};
+
+typedef struct _TraceEvent TraceEvent;
+struct _TraceEvent
+{
+  long long          time;          /* CLOCK_MONOTONIC ns */
+  long long          arg;
+  int                pid;
+  unsigned short     type;
+  unsigned short     reserved;
+  char               id[TRACE_ID_LEN];  /* the task, "" for procman */
+};
+
+typedef struct _TraceRing TraceRing;
+struct _TraceRing
+{
+  TraceEvent         events[TRACE_RING];
+  unsigned long long head __attribute__ ((aligned (64)));
+  unsigned long long dropped;       /* since the last TRACE_DROPPED */
+  unsigned long long lost;          /* in total */
+  unsigned long long tail __attribute__ ((aligned (64)));
+};
+
+static inline long long
+trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void
+trace_fill (TraceEvent *event,
+            int         type,
+            const char *id,
+            int         pid,
+            long long   arg,
+            long long   time)
+{
+  event->time = time;
+  event->arg = arg;
+  event->pid = pid;
+  event->type = type;
+  event->reserved = 0;
+  strncpy (event->id, id, TRACE_ID_LEN);
+}
+
+/* single producer, 'time' 0 for now.  Returns -1 if the event was dropped. */
+static inline int
+trace_put (TraceRing  *ring,
+           int         type,
+           const char *id,
+           int         pid,
+           long long   arg,
+           long long   time)
+{
+  unsigned long long head = ring->head;
+  unsigned long long used;
+
+  used = head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (used + 1 + (ring->dropped != 0) > TRACE_RING)
+    {
+      ring->dropped++;
+      return -1;
+    }
+
+  if (!time)
+    time = trace_now ();
+  if (ring->dropped)
+    {
+      trace_fill (&ring->events[head++ & (TRACE_RING - 1)], TRACE_DROPPED,
+                  "", 0, ring->dropped, time);
+      ring->lost += ring->dropped;
+      ring->dropped = 0;
+    }
+  trace_fill (&ring->events[head++ & (TRACE_RING - 1)], type, id, pid, arg,
+              time);
+  __atomic_store_n (&ring->head, head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static inline int
+trace_write_all (int         fd,
+                 const char *buf,
+                 size_t      len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = write (fd, buf, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+/* single consumer, the events written to 'fd' or -1. */
+static inline long long
+trace_flush (TraceRing *ring,
+             int        fd)
+{
+  unsigned long long head;
+  unsigned long long tail = ring->tail;
+  unsigned long long first;
+  unsigned long long n;
+
+  head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return 0;
+
+  /* up to the end of the ring, then from its start. */
+  first = tail & (TRACE_RING - 1);
+  n = head - tail;
+  if (n > TRACE_RING - first)
+    n = TRACE_RING - first;
+  if (trace_write_all (fd, (char *) &ring->events[first],
+                       n * sizeof (TraceEvent)))
+    return -1;
+  if (head - tail > n
+      && trace_write_all (fd, (char *) ring->events,
+                          (head - tail - n) * sizeof (TraceEvent)))
+    return -1;
+
+  __atomic_store_n (&ring->tail, head, __ATOMIC_RELEASE);
+
+  return head - tail;
+}
+
+#endif /* TRACE_H */
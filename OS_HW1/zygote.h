@@ -0,0 +1,279 @@
+/*
+ * OS Assignment #1
+ *
+ * Zygote protocol of procman, shared with task.
+ *
+ * procman starts the template of a zygote=yes task with ZYGOTE_FD set to
+ * its end of a SOCK_SEQPACKET socket pair.  The template initialises
+ * itself once, says hello with its pid and waits for requests.  A request
+ * carries the fds of the new child (see 'fds') as SCM_RIGHTS and the
+ * environment to add.  The template clones the child with CLONE_PARENT,
+ * so it is a child of procman which reaps and signals it like any other
+ * task, and replies with its pid or an errno.  zygote_serve() is the
+ * template side: it returns 0 in every child, and exits once procman
+ * closes the socket.
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+#define ZYGOTE_ENV_LEN 1024
+#define ZYGOTE_ID_LEN  32
+
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#define IOPRIO_WHO_PROCESS 1
+
+/* the fds of a request, in this order. */
+typedef enum
+{
+  ZYGOTE_STDIN,
+  ZYGOTE_STDOUT,
+  ZYGOTE_STDERR,
+  ZYGOTE_NOTIFY,
+  ZYGOTE_CGROUP,                    /* the leaf to clone into */
+  ZYGOTE_FDS,
+
+} ZygoteFd;
+
+typedef enum
+{
+  PLACE_SET_CPUS   = 1 << 0,
+  PLACE_SET_NODES  = 1 << 1,
+  PLACE_SET_NICE   = 1 << 2,
+  PLACE_SET_IOPRIO = 1 << 3,
+  PLACE_SET_SCHED  = 1 << 4,
+
+} PlacementSet;
+
+/* where a child runs, applied by the child itself before it does a thing. */
+typedef struct _Placement Placement;
+struct _Placement
+{
+  unsigned int       set;           /* PlacementSet */
+  cpu_set_t          cpus;
+  cpu_set_t          nodes;         /* a nodemask is a bitmask of longs too */
+  int                nice;
+  int                ioprio;
+  int                policy;
+};
+
+typedef struct _ZygoteRequest ZygoteRequest;
+struct _ZygoteRequest
+{
+  char               id[ZYGOTE_ID_LEN];   /* of the task, for messages */
+  Placement          place;
+  unsigned int       fds;           /* a bit per ZygoteFd passed */
+  unsigned int       env_len;
+  char               env[ZYGOTE_ENV_LEN];  /* "NAME=value\0"... */
+};
+
+/* the hello has the pid of the template itself. */
+typedef struct _ZygoteReply ZygoteReply;
+struct _ZygoteReply
+{
+  int                pid;
+  int                error;
+};
+
+static inline void
+apply_placement (const Placement *place,
+                 const char      *id)
+{
+  if ((place->set & PLACE_SET_CPUS)
+      && sched_setaffinity (0, sizeof (place->cpus), &place->cpus))
+    fprintf (stderr, "failed to set cpus of task '%s': %s\n", id,
+             strerror (errno));
+
+  if ((place->set & PLACE_SET_NODES)
+      && syscall (SYS_set_mempolicy, MPOL_BIND, &place->nodes, CPU_SETSIZE))
+    fprintf (stderr, "failed to bind task '%s' to nodes: %s\n", id,
+             strerror (errno));
+
+  if ((place->set & PLACE_SET_NICE)
+      && setpriority (PRIO_PROCESS, 0, place->nice))
+    fprintf (stderr, "failed to set nice of task '%s': %s\n", id,
+             strerror (errno));
+
+  if ((place->set & PLACE_SET_IOPRIO)
+      && syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, place->ioprio))
+    fprintf (stderr, "failed to set ioprio of task '%s': %s\n", id,
+             strerror (errno));
+
+  if (place->set & PLACE_SET_SCHED)
+    {
+      struct sched_param param;
+
+      memset (&param, 0x00, sizeof (param));
+      if (sched_setscheduler (0, place->policy, &param))
+        fprintf (stderr, "failed to set sched of task '%s': %s\n", id,
+                 strerror (errno));
+    }
+}
+
+/* fork() with procman as the parent, right into 'cgroup' if not -1. */
+static inline pid_t
+zygote_clone (int cgroup)
+{
+  struct clone_args args;
+  pid_t             pid;
+
+  memset (&args, 0x00, sizeof (args));
+  args.flags = CLONE_PARENT;
+  if (cgroup >= 0)
+    {
+      args.flags |= CLONE_INTO_CGROUP;
+      args.cgroup = cgroup;
+    }
+  args.exit_signal = SIGCHLD;
+
+  pid = syscall (SYS_clone3, &args, sizeof (args));
+  if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+    return pid;
+
+  pid = syscall (SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+  if (pid == 0 && cgroup >= 0)
+    {
+      int fd;
+
+      fd = openat (cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+      if (fd < 0 || write (fd, "0", 1) != 1)
+        fprintf (stderr, "failed to move into cgroup: %s\n", strerror (errno));
+      if (fd >= 0)
+        close (fd);
+    }
+
+  return pid;
+}
+
+/* in the child, take over the fds and the environment of 'request'. */
+static inline void
+zygote_child (const ZygoteRequest *request,
+              int                 *fds)
+{
+  const char *p;
+  int         i;
+
+  for (i = ZYGOTE_STDIN; i <= ZYGOTE_STDERR; i++)
+    if (fds[i] >= 0)
+      {
+        dup2 (fds[i], i);
+        close (fds[i]);
+      }
+  if (fds[ZYGOTE_NOTIFY] >= 0)
+    {
+      char value[16];
+
+      fcntl (fds[ZYGOTE_NOTIFY], F_SETFD, 0);
+      snprintf (value, sizeof (value), "%d", fds[ZYGOTE_NOTIFY]);
+      setenv ("NOTIFY_FD", value, 1);
+    }
+  if (fds[ZYGOTE_CGROUP] >= 0)
+    close (fds[ZYGOTE_CGROUP]);
+  apply_placement (&request->place, request->id);
+
+  for (p = request->env; p < request->env + request->env_len;
+       p += strlen (p) + 1)
+    if (strchr (p, '='))
+      putenv (strdup (p));
+}
+
+/*
+ * Serve procman on 'sock' from ZYGOTE_FD.  Returns 0 in each child, -1 if
+ * the hello fails, and exits when procman goes away.
+ */
+static inline int
+zygote_serve (int sock)
+{
+  ZygoteReply reply;
+
+  fcntl (sock, F_SETFD, FD_CLOEXEC);
+  reply.pid = getpid ();
+  reply.error = 0;
+  if (send (sock, &reply, sizeof (reply), MSG_NOSIGNAL) < 0)
+    return -1;
+
+  for (;;)
+    {
+      ZygoteRequest   request;
+      struct msghdr   msg;
+      struct iovec    iov;
+      struct cmsghdr *cmsg;
+      union
+      {
+        struct cmsghdr header;
+        char           buf[CMSG_SPACE (ZYGOTE_FDS * sizeof (int))];
+      } control;
+      int             received[ZYGOTE_FDS];
+      int             fds[ZYGOTE_FDS];
+      int             count;
+      ssize_t         len;
+      pid_t           pid;
+      int             i;
+      int             j;
+
+      memset (&msg, 0x00, sizeof (msg));
+      iov.iov_base = &request;
+      iov.iov_len = sizeof (request);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof (control.buf);
+
+      len = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        _exit (0);
+
+      count = 0;
+      cmsg = CMSG_FIRSTHDR (&msg);
+      if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+          && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+          count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+          memcpy (received, CMSG_DATA (cmsg), count * sizeof (int));
+        }
+      for (i = 0, j = 0; i < ZYGOTE_FDS; i++)
+        fds[i] = (request.fds & (1 << i)) && j < count ? received[j++] : -1;
+      if (request.env_len > ZYGOTE_ENV_LEN)
+        request.env_len = 0;
+      request.id[ZYGOTE_ID_LEN - 1] = '\0';
+
+      pid = zygote_clone (fds[ZYGOTE_CGROUP]);
+      if (pid == 0)
+        {
+          close (sock);
+          zygote_child (&request, fds);
+          return 0;
+        }
+
+      reply.pid = pid;
+      reply.error = pid < 0 ? errno : 0;
+      for (i = 0; i < count; i++)
+        close (received[i]);
+      send (sock, &reply, sizeof (reply), MSG_NOSIGNAL);
+    }
+}
+
+#endif /* ZYGOTE_H */
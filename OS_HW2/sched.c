@@ -9,6 +9,7 @@
 #include <signal.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/wait.h>
 
 #define MSG(x...) fprintf (stderr, x)
@@ -26,6 +27,9 @@
 #define PRIORITY_MIN 1
 #define PRIORITY_MAX 10
 
+/* -l, arrive and service times in microseconds over hours and days. */
+#define TIME_MAX (1LL << 40)
+
 #define SLOT_MAX ((ARRIVE_TIME_MAX + SERVICE_TIME_MAX) * PROCESS_MAX)
 
 enum
@@ -43,15 +47,15 @@ struct _Process
   int    idx;
   int    queue_idx;
 
-  char   id[ID_MAX + 1];
-  int    arrive_time;
-  int    service_time;
-  int    priority;
+  char      id[ID_MAX + 1];
+  long long arrive_time;
+  long long service_time;
+  int       priority;
 
-  int    remain_time;
-  int    complete_time;
-  int    turnaround_time;
-  int    wait_time;
+  long long remain_time;
+  long long complete_time;
+  long long turnaround_time;
+  long long wait_time;
 };
 
 static Process  processes[PROCESS_MAX];
@@ -62,6 +66,9 @@ static int      queue_len;
 
 static char     schedule[PROCESS_MAX][SLOT_MAX];
 
+static long long arrive_time_max = ARRIVE_TIME_MAX;
+static long long service_time_max = SERVICE_TIME_MAX;
+
 static char *
 strstrip (char *str)
 {
@@ -184,9 +191,9 @@ read_config (const char *filename)
       *p = '\0';
       strstrip (s);
 
-      process.arrive_time = strtol (s, NULL, 10);
+      process.arrive_time = strtoll (s, NULL, 10);
       if (process.arrive_time < ARRIVE_TIME_MIN
-	  || ARRIVE_TIME_MAX < process.arrive_time
+	  || arrive_time_max < process.arrive_time
 	  || (process_total > 0 &&
 	      processes[process_total - 1].arrive_time > process.arrive_time))
 	{
@@ -201,9 +208,9 @@ read_config (const char *filename)
 	goto invalid_line;
       *p = '\0';
       strstrip (s);
-      process.service_time = strtol (s, NULL, 10);
+      process.service_time = strtoll (s, NULL, 10);
       if (process.service_time < SERVICE_TIME_MIN
-	  || SERVICE_TIME_MAX < process.service_time)
+	  || service_time_max < process.service_time)
 	{
 	  MSG ("invalid service-time '%s' in line %d, ignored\n", s, line_nr);
 	  continue;
@@ -232,97 +239,76 @@ read_config (const char *filename)
   return 0;
 }
 
+/* put an arrived process at the end of the queue. */
 static void
-simulate (int sched)
+arrive_process (Process *pp)
 {
-  Process *process;
-  int      p;
-  int      p_done;
-  int      cpu_time; //스케줄링 할 프로세스가 없을 때까지 걸리는 시간
-  int      sum_turnaround_time; // 프로세스 완료시간 합계
-  int      sum_waiting_time; // 프로세스 대기 시간 합계
-  float    avg_turnaround_time; // 평균
-  float    avg_waiting_time; // 평균
-
-  for (p = 0; p < PROCESS_MAX; p++)
-    {
-      int slot;
+  pp->remain_time = pp->service_time;
+  pp->queue_idx = queue_len;
 
-      for (slot = 0; slot < SLOT_MAX; slot++)
-         schedule[p][slot] = 0;
-      queue[p] = NULL;
-    }
-
-  p = 0;
-  p_done = 0;
-  queue_len = 0;
-  process = NULL;
+  queue[queue_len] = pp;
+  queue_len++;
+}
 
-  for (cpu_time = 0; p_done < process_total; cpu_time++)
+/*
+ * Pick a process according to scheduling algorithm, from the queue and
+ * the process of the time unit before.  RR moves it to the end.
+ */
+static Process *
+pick_process (int      sched,
+	      Process *process)
+{
+  switch (sched)
     {
-      /* Insert arrived process into the queue. */
-      for (; p < process_total; p++)
-	{
-	  Process *pp;
-
-	  pp = &processes[p];
-	  if (pp->arrive_time != cpu_time)
-	    break;
-	  pp->remain_time = pp->service_time;
-	  pp->queue_idx = queue_len;
-
-	  queue[queue_len] = pp;
-	  queue_len++;
-	}
-
-      /* Pick a process according to scheduling algorithm. */
-      switch (sched)
+    case SCHED_SJF:
+      if (!process)
 	{
-	case SCHED_SJF:
-	  if (!process)
-	    {
-	      int i;
-	      int shortest;
-
-	      shortest = SERVICE_TIME_MAX + 1;
-	      for (i = 0; i < queue_len; i++)
-		if (queue[i]->service_time < shortest)
-		  {
-		    process = queue[i];
-		    shortest = process->service_time;
-		  }
-	    }
-	  break;
-	case SCHED_SRT:
-	  {
-	    int i;
-	    int shortest;
-
-	    shortest = SERVICE_TIME_MAX + 1;
-	    for (i = 0; i < queue_len; i++)
-	      if (queue[i]->remain_time < shortest)
-		    {
-		         process = queue[i];
-		         shortest = process->remain_time;
-		    }
-	  }
-	  break;
-	case SCHED_RR:
-	  {
-	    int i;
+	  int       i;
+	  long long shortest;
 
-	    process = queue[0];
-	    for (i = 0; i < (queue_len - 1); i++)
+	  shortest = LLONG_MAX;
+	  for (i = 0; i < queue_len; i++)
+	    if (queue[i]->service_time < shortest)
 	      {
-		queue[i] = queue[i + 1];
-		queue[i]->queue_idx = i;
+		process = queue[i];
+		shortest = process->service_time;
 	      }
-	    queue[i] = process;
+	}
+      break;
+    case SCHED_SRT:
+      {
+	int       i;
+	long long shortest;
+
+	shortest = LLONG_MAX;
+	for (i = 0; i < queue_len; i++)
+	  if (queue[i]->remain_time < shortest)
+		{
+		     process = queue[i];
+		     shortest = process->remain_time;
+		}
+      }
+      break;
+    case SCHED_RR:
+      {
+	int i;
+
+	/* an empty queue has the last process left in it. */
+	if (!queue_len)
+	  return NULL;
+
+	process = queue[0];
+	for (i = 0; i < (queue_len - 1); i++)
+	  {
+	    queue[i] = queue[i + 1];
 	    queue[i]->queue_idx = i;
 	  }
-	  break;
-	case SCHED_PR:
-	  /* TO BE IMPLEMENTED */
+	queue[i] = process;
+	queue[i]->queue_idx = i;
+      }
+      break;
+    case SCHED_PR:
+      /* TO BE IMPLEMENTED */
 
 /*================================Edit Code========================================*/
     {
@@ -330,7 +316,7 @@ simulate (int sched)
         int i;
         int highest; //현재 가장 높은 우선 순위를 저장
 
-        highest = 10; // 처음 들어오는 프로세스를 실행시키기 위해 우선순위를 가장 낮은 10으로 초기화
+        highest = PRIORITY_MAX + 1; // 우선순위가 가장 낮은 10인 프로세스도 실행시키기 위해 그보다 1 크게 초기화
 
         for(i = 0 ; i < queue_len ; i++){ // 모든 프로세스가 들어올 때까지 반복
             if(queue[i]->priority < highest){ // 도착한 프로세스의 우선순위가 현재 진행중인 프로세스의 우선순위보다 높은지 확인
@@ -341,15 +327,69 @@ simulate (int sched)
     }
 
 /*================================Edit Code========================================*/
+      break;
+    }
 
-	  break;
-	default:
-	  MSG ("invalid scheduing algorithm '%d', ignored\n", sched);
-	  return;
+  return process;
+}
+
+static void
+complete_process (Process   *process,
+		  long long  time)
+{
+  int i;
+
+  for (i = process->queue_idx; i < (queue_len - 1); i++)
+    {
+      queue[i] = queue[i + 1];
+      queue[i]->queue_idx = i;
+    }
+  queue_len--;
+
+  process->complete_time = time;
+  process->turnaround_time =
+    process->complete_time - process->arrive_time;
+  process->wait_time =
+    process->turnaround_time - process->service_time;
+}
+
+/* the chart has room for the times of the assignment only. */
+static void
+mark_schedule (Process   *process,
+	       long long  from,
+	       long long  to)
+{
+  for (; from < to && from < SLOT_MAX; from++)
+    schedule[process->idx][from] = 1;
+}
+
+/* -t, one step per time unit, returns the cpu time. */
+static long long
+run_ticks (int sched)
+{
+  Process  *process;
+  int       p;
+  int       p_done;
+  long long cpu_time; //스케줄링 할 프로세스가 없을 때까지 걸리는 시간
+
+  p = 0;
+  p_done = 0;
+  process = NULL;
+
+  for (cpu_time = 0; p_done < process_total; cpu_time++)
+    {
+      /* Insert arrived process into the queue. */
+      for (; p < process_total; p++)
+	{
+	  if (processes[p].arrive_time != cpu_time)
+	    break;
+	  arrive_process (&processes[p]);
 	}
 
+      process = pick_process (sched, process);
+
       if (0)
-	MSG ("[%02d] %s[%d:%d] %d/%d\n",
+	MSG ("[%02lld] %s[%d:%d] %lld/%lld\n",
 	     cpu_time,
 	     process->id,
 	     process->idx,
@@ -361,30 +401,277 @@ simulate (int sched)
       if (!process)
 	continue;
 
-      schedule[process->idx][cpu_time] = 1;
+      mark_schedule (process, cpu_time, cpu_time + 1);
       process->remain_time--;
       if (process->remain_time <= 0)
 	{
-	  int i;
+	  complete_process (process, cpu_time + 1);
+	  process = NULL;
+	  p_done++;
+	}
+    }
+
+  return cpu_time;
+}
+
+/*
+ * Event queue.
+ *
+ * The event engine runs from one arrival or completion to the next, so
+ * its cost grows with the number of processes instead of the cpu time.
+ * Arrivals are in the heap from the start, and each dispatch adds the
+ * completion it leads to; an earlier one for a process that was
+ * preempted since has an old 'seq' and is dropped.
+ */
+enum
+{
+  EVENT_ARRIVE = 0,
+  EVENT_COMPLETE
+};
+
+typedef struct _Event Event;
+struct _Event
+{
+  long long time;
+  int       type;
+  int       idx;       /* of the process, arrivals go in file order */
+  int       seq;       /* of the dispatch */
+};
+
+/* the arrivals, and a completion per arrival or completion at most. */
+#define EVENT_MAX (PROCESS_MAX * 3 + 1)
 
-	  for (i = process->queue_idx; i < (queue_len - 1); i++)
+static Event events[EVENT_MAX];
+static int   events_len;
+
+static int
+event_before (const Event *a,
+	      const Event *b)
+{
+  if (a->time != b->time)
+    return a->time < b->time;
+  if (a->type != b->type)
+    return a->type < b->type;
+
+  return a->idx < b->idx;
+}
+
+static void
+push_event (long long time,
+	    int       type,
+	    int       idx,
+	    int       seq)
+{
+  Event ev;
+  int   i;
+
+  ev.time = time;
+  ev.type = type;
+  ev.idx = idx;
+  ev.seq = seq;
+
+  for (i = events_len++; i > 0; i = (i - 1) / 2)
+    {
+      if (!event_before (&ev, &events[(i - 1) / 2]))
+	break;
+      events[i] = events[(i - 1) / 2];
+    }
+  events[i] = ev;
+}
+
+static Event
+pop_event (void)
+{
+  Event top;
+  Event last;
+  int   i;
+
+  top = events[0];
+  last = events[--events_len];
+  for (i = 0; i * 2 + 1 < events_len; )
+    {
+      int child;
+
+      child = i * 2 + 1;
+      if (child + 1 < events_len
+	  && event_before (&events[child + 1], &events[child]))
+	child++;
+      if (!event_before (&events[child], &last))
+	break;
+      events[i] = events[child];
+      i = child;
+    }
+  events[i] = last;
+
+  return top;
+}
+
+/*
+ * The time units of RR from 'from' to 'to', in which the queue goes
+ * round with a quantum of one and nothing arrives.  Whole rounds are
+ * added up at once; only the last unit may complete a process, which is
+ * then at the end of the queue.
+ */
+static void
+run_rounds (long long from,
+	    long long to)
+{
+  Process  *rotated[PROCESS_MAX];
+  long long n;
+  long long rounds;
+  int       rest;
+  int       i;
+
+  if (!queue_len || from >= to)
+    return;
+
+  n = to - from;
+  rounds = n / queue_len;
+  rest = n % queue_len;
+  for (i = 0; from + i < to && from + i < SLOT_MAX; i++)
+    mark_schedule (queue[i % queue_len], from + i, from + i + 1);
+  for (i = 0; i < queue_len; i++)
+    {
+      queue[i]->remain_time -= rounds + (i < rest);
+      rotated[i] = queue[(i + rest) % queue_len];
+    }
+  for (i = 0; i < queue_len; i++)
+    {
+      queue[i] = rotated[i];
+      queue[i]->queue_idx = i;
+    }
+
+  if (queue[queue_len - 1]->remain_time <= 0)
+    complete_process (queue[queue_len - 1], to);
+}
+
+/* when the first process in the queue of RR completes. */
+static long long
+next_round_completion (long long now)
+{
+  long long first;
+  int       i;
+
+  first = LLONG_MAX;
+  for (i = 0; i < queue_len; i++)
+    {
+      long long time;
+
+      time = now + (queue[i]->remain_time - 1) * queue_len + i + 1;
+      if (time < first)
+	first = time;
+    }
+
+  return first;
+}
+
+/* the event engine, with the same result as run_ticks(). */
+static long long
+run_events (int sched)
+{
+  Process  *process;
+  long long now;
+  int       p_done;
+  int       seq;
+  int       p;
+
+  events_len = 0;
+  for (p = 0; p < process_total; p++)
+    push_event (processes[p].arrive_time, EVENT_ARRIVE, p, 0);
+
+  p_done = 0;
+  seq = 0;
+  now = 0;
+  process = NULL;
+
+  while (p_done < process_total && events_len > 0)
+    {
+      Event     ev;
+      long long start;
+      int       done;
+
+      ev = pop_event ();
+      if (ev.type == EVENT_COMPLETE && ev.seq != seq)
+	continue;
+
+      /* what ran since the last event. */
+      start = now;
+      now = ev.time;
+      done = queue_len;
+      if (sched == SCHED_RR)
+	run_rounds (start, now);
+      else if (process)
+	{
+	  mark_schedule (process, start, now);
+	  process->remain_time -= now - start;
+	  if (process->remain_time <= 0)
 	    {
-	      queue[i] = queue[i + 1];
-	      queue[i]->queue_idx = i;
+	      complete_process (process, now);
+	      process = NULL;
 	    }
-	  queue_len--;
+	}
+      p_done += done - queue_len;
 
-	  process->complete_time = cpu_time + 1;
-	  process->turnaround_time =
-	    process->complete_time - process->arrive_time;
-	  process->wait_time =
-	    process->turnaround_time - process->service_time;
+      /* completions come first, then the arrivals in file order. */
+      for (;;)
+	{
+	  if (ev.type == EVENT_ARRIVE)
+	    arrive_process (&processes[ev.idx]);
+	  if (!events_len || events[0].time != now)
+	    break;
+	  ev = pop_event ();
+	}
 
-	  process = NULL;
-	  p_done++;
+      seq++;
+      if (sched == SCHED_RR)
+	{
+	  if (queue_len > 0)
+	    push_event (next_round_completion (now), EVENT_COMPLETE, 0, seq);
+	}
+      else
+	{
+	  process = pick_process (sched, process);
+	  if (process)
+	    push_event (now + process->remain_time, EVENT_COMPLETE,
+			process->idx, seq);
 	}
     }
 
+  return now;
+}
+
+static void
+simulate (int sched,
+	  int ticks)
+{
+  long long cpu_time;
+  int       p;
+  long long sum_turnaround_time; // 프로세스 완료시간 합계
+  long long sum_waiting_time; // 프로세스 대기 시간 합계
+  double    avg_turnaround_time; // 평균
+  double    avg_waiting_time; // 평균
+
+  if (sched < 0 || SCHED_MAX <= sched)
+    {
+      MSG ("invalid scheduing algorithm '%d', ignored\n", sched);
+      return;
+    }
+
+  for (p = 0; p < PROCESS_MAX; p++)
+    {
+      int slot;
+
+      for (slot = 0; slot < SLOT_MAX; slot++)
+	 schedule[p][slot] = 0;
+      queue[p] = NULL;
+    }
+  queue_len = 0;
+
+  if (ticks)
+    cpu_time = run_ticks (sched);
+  else
+    cpu_time = run_events (sched);
+
   printf ("\n[%s]\n",
 	  sched == SCHED_SJF ? "SJF" :
 	  sched == SCHED_SRT ? "SRT" :
@@ -397,19 +684,27 @@ simulate (int sched)
     {
       int slot;
 
-      printf ("%s ", processes[p].id);
-      for (slot = 0; slot <= cpu_time; slot++)
-	putchar (schedule[p][slot] ? '*' : ' ');
-      printf ("\n");
+      /* too long for a chart, the times of each process instead. */
+      if (cpu_time >= SLOT_MAX)
+	printf ("%s %lld %lld %lld\n", processes[p].id,
+		processes[p].complete_time, processes[p].turnaround_time,
+		processes[p].wait_time);
+      else
+	{
+	  printf ("%s ", processes[p].id);
+	  for (slot = 0; slot <= cpu_time; slot++)
+	    putchar (schedule[p][slot] ? '*' : ' ');
+	  printf ("\n");
+	}
 
       sum_turnaround_time += processes[p].turnaround_time;
       sum_waiting_time += processes[p].wait_time;
     }
 
-  avg_turnaround_time = (float) sum_turnaround_time / (float) process_total;
-  avg_waiting_time = (float) sum_waiting_time / (float) process_total;
+  avg_turnaround_time = (double) sum_turnaround_time / (double) process_total;
+  avg_waiting_time = (double) sum_waiting_time / (double) process_total;
 
-  printf ("CPU TIME: %d\n", cpu_time);
+  printf ("CPU TIME: %lld\n", cpu_time);
   printf ("AVERAGE TURNAROUND TIME: %.2f\n", avg_turnaround_time);
   printf ("AVERAGE WAITING TIME: %.2f\n", avg_waiting_time);
 }
@@ -419,21 +714,45 @@ main (int    argc,
       char **argv)
 {
   int sched;
+  int ticks = 0;
 
-  if (argc <= 1)
-    {
-      MSG ("usage: %s input-file\n", argv[0]);
-      return -1;
-    }
+  {
+    int opt;
+
+    while ((opt = getopt (argc, argv, "tl")) != -1)
+      {
+	switch (opt)
+	  {
+	  case 't':
+	    ticks = 1;
+	    break;
+	  case 'l':
+	    arrive_time_max = TIME_MAX;
+	    service_time_max = TIME_MAX;
+	    break;
+	  default:
+	    optind = -1;
+	    break;
+	  }
+	if (optind < 0)
+	  break;
+      }
+
+    if (optind < 0 || optind >= argc)
+      {
+	MSG ("usage: %s [-t] [-l] input-file\n", argv[0]);
+	return -1;
+      }
+  }
 
-  if (read_config (argv[1]))
+  if (read_config (argv[optind]))
     {
-      MSG ("failed to load config file '%s': %s\n", argv[1], STRERROR);
+      MSG ("failed to load config file '%s': %s\n", argv[optind], STRERROR);
       return -1;
     }
 
   for (sched = 0; sched < SCHED_MAX; sched++)
-    simulate (sched);
+    simulate (sched, ticks);
 
   return 0;
 }